@@ -2,6 +2,15 @@
 
 #include "modules/Starter.hpp"
 #include "modules/TextMaker.hpp"
+#include "modules/Denoiser.hpp"
+#include "modules/Sampler.hpp"
+#include "modules/Bsdf.hpp"
+#include "modules/RayBVH.hpp"
+#include "modules/RayScene.hpp"
+#include "modules/CpuRayTracer.hpp"
+#include "modules/RenderOptions.hpp"
+#include "modules/Benchmark.hpp"
+#include "modules/GpuProfiler.hpp"
 
 #define n_objects 7
 
@@ -43,6 +52,22 @@ struct VertexSpheres {
 	glm::vec2 UV;
 };
 
+//One sphere of the instanced draw, read by SphereShader.vert and .frag (std430)
+struct SphereInstance {
+	alignas(16) glm::mat4 mMat;
+	alignas(16) glm::mat4 nMat;
+	alignas(4) int material; //index in the material table
+	alignas(4) int textureLayer; //layer of the sphere texture array
+};
+
+//Shading of a sphere: clamp(texture * textureScale + tint), or lit by a spot with albedo tint.rgb
+struct SphereMaterial {
+	alignas(16) glm::vec4 tint;
+	alignas(4) float textureScale;
+	alignas(4) int room; //room where the sphere is visible, compared with currRoom (box - 3)
+	alignas(4) int light; //spot lighting the sphere, -1 unlit
+};
+
 //Vertex for the mirrors in the third room
 struct VertexMirrors {
 	glm::vec3 pos;
@@ -58,11 +83,37 @@ struct UniformBufferObject {
 	alignas(16) glm::mat4 invViewMatrix;
 	alignas(16) glm::mat4 invProjectionMatrix;
 	alignas(16) int currBox;
+	int firstObject; //range of the current box in the scene storage buffer
+	int objectCount;
+	int rootNode; //BVH of the current box, -1 if it has none
+	int firstTriangle; //range of the current box in the triangle storage buffer
+	int triangleCount;
+	int firstLight; //lights of the current box, sampled directly at the diffuse hits
+	int lightCount; //0 disables the light sampling
+	alignas(16) glm::mat4 prevViewProjMatrix; //camera of the previous frame, for the reprojection
+	alignas(16) glm::vec3 prevCameraPos;
 };
 
 //Used for progressive rendering
 struct GlobalUniformBufferObject {
 	alignas(16) int numberOfSamples;
+	float convergenceThreshold; //adaptive sampling, 0 disables it
+	int minSamples;
+	int reproject; //the camera moved: the samples of the previous frame are reprojected
+	int maxHistory; //samples kept by the reprojection
+	int rouletteDepth; //first bounce that Russian roulette can end, the maximum depth disables it
+	int samplerType; //cpurt::SamplerType
+};
+
+//One iteration of the denoiser, see shaders/Denoise.comp
+struct DenoiseUniformBufferObject {
+	alignas(16) int stepWidth;
+	int accumLayer; //layer of Accum written by the tracer in this frame
+	float sigmaColor;
+	float sigmaNormal;
+	float sigmaDepth;
+	float sigmaAlbedo;
+	float noiseScale;
 };
 
 //Vertex struct to pass to the vertex shader
@@ -70,17 +121,71 @@ struct Vertex {
 	glm::vec3 pos;
 };
 
+//Layout of the sphere vertices, also used to read models/Sphere.obj for the headless renderer
+void initSphereVertexDescriptor(BaseProject* bp, VertexDescriptor& VDSpheres) {
+	VDSpheres.init(bp, {
+			  {0, sizeof(VertexSpheres), VK_VERTEX_INPUT_RATE_VERTEX}
+		}, {
+		  {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSpheres, pos), sizeof(glm::vec3), POSITION},
+		  {0, 1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSpheres, norm), sizeof(glm::vec3), NORMAL},
+		  {0, 2, VK_FORMAT_R32G32_SFLOAT, offsetof(VertexSpheres, UV), sizeof(glm::vec2), UV}
+		});
+}
+
+//Camera matrices shared by the application and the headless renderer
+glm::mat4 cameraProjection(float Ar) {
+	glm::mat4 M = glm::perspective(glm::radians(45.0f), Ar, 0.1f, 50.0f);
+	M[1][1] *= -1;
+	return M;
+}
+
+glm::mat4 cameraView(glm::vec3 CamPos, float CamAlpha, float CamBeta) {
+	return glm::rotate(glm::mat4(1.0), -CamBeta, glm::vec3(1, 0, 0)) *
+		glm::rotate(glm::mat4(1.0), -CamAlpha, glm::vec3(0, 1, 0)) *
+		glm::translate(glm::mat4(1.0), -CamPos);
+}
+
 
 /////////////////////////////////////////////////////////////
 ///						MAIN							  ///
 /////////////////////////////////////////////////////////////
 class App : public BaseProject {
+public:
+	// Applies the command line options, before run()
+	void setOptions(const RenderOptions& O) {
+		denoise = O.denoise && !O.fragmentTracing; //the fragment tracer is not denoised
+		denoiseSettings.iterations = O.denoiseIterations;
+		options = O;
+		traceWidth = O.width;
+		traceHeight = O.height;
+		computeTracing = !O.fragmentTracing;
+		meshSpheres = O.meshSpheres;
+		currentBox = O.box;
+		renderMode = O.mode;
+		pipelineCacheFile = O.pipelineCache;
+		uncappedPresent = !O.benchmark.empty(); //frame times not paced by the display
+		for (int i = 0; i < 6; i++) {
+			if (nextBox(i) == O.box) counter = i;
+		}
+		CamPos = O.camPos;
+		CamAlpha = glm::radians(O.camAlpha);
+		CamBeta = glm::radians(O.camBeta);
+	}
+
 protected:
+	RenderOptions options;
+	uint32_t lastImage = 0; //swap chain image of the previous frame, saved in batch mode
+
+	// Benchmark: one run per box, filled frame by frame by benchmarkStep()
+	std::vector<BenchmarkRun> benchmarkRuns;
+	int benchmarkFrame = 0; //frames submitted for the box of the last run, warmup included
+	bool benchmarkDone = false;
+	std::map<uint64_t, int> benchmarkGpuFrames; //GpuProfiler frame -> run it is measured for, until its timing arrives
 	
 	///////////		GP DLS,DS,Pipeline,Models,Textures	///////////
 	// Descriptor Layouts
 	DescriptorSetLayout DSLGlobalTransform;	
-	DescriptorSetLayout DSLSphereTransform;	
+	DescriptorSetLayout DSLspheres;	
 	DescriptorSetLayout DSLlight;
 
 	// Vertex formats
@@ -90,16 +195,17 @@ protected:
 
 	// Pipelines [Shader couples]
 	Pipeline Prooms, Pmirrors;
-	Pipeline Psphere1,Psphere2,Psphere3,Psphere4,Psphere5,Psphere6,Psphere7;
+	Pipeline Pspheres; //all the spheres, in a single instanced draw
 
 	// Models, textures and Descriptor Sets (values assigned to the uniforms)
 	Model Room1, Room2, Room3, Light1, Light2, MirrorL, MirrorR;
-	Model S[n_objects];
-	Texture T[n_objects];
+	Model Msphere;
+	Texture Tspheres; //one layer per sphere
+	StorageBuffer SBsphereInstances, SBsphereMaterials;
 	Texture TM;
 
 	DescriptorSet DSLight,DSGlobalGP;
-	DescriptorSet DSSphere[n_objects]; 
+	DescriptorSet DSspheres; 
 
 	///////////	  RAY DLS,DS,Pipeline,Models,Textures	///////////
 	// Descriptor Layouts
@@ -111,13 +217,45 @@ protected:
 
 	// Pipelines [Shader couples]
 	Pipeline Pray;
+	ComputePipeline PrayCompute;
+
+	// Every render mode is a variant of the ray tracing pipelines, specialized with rayConstants()
+	PipelineVariants<Pipeline> PrayVariants;
+	PipelineVariants<ComputePipeline> PrayComputeVariants;
+	RenderMode renderMode = RENDER_INTERACTIVE; //cycled with M
+	bool pressedMode = false;
 
 	// Models, textures and Descriptor Sets (values assigned to the uniforms)
 	Model Mtri;
-	Texture Timage; //Previous frame texture
+	Texture Accum; //Ping-pong accumulation images: layers 0-1 sum of the samples in rgb and their count in alpha, layers 2-3 sum of the squared luminances
+	Texture TraceOut; //Average written by the compute tracer, blitted to the swap chain
+	Texture Features; //First hit AOVs written by the tracers, ping-pong as Accum: layers 2k albedo and depth, 2k+1 normal
 
 	DescriptorSet DSray, DSGlobal;
 
+	// Edge-aware à-trous denoiser after the compute tracer: the iterations swap TraceOut and DenoiseTmp,
+	// each one has its own descriptor set for its step width
+	DescriptorSetLayout DSLdenoise;
+	ComputePipeline Pdenoise;
+	Texture DenoiseTmp;
+	DescriptorSet DSdenoise[DENOISER_MAX_ITERATIONS];
+	DenoiseSettings denoiseSettings;
+	bool denoise = false; //toggled with N
+	bool pressedDenoise = false;
+
+	// Scene of the ray tracer and its BVH, uploaded once in storage buffers
+	RayScene Scene;
+	StorageBuffer SBmaterials, SBgeometries, SBnodes, SBprimRefs, SBmeshVertices, SBtriangles, SBlights;
+	bool meshSpheres = false; //trace the spheres as the triangles of models/Sphere.obj
+
+	// The compute tracer renders at its own resolution, the blit scales it to the window
+	bool computeTracing = true; //false: fragment shader on the full screen quad
+	int traceWidth = 1024;
+	int traceHeight = 512;
+
+	// GPU time of every pass, read back when a swap chain image is used again
+	GpuProfiler Profiler;
+
 	///////////	  Other parameters	///////////
 	int numberOfSamples = -1; //for progressive rendering
 	int counter = 0; //used to alternate between rooms
@@ -129,9 +267,8 @@ protected:
 	float CamAlpha = glm::radians(-75.0f);
 	float CamBeta = glm::radians(-10.0f);
 	float Ar;
-
-	//Translation matrices for the spheres
-	glm::mat4 Tpre[n_objects];
+	glm::mat4 prevViewPrj = glm::mat4(1.0f); //camera of the last frame submitted, for the reprojection
+	glm::vec3 prevCamPos = glm::vec3(0.0f);
 
 	//-----------------------------------------------------------
 	//------------------------- METHODS -------------------------
@@ -480,15 +617,13 @@ protected:
 		//									Spheres									  //
 		////////////////////////////////////////////////////////////////////////////////
 
-		for(int i = 0; i < n_objects; i++) {
-			S[i].init(this, &VDSpheres, "models/Sphere.obj", OBJ);
-		}
+		Msphere.init(this, &VDSpheres, "models/Sphere.obj", OBJ);
 	}
 
 	/* Main application parameters */
 	void setWindowParameters() {
-		windowWidth = 1024;
-		windowHeight = 512;
+		windowWidth = options.width;
+		windowHeight = options.height;
 		windowTitle = "GraphicsProject";
 		windowResizable = GLFW_TRUE;
 		initialBackgroundColor = {0.0f,0.0f,0.0f,1.0f};
@@ -504,10 +639,19 @@ protected:
 
 	/* Load and setup all your Vulkan Models and Texutures. Create your Descriptor set layouts and load the shaders for the pipelines */
 	void localInit() {
+		Profiler.init(this, options.pipelineStatistics);
+		if (!options.gpuProfile.empty()) {
+			Profiler.openLog(options.gpuProfile);
+		}
+		if (!options.benchmark.empty()) {
+			Profiler.onFrame = [this](const GpuFrameTiming& F) { benchmarkGpuFrame(F); };
+		}
+
 		///////////	  DSL GP init	///////////
-		DSLSphereTransform.init(this, {
-					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, sizeof(TransformUniformBufferObject), 1}, //WVP matrix with translation for the specific sphere
-					{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0, 1},
+		DSLspheres.init(this, {
+					{0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, 1}, //Transform and material of every sphere
+					{1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 1, 1}, //Material table
+					{2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0, 1}, //Texture array of the spheres
 			});
 		DSLGlobalTransform.init(this, {
 					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, sizeof(TransformUniformBufferObject), 1},
@@ -519,11 +663,27 @@ protected:
 
 		///////////	 DSL Ray init	///////////
 		DSLglobal.init(this, {
-					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, sizeof(GlobalUniformBufferObject), 1},
-					{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 0, 1} //Previous frame texture
+					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT, sizeof(GlobalUniformBufferObject), 1},
+					{1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 0, 1}, //Accumulation images
+					{2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1, 1}, //Output of the compute tracer
+					{3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 2, 1} //AOVs of the denoiser
+			});
+		DSLdenoise.init(this, {
+					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, sizeof(DenoiseUniformBufferObject), 1},
+					{1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0, 1}, //Input of the iteration
+					{2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1, 1}, //Output of the iteration
+					{3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 2, 1}, //Accumulation images, for the noise
+					{4, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 3, 1} //AOVs
 			});
 		DSLray.init(this, {
-					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, sizeof(UniformBufferObject), 1},
+					{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT, sizeof(UniformBufferObject), 1},
+					{1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 0, 1}, //Material table
+					{2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 1, 1}, //Geometries of all the boxes
+					{3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 2, 1}, //BVH nodes
+					{4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 3, 1}, //BVH primitive references
+					{5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 4, 1}, //Mesh vertices
+					{6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 5, 1}, //Mesh triangles
+					{7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT, 6, 1}  //Lights sampled directly
 			});
 
 
@@ -537,13 +697,7 @@ protected:
 			  {0, 3, VK_FORMAT_R32G32_SFLOAT, offsetof(VertexRooms, room), sizeof(glm::vec2), UV}
 			});
 
-		VDSpheres.init(this, {
-				  {0, sizeof(VertexSpheres), VK_VERTEX_INPUT_RATE_VERTEX}
-			}, {
-			  {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSpheres, pos), sizeof(glm::vec3), POSITION},
-			  {0, 1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexSpheres, norm), sizeof(glm::vec3), NORMAL},
-			  {0, 2, VK_FORMAT_R32G32_SFLOAT, offsetof(VertexSpheres, UV), sizeof(glm::vec2), UV}
-			});
+		initSphereVertexDescriptor(this, VDSpheres);
 
 		VDMirrors.init(this, {
 				  {0, sizeof(VertexRooms), VK_VERTEX_INPUT_RATE_VERTEX}
@@ -563,25 +717,19 @@ protected:
 		///////////	  Pipeline init	  ///////////
 		Prooms.init(this, &VDRooms, "shaders/RoomShaderVert.spv", "shaders/RoomShaderFrag.spv", { &DSLGlobalTransform, &DSLlight });
 		Prooms.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere1.init(this, &VDSpheres, "shaders/SphereShader1Vert.spv", "shaders/SphereShader1Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere1.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere2.init(this, &VDSpheres, "shaders/SphereShader2Vert.spv", "shaders/SphereShader2Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere2.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere3.init(this, &VDSpheres, "shaders/SphereShader3Vert.spv", "shaders/SphereShader3Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere3.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere4.init(this, &VDSpheres, "shaders/SphereShader4Vert.spv", "shaders/SphereShader4Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere4.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere5.init(this, &VDSpheres, "shaders/SphereShader5Vert.spv", "shaders/SphereShader5Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere5.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere6.init(this, &VDSpheres, "shaders/SphereShader6Vert.spv", "shaders/SphereShader6Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere6.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
-		Psphere7.init(this, &VDSpheres, "shaders/SphereShader7Vert.spv", "shaders/SphereShader7Frag.spv", { &DSLSphereTransform, &DSLlight });
-		Psphere7.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
+		Pspheres.init(this, &VDSpheres, "shaders/SphereShaderVert.spv", "shaders/SphereShaderFrag.spv", { &DSLGlobalTransform, &DSLlight, &DSLspheres });
+		Pspheres.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
 		Pmirrors.init(this, &VDMirrors, "shaders/MirrorsShaderVert.spv", "shaders/MirrorsShaderFrag.spv", { &DSLGlobalTransform, &DSLlight });
 		Pmirrors.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
 		
 		Pray.init(this, &VD, "shaders/RayShaderVert.spv", "shaders/RayShaderFrag.spv", { &DSLglobal, &DSLray });
 		Pray.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
+		PrayVariants.init(&Pray);
+		if (computeTracing) {
+			PrayCompute.init(this, "shaders/RayShaderComp.spv", { &DSLglobal, &DSLray });
+			PrayComputeVariants.init(&PrayCompute);
+			Pdenoise.init(this, "shaders/DenoiseComp.spv", { &DSLdenoise });
+		}
 
 
 		///////////	  Models init	///////////
@@ -607,31 +755,68 @@ protected:
 
 		
 		///////////	  Textures init	  ///////////
+		std::string sphereTextures[n_objects];
 		for(int i = 0; i < n_objects; i++) {
-			const char* path = ("textures/sphere" + std::to_string(i+1) + ".jpg").c_str();
-			T[i].init(this, path);
+			sphereTextures[i] = "textures/sphere" + std::to_string(i+1) + ".jpg";
 		}
+		Tspheres.initArray(this, sphereTextures, n_objects);
 		TM.init(this, "textures/Mirror.png");
 
-		Timage.init(this, "textures/background.png");
+		///////////	  Ray tracing scene	  ///////////
+		//the spheres share the vertices of their raster models
+		RayMeshSource sphereMesh = {&Msphere.vertices, &Msphere.indices, sizeof(VertexSpheres),
+									VDSpheres.Position.offset, VDSpheres.Normal.offset, 1.5f};
+		Scene = RayScene::cornellBoxes(meshSpheres ? &sphereMesh : nullptr);
+		SBmaterials.init(this, Scene.materials.data(), Scene.materials.size() * sizeof(RayMaterial));
+		SBgeometries.init(this, Scene.geometries.data(), Scene.geometries.size() * sizeof(RayGeometry));
+		SBnodes.init(this, Scene.nodes.data(), Scene.nodes.size() * sizeof(BVHNode));
+		SBprimRefs.init(this, Scene.primRefs.data(), Scene.primRefs.size() * sizeof(uint32_t));
+		SBmeshVertices.init(this, Scene.meshVertices.data(), Scene.meshVertices.size() * sizeof(RayMeshVertex));
+		SBtriangles.init(this, Scene.triangles.data(), Scene.triangles.size() * sizeof(RayTriangle));
+		SBlights.init(this, Scene.lights.data(), Scene.lights.size() * sizeof(uint32_t));
 		
 
-		///////////	  Translation mat for spheres  ///////////
-		Tpre[0] = glm::translate(glm::mat4(1.0f),glm::vec3(7.0f, 1.5f, 2.5f));
-		Tpre[1] = glm::translate(glm::mat4(1.0f),glm::vec3(7.0f, 1.5f, 7.5f));
-		Tpre[2] = glm::translate(glm::mat4(1.0f),glm::vec3(7.0f, 1.5f, 14.5f));
-		Tpre[3] = glm::translate(glm::mat4(1.0f),glm::vec3(7.0f, 1.5f, 19.5f));
-		Tpre[4] = glm::translate(glm::mat4(1.0f),glm::vec3(3.0f, 1.5f, 17.0f));
-		Tpre[5] = glm::translate(glm::mat4(1.0f),glm::vec3(5.0f, 7.0f, 29.0f));
-		Tpre[6] = glm::translate(glm::mat4(1.0f),glm::vec3(5.0f, 2.64f, 29.0f));
+		///////////	  Sphere instances  ///////////
+		//the spheres do not move: their transforms are uploaded once, the scene transform
+		//of the rooms is applied on top of them by the vertex shader
+		glm::vec3 spherePos[n_objects] = {
+			glm::vec3(7.0f, 1.5f, 2.5f),
+			glm::vec3(7.0f, 1.5f, 7.5f),
+			glm::vec3(7.0f, 1.5f, 14.5f),
+			glm::vec3(7.0f, 1.5f, 19.5f),
+			glm::vec3(3.0f, 1.5f, 17.0f),
+			glm::vec3(5.0f, 7.0f, 29.0f),
+			glm::vec3(5.0f, 2.64f, 29.0f)
+		};
+		SphereMaterial sphereMaterials[n_objects] = {
+			{glm::vec4(0.0f), 1.0f, 0, -1},
+			{glm::vec4(0.3f, 0.0f, 0.0f, 0.3f), 2.0f, 0, -1},
+			{glm::vec4(0.0f, 1.0f, 0.0f, 1.0f), 0.0f, 1, 1}, //green, lit by the spot of the second box
+			{glm::vec4(1.0f, 0.0f, 0.0f, 1.0f), 0.0f, 1, 1}, //red
+			{glm::vec4(0.0f), 0.25f, 1, -1},
+			{glm::vec4(1.0f), 0.0f, 2, -1}, //the light of the third box
+			{glm::vec4(0.062f, 0.05f, 0.015f, 0.1f), 0.5f, 2, -1}
+		};
+		SphereInstance sphereInstances[n_objects];
+		for(int i = 0; i < n_objects; i++) {
+			sphereInstances[i].mMat = glm::translate(glm::mat4(1.0f), spherePos[i]);
+			sphereInstances[i].nMat = glm::inverse(glm::transpose(sphereInstances[i].mMat));
+			sphereInstances[i].material = i;
+			sphereInstances[i].textureLayer = i;
+		}
+		SBsphereInstances.init(this, sphereInstances, sizeof(sphereInstances));
+		SBsphereMaterials.init(this, sphereMaterials, sizeof(sphereMaterials));
 
 
 		// Descriptor pool sizes
 		// WARNING!!!!!!!!
 		// Must be set before initializing the text and the scene
-		DPSZs.uniformBlocksInPool = 2 + n_objects*2 + 2; //2.1.2
-		DPSZs.texturesInPool = n_objects*2 + 1 + 1;
-		DPSZs.setsInPool = 2 + n_objects*2 + 2;
+		int denoiseSets = computeTracing ? denoiseSettings.iterations : 0;
+		DPSZs.uniformBlocksInPool = 2 + 2 + denoiseSets; //2.1.2
+		DPSZs.texturesInPool = 2;
+		DPSZs.storageImagesInPool = 3 + denoiseSets*4;
+		DPSZs.storageBuffersInPool = 7 + 2;
+		DPSZs.setsInPool = 3 + 2 + denoiseSets;
 
 
 		std::cout << "Initializing text\n";
@@ -639,6 +824,8 @@ protected:
 		std::cout << "Initialization completed!\n";
 		std::cout << "Uniform Blocks in the Pool  : " << DPSZs.uniformBlocksInPool << "\n";
 		std::cout << "Textures in the Pool        : " << DPSZs.texturesInPool << "\n";
+		std::cout << "Storage Images in the Pool  : " << DPSZs.storageImagesInPool << "\n";
+		std::cout << "Storage Buffers in the Pool : " << DPSZs.storageBuffersInPool << "\n";
 		std::cout << "Descriptor Sets in the Pool : " << DPSZs.setsInPool << "\n";
 	}
 
@@ -646,57 +833,75 @@ protected:
 	void pipelinesAndDescriptorSetsInit() {
 		// Pipeline 
 		Prooms.create();
-		Psphere1.create();
-		Psphere2.create();
-		Psphere3.create();
-		Psphere4.create();
-		Psphere5.create();
-		Psphere6.create();
-		Psphere7.create();
+		Pspheres.create();
 		Pmirrors.create();
 
-		Pray.create();
-
+		// only the variant of the current mode, the others are created when first selected
+		if (computeTracing) {
+			rayComputePipeline();
+			Pdenoise.create();
+		}
+		else {
+			rayPipeline();
+		}
 
 		// Define the data set
 		DSLight.init(this, &DSLlight, { });
 		DSGlobalGP.init(this, &DSLGlobalTransform, { &TM });
-		for(int i = 0; i < n_objects; i++) {
-			DSSphere[i].init(this, &DSLSphereTransform, {&T[i]});
+		DSspheres.init(this, &DSLspheres, { &Tspheres }, { &SBsphereInstances, &SBsphereMaterials });
+
+		// The fragment tracer accumulates at the size of the swap chain, the compute one at its own size.
+		// Either way a resize restarts the accumulation.
+		int accumWidth = computeTracing ? traceWidth : swapChainExtent.width;
+		int accumHeight = computeTracing ? traceHeight : swapChainExtent.height;
+		Accum.initStorage(this, accumWidth, accumHeight, 4, VK_FORMAT_R32G32B32A32_SFLOAT);
+		TraceOut.initStorage(this, accumWidth, accumHeight, 1, VK_FORMAT_R16G16B16A16_SFLOAT);
+		Features.initStorage(this, accumWidth, accumHeight, 4, VK_FORMAT_R32G32B32A32_SFLOAT);
+		numberOfSamples = 0;
+
+		DSray.init(this, &DSLray, { }, { &SBmaterials, &SBgeometries, &SBnodes, &SBprimRefs, &SBmeshVertices, &SBtriangles, &SBlights });
+		DSGlobal.init(this, &DSLglobal, { &Accum, &TraceOut, &Features });
+
+		if (computeTracing) {
+			DenoiseTmp.initStorage(this, accumWidth, accumHeight, 1, VK_FORMAT_R16G16B16A16_SFLOAT);
+			for (int i = 0; i < denoiseSettings.iterations; i++) {
+				Texture* in = i % 2 == 0 ? &TraceOut : &DenoiseTmp;
+				Texture* out = i % 2 == 0 ? &DenoiseTmp : &TraceOut;
+				DSdenoise[i].init(this, &DSLdenoise, { in, out, &Accum, &Features });
+			}
 		}
-
-		DSray.init(this, &DSLray, { });
-		DSGlobal.init(this, &DSLglobal, { &Timage });
-	}
-
-	Texture getImage() {
-		return Timage;
 	}
 
 	/* Destroy pipelines and Descriptor Sets */
 	void pipelinesAndDescriptorSetsCleanup() {
 		// Cleanup pipelines
 		Prooms.cleanup();
-		Psphere1.cleanup();
-		Psphere2.cleanup();
-		Psphere3.cleanup();
-		Psphere4.cleanup();
-		Psphere5.cleanup();
-		Psphere6.cleanup();
-		Psphere7.cleanup();
+		Pspheres.cleanup();
 		Pmirrors.cleanup();
 
-		Pray.cleanup();
+		PrayVariants.cleanup();
+		if (computeTracing) {
+			PrayComputeVariants.cleanup();
+			Pdenoise.cleanup();
+		}
 
 		// Cleanup Descriptor Sets
 		DSLight.cleanup();
 		DSGlobalGP.cleanup();
-		for(int i = 0; i < n_objects; i++) {
-			DSSphere[i].cleanup();
-		}
+		DSspheres.cleanup();
 
 		DSray.cleanup();
 		DSGlobal.cleanup();
+
+		Accum.cleanup();
+		TraceOut.cleanup();
+		Features.cleanup();
+		if (computeTracing) {
+			for (int i = 0; i < denoiseSettings.iterations; i++) {
+				DSdenoise[i].cleanup();
+			}
+			DenoiseTmp.cleanup();
+		}
 	}
 
 	/* Here you destroy all the Models, Texture, Desc. Set Layouts and Pipelines */
@@ -707,39 +912,230 @@ protected:
 		Room3.cleanup();
 		Light1.cleanup();
 		Light2.cleanup();
-		for(int i = 0; i < n_objects; i++) {
-			S[i].cleanup();
-			T[i].cleanup();
-		}
+		Msphere.cleanup();
+		Tspheres.cleanup();
+		SBsphereInstances.cleanup();
+		SBsphereMaterials.cleanup();
 		MirrorL.cleanup();
 		MirrorR.cleanup();
 		TM.cleanup();
 
 		Mtri.cleanup();
-		Timage.cleanup();
+		SBmaterials.cleanup();
+		SBgeometries.cleanup();
+		SBnodes.cleanup();
+		SBprimRefs.cleanup();
+		SBmeshVertices.cleanup();
+		SBtriangles.cleanup();
+		SBlights.cleanup();
 		
 		// Cleanup Descriptor Set Layouts
 		DSLlight.cleanup();
 		DSLGlobalTransform.cleanup();
-		DSLSphereTransform.cleanup();
+		DSLspheres.cleanup();
 
 		DSLray.cleanup();
 		DSLglobal.cleanup();
+		DSLdenoise.cleanup();
 
 		// Destroy Pipelines
 		Prooms.destroy();
-		Psphere1.destroy();
-		Psphere2.destroy();
-		Psphere3.destroy();
-		Psphere4.destroy();
-		Psphere5.destroy();
-		Psphere6.destroy();
-		Psphere7.destroy();
+		Pspheres.destroy();
 		Pmirrors.destroy();
 
 		Pray.destroy();
+		if (computeTracing) {
+			PrayCompute.destroy();
+			Pdenoise.destroy();
+		}
+
+		Profiler.cleanup();
+	}
+
+
+	/* Commands executed before the render pass */
+	void populatePrePassCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+		Profiler.resetQueries(commandBuffer, currentImage);
+
+		// The ray shader of the previous frame wrote one pair of layers of Accum and read the other one:
+		// both accesses must be finished before this frame swaps their roles.
+		// The same holds for the two pairs of layers of Features, also read by the denoiser.
+		vks_tools_insertImageMemoryBarrier(
+			commandBuffer,
+			Accum.textureImage,
+			VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+			VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 4 });
+		vks_tools_insertImageMemoryBarrier(
+			commandBuffer,
+			Features.textureImage,
+			VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+			VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 4 });
+
+		if (!computeRayMode()) {
+			return;
+		}
+
+		// the blit of the previous frame must have read TraceOut (or DenoiseTmp) before it is written again
+		for (Texture* T : { &TraceOut, &DenoiseTmp }) {
+			vks_tools_insertImageMemoryBarrier(
+				commandBuffer,
+				T->textureImage,
+				VK_ACCESS_TRANSFER_READ_BIT,
+				VK_ACCESS_SHADER_WRITE_BIT,
+				VK_IMAGE_LAYOUT_GENERAL,
+				VK_IMAGE_LAYOUT_GENERAL,
+				VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+		}
+
+		Profiler.beginPass(commandBuffer, currentImage, "PrayCompute");
+		ComputePipeline& P = rayComputePipeline();
+		P.bind(commandBuffer);
+		DSGlobal.bind(commandBuffer, P, 0, currentImage);
+		DSray.bind(commandBuffer, P, 1, currentImage);
+		vkCmdDispatch(commandBuffer, (traceWidth + 7) / 8, (traceHeight + 7) / 8, 1);	// 8x8 workgroups
+		Profiler.endPass(commandBuffer, currentImage);
+
+		if (denoise) {
+			populateDenoiseCommandBuffer(commandBuffer, currentImage);
+		}
+
+		vks_tools_insertImageMemoryBarrier(
+			commandBuffer,
+			presentedImage().textureImage,
+			VK_ACCESS_SHADER_WRITE_BIT,
+			VK_ACCESS_TRANSFER_READ_BIT,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+	}
+
+	/* Iterations of the denoiser on the output of the compute tracer */
+	void populateDenoiseCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+		// the tracer results are read by every iteration
+		VkMemoryBarrier traced{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+		traced.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		traced.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &traced, 0, nullptr, 0, nullptr);
+
+		Profiler.beginPass(commandBuffer, currentImage, "Pdenoise");
+		Pdenoise.bind(commandBuffer);
+		for (int i = 0; i < denoiseSettings.iterations; i++) {
+			if (i > 0) {
+				// the output of the previous iteration is the input of this one, and its input is overwritten
+				VkMemoryBarrier iteration{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+				iteration.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT;
+				iteration.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT;
+				vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					0, 1, &iteration, 0, nullptr, 0, nullptr);
+			}
+			DSdenoise[i].bind(commandBuffer, Pdenoise, 0, currentImage);
+			vkCmdDispatch(commandBuffer, (traceWidth + 7) / 8, (traceHeight + 7) / 8, 1);
+		}
+		Profiler.endPass(commandBuffer, currentImage);
+	}
+
+	// Image blitted to the swap chain: the last iteration of the denoiser writes DenoiseTmp when their number is odd
+	Texture& presentedImage() {
+		return denoise && denoiseSettings.iterations % 2 == 1 ? DenoiseTmp : TraceOut;
+	}
+
+	/* Commands executed after the render pass: present the image of the compute tracer */
+	void populatePostPassCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+		if (!computeRayMode()) {
+			return;
+		}
+		// no render pass was recorded and the blit writes every pixel: the old contents are discarded.
+		// The acquire semaphore waits at the transfer stage, so the transition follows the acquire
+		VkImageSubresourceRange range{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		vks_tools_insertImageMemoryBarrier(
+			commandBuffer,
+			swapChainImages[currentImage],
+			0,
+			VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			range);
+
+		Profiler.beginPass(commandBuffer, currentImage, "Blit", false);
+		VkImageBlit blit{};
+		blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		blit.srcOffsets[1] = { traceWidth, traceHeight, 1 };
+		blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		blit.dstOffsets[1] = { (int32_t)swapChainExtent.width, (int32_t)swapChainExtent.height, 1 };
+		vkCmdBlitImage(commandBuffer,
+			presentedImage().textureImage, VK_IMAGE_LAYOUT_GENERAL,
+			swapChainImages[currentImage], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			1, &blit, VK_FILTER_LINEAR);
+		Profiler.endPass(commandBuffer, currentImage);
+
+		vks_tools_insertImageMemoryBarrier(
+			commandBuffer,
+			swapChainImages[currentImage],
+			VK_ACCESS_TRANSFER_WRITE_BIT,
+			0,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			range);
 	}
 
+	// Boxes 0-2 are path traced, 3-5 rasterized
+	bool rayMode() {
+		return currentBox < 3;
+	}
+
+	bool computeRayMode() {
+		return computeTracing && rayMode();
+	}
+
+	// Values of the specialization constants of RayCommon.glsl for a render mode
+	SpecializationConstants rayConstants(RenderMode mode) {
+		RenderModeSettings settings = options.modeSettings(mode);
+		SpecializationConstants SC;
+		SC.set(0, settings.path.maxDepth);	// MAX_DEPTH
+		SC.set(1, settings.samplesPerFrame);	// RAYS_PER_PIXEL
+		return SC;
+	}
+
+	Pipeline& rayPipeline() {
+		return PrayVariants.get(rayConstants(renderMode));
+	}
+
+	ComputePipeline& rayComputePipeline() {
+		return PrayComputeVariants.get(rayConstants(renderMode));
+	}
+
+	// Every combination of what is recorded has its own command buffers, drawFrame() selects them each frame:
+	// the rasterized boxes share one set, the path traced ones have one per render mode and denoiser state
+	uint32_t commandBufferKey() {
+		if (!rayMode()) {
+			return 0;
+		}
+		return 1 + 2 * renderMode + (computeRayMode() && denoise ? 1 : 0);
+	}
+
+	// The compute tracer blits over the whole swap chain image, the render pass would only clear it
+	bool needsRenderPass() {
+		return !computeRayMode();
+	}
 
 	/* Creation of the command buffer: send to the GPU all the objects you want to draw, with their buffers and textures */
 	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
@@ -749,6 +1145,22 @@ protected:
 			- bind the descriptor sets
 			- draw call
 		*/	
+		// only what the current mode shows is recorded, see commandBufferKey()
+		if (rayMode()) {
+			if (!computeTracing) {
+				Profiler.beginPass(commandBuffer, currentImage, "Pray");
+				Pipeline& P = rayPipeline();
+				P.bind(commandBuffer);
+				Mtri.bind(commandBuffer);
+				DSGlobal.bind(commandBuffer, P, 0, currentImage);	// The Global Descriptor Set (Set 0)
+				DSray.bind(commandBuffer, P, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
+				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Mtri.indices.size()), 1, 0, 0, 0);
+				Profiler.endPass(commandBuffer, currentImage);
+			}
+			return;
+		}
+
+		Profiler.beginPass(commandBuffer, currentImage, "Prooms");
 		Prooms.bind(commandBuffer);
 		DSGlobalGP.bind(commandBuffer, Prooms, 0, currentImage);	// The Global Descriptor Set (Set 0)
 		DSLight.bind(commandBuffer, Prooms, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
@@ -762,49 +1174,18 @@ protected:
 		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Light1.indices.size()), 1, 0, 0, 0);
 		Light2.bind(commandBuffer);
 		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Light2.indices.size()), 1, 0, 0, 0);
+		Profiler.endPass(commandBuffer, currentImage);
 		
-		Psphere1.bind(commandBuffer);
-		DSSphere[0].bind(commandBuffer, Psphere1, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere1, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[0].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[0].indices.size()), 1, 0, 0, 0);
-
-		Psphere2.bind(commandBuffer);
-		DSSphere[1].bind(commandBuffer, Psphere2, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere2, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[1].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[1].indices.size()), 1, 0, 0, 0);
-
-		Psphere3.bind(commandBuffer);
-		DSSphere[2].bind(commandBuffer, Psphere3, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere3, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[2].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[2].indices.size()), 1, 0, 0, 0);
-
-		Psphere4.bind(commandBuffer);
-		DSSphere[3].bind(commandBuffer, Psphere4, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere4, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[3].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[3].indices.size()), 1, 0, 0, 0);
-
-		Psphere5.bind(commandBuffer);
-		DSSphere[4].bind(commandBuffer, Psphere5, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere5, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[4].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[4].indices.size()), 1, 0, 0, 0);
-
-		Psphere6.bind(commandBuffer);
-		DSSphere[5].bind(commandBuffer, Psphere6, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere6, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[5].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[5].indices.size()), 1, 0, 0, 0);
-
-		Psphere7.bind(commandBuffer);
-		DSSphere[6].bind(commandBuffer, Psphere7, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSLight.bind(commandBuffer, Psphere7, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		S[6].bind(commandBuffer);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(S[6].indices.size()), 1, 0, 0, 0);
-
+		Profiler.beginPass(commandBuffer, currentImage, "Pspheres");
+		Pspheres.bind(commandBuffer);
+		DSGlobalGP.bind(commandBuffer, Pspheres, 0, currentImage);	// The Global Descriptor Set (Set 0)
+		DSLight.bind(commandBuffer, Pspheres, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
+		DSspheres.bind(commandBuffer, Pspheres, 2, currentImage);	// Instances, materials and textures of the spheres (Set 2)
+		Msphere.bind(commandBuffer);
+		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Msphere.indices.size()), n_objects, 0, 0, 0);
+		Profiler.endPass(commandBuffer, currentImage);
+
+		Profiler.beginPass(commandBuffer, currentImage, "Pmirrors");
 		Pmirrors.bind(commandBuffer);
 		DSGlobalGP.bind(commandBuffer, Pmirrors, 0, currentImage);	// The Global Descriptor Set (Set 0)
 		DSLight.bind(commandBuffer, Pmirrors, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
@@ -812,14 +1193,87 @@ protected:
 		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(MirrorL.indices.size()), 1, 0, 0, 0);
 		MirrorR.bind(commandBuffer);
 		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(MirrorR.indices.size()), 1, 0, 0, 0);
+		Profiler.endPass(commandBuffer, currentImage);
+	}
+
+
+	// Advances the benchmark by one frame. deltaT is the time of the frame submitted
+	// before this one, so it is recorded for the previous pose once the warmup is over.
+	// The GPU time of a measured frame arrives through the profiler some frames later.
+	void benchmarkStep(float deltaT) {
+		if (benchmarkDone) return;
+		const int frames = options.benchmarkFrames;
+		if (!benchmarkRuns.empty() && benchmarkFrame > BENCHMARK_WARMUP_FRAMES &&
+			benchmarkFrame <= BENCHMARK_WARMUP_FRAMES + frames) {
+			benchmarkRuns.back().frameMs.push_back(deltaT * 1000.0);
+		}
+
+		if (benchmarkRuns.empty() || benchmarkFrame >= BENCHMARK_WARMUP_FRAMES + frames) {
+			int box = static_cast<int>(benchmarkRuns.size());
+			if (box == 6) {
+				// the last timings are read when their swap chain images are used again
+				if (benchmarkGpuFrames.empty() ||
+					benchmarkFrame++ >= BENCHMARK_WARMUP_FRAMES + frames + (int)swapChainImages.size()) {
+					finishBenchmark();
+				}
+				return;
+			}
+			BenchmarkRun run;
+			run.box = box;
+			run.backend = box >= 3 ? "raster" : (computeTracing ? "compute" : "fragment");
+			run.width = box < 3 && computeTracing ? traceWidth : swapChainExtent.width;
+			run.height = box < 3 && computeTracing ? traceHeight : swapChainExtent.height;
+			run.samplesPerFrame = box < 3 ? options.modeSettings(renderMode).samplesPerFrame : 1;
+			benchmarkRuns.push_back(run);
+			currentBox = box;
+			benchmarkFrame = 0;
+		}
 
-		Pray.bind(commandBuffer);
-		Mtri.bind(commandBuffer);
-		DSGlobal.bind(commandBuffer, Pray, 0, currentImage);	// The Global Descriptor Set (Set 0)
-		DSray.bind(commandBuffer, Pray, 1, currentImage);	// The Material and Position Descriptor Set (Set 1)
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Mtri.indices.size()), 1, 0, 0, 0);
+		CameraPose pose = CameraPath::forBox(currentBox).at(std::max(benchmarkFrame - BENCHMARK_WARMUP_FRAMES, 0), frames);
+		CamPos = pose.pos;
+		CamAlpha = pose.alpha;
+		CamBeta = pose.beta;
+		numberOfSamples = 0; //one sample per frame, without history
+		if (benchmarkFrame >= BENCHMARK_WARMUP_FRAMES) {
+			benchmarkGpuFrames[Profiler.nextFrame()] = static_cast<int>(benchmarkRuns.size()) - 1;
+		}
+		benchmarkFrame++;
+	}
+
+	// GPU time of a frame submitted by benchmarkStep(): all the passes of the frame, from the first to the last
+	void benchmarkGpuFrame(const GpuFrameTiming& F) {
+		auto measured = benchmarkGpuFrames.find(F.frame);
+		if (measured == benchmarkGpuFrames.end()) return;
+		benchmarkRuns[measured->second].gpuFrameMs.push_back(F.totalMs);
+		benchmarkGpuFrames.erase(measured);
+	}
+
+	static const char* presentModeName(VkPresentModeKHR mode) {
+		switch (mode) {
+			case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+			case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+			case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+			case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+			default: return "OTHER";
+		}
 	}
 
+	// The rays per sample of the GPU are not counted: they are estimated on the CPU along the same paths
+	void finishBenchmark() {
+		benchmarkDone = true;
+		glm::mat4 M = cameraProjection(Ar);
+		for (BenchmarkRun& run : benchmarkRuns) {
+			if (run.box < 3) {
+				run.raysPerSample = estimateRaysPerSample(Scene, run.box, options.benchmarkFrames, Ar, M,
+														  options.lightSampling, options.modeSettings(renderMode).path);
+			}
+		}
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		writeBenchmarkJSON(options.benchmark, benchmarkRuns, properties.deviceName, presentModeName(swapChainPresentMode));
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	}
 
 	/* Update uniforms */
 	void updateUniformBuffer(uint32_t currentImage) {
@@ -828,8 +1282,30 @@ protected:
 		bool fire = false;
 		getSixAxis(deltaT, m, r, fire);
 
-		//////////// Reset frame buffer ////////////
-		if (m != glm::vec3(0.0f, 0.0f, 0.f) || r != glm::vec3(0.0f, 0.0f, 0.f)) {
+		//////////// Batch rendering ////////////
+		if (options.batch) {
+			m = glm::vec3(0.0f);
+			r = glm::vec3(0.0f);
+			// the frame submitted last completed the requested samples
+			if (numberOfSamples * options.modeSettings(renderMode).samplesPerFrame >= options.spp) {
+				vkDeviceWaitIdle(device);
+				saveScreenshot(options.output.c_str(), lastImage);
+				glfwSetWindowShouldClose(window, GL_TRUE);
+			}
+			lastImage = currentImage;
+		}
+
+		//////////// Benchmark ////////////
+		if (!options.benchmark.empty()) {
+			m = glm::vec3(0.0f);
+			r = glm::vec3(0.0f);
+			benchmarkStep(deltaT);
+		}
+
+		//////////// Camera motion ////////////
+		// the accumulated samples are reprojected into the new view, or discarded without reprojection
+		bool cameraMoved = m != glm::vec3(0.0f, 0.0f, 0.f) || r != glm::vec3(0.0f, 0.0f, 0.f);
+		if (cameraMoved && !options.reprojection) {
 			numberOfSamples = 0; //in questo caso ci serve = 0 almeno nella shader la media pesata non considera il previous frame (perchè ci stiamo muovendo)
 		}
 
@@ -878,15 +1354,31 @@ protected:
 				pressed = false;
 			}
 		}
+		if (glfwGetKey(window, GLFW_KEY_N)) {
+			if (!pressedDenoise) {
+				pressedDenoise = true;
+				denoise = computeTracing && !denoise;
+			}
+		}
+		else {
+			pressedDenoise = false;
+		}
+		if (glfwGetKey(window, GLFW_KEY_M)) {
+			if (!pressedMode) {
+				pressedMode = true;
+				renderMode = (RenderMode)((renderMode + 1) % RENDER_MODE_COUNT);
+				numberOfSamples = 0; //the samples of another depth are not mixed
+				std::cout << "Render mode: " << options.modeSettings(renderMode).name << "\n";
+			}
+		}
+		else {
+			pressedMode = false;
+		}
 
 
 		// Here is where you actually update your uniforms				
-		glm::mat4 M = glm::perspective(glm::radians(45.0f), Ar, 0.1f, 50.0f);
-		M[1][1] *= -1;
-
-		glm::mat4 Mv = glm::rotate(glm::mat4(1.0), -CamBeta, glm::vec3(1, 0, 0)) *
-			glm::rotate(glm::mat4(1.0), -CamAlpha, glm::vec3(0, 1, 0)) *
-			glm::translate(glm::mat4(1.0), -CamPos);
+		glm::mat4 M = cameraProjection(Ar);
+		glm::mat4 Mv = cameraView(CamPos, CamAlpha, CamBeta);
 
 		glm::mat4 ViewPrj = M * Mv;
 		glm::mat4 baseTr = glm::mat4(1.0f);
@@ -916,19 +1408,33 @@ protected:
 		tubo.nMat = glm::inverse(glm::transpose(tubo.mMat));
 		DSGlobalGP.map(currentImage, &tubo, 0);
 
-		TransformUniformBufferObject subo{};
-		for(int i = 0; i < n_objects; i++) {
-			subo.mMat = baseTr * Tpre[i];
-			subo.mvpMat = ViewPrj * subo.mMat;
-			subo.nMat = glm::inverse(glm::transpose(subo.mMat));
-			DSSphere[i].map(currentImage, &subo, 0);
-		}
-
 		// Ray samples
 		GlobalUniformBufferObject gubo{};
 		gubo.numberOfSamples = numberOfSamples;
+		gubo.convergenceThreshold = options.convergenceThreshold;
+		gubo.minSamples = options.minSamples;
+		gubo.reproject = cameraMoved && options.reprojection;
+		gubo.maxHistory = options.maxHistory;
+		gubo.rouletteDepth = options.modeSettings(renderMode).path.rouletteDepth;
+		gubo.samplerType = options.sampler;
 		
 		DSGlobal.map(currentImage, &gubo, 0);
+
+		// Denoiser iterations, reading the layer of Accum written in this frame
+		if (computeTracing) {
+			DenoiseUniformBufferObject dubo{};
+			dubo.accumLayer = numberOfSamples & 1;
+			dubo.sigmaColor = denoiseSettings.sigmaColor;
+			dubo.sigmaNormal = denoiseSettings.sigmaNormal;
+			dubo.sigmaDepth = denoiseSettings.sigmaDepth;
+			dubo.sigmaAlbedo = denoiseSettings.sigmaAlbedo;
+			dubo.noiseScale = 1.0f;
+			for (int i = 0; i < denoiseSettings.iterations; i++) {
+				dubo.stepWidth = 1 << i;
+				DSdenoise[i].map(currentImage, &dubo, 0);
+				dubo.noiseScale *= denoiseSettings.noiseScale;
+			}
+		}
 		numberOfSamples += 1;
 
 		// Camera info
@@ -937,16 +1443,133 @@ protected:
 		ubo.invViewMatrix = glm::inverse(Mv);
 		ubo.invProjectionMatrix = glm::inverse(M);
 		ubo.currBox = currentBox;
+		RayBox box = Scene.getBox(currentBox);
+		ubo.firstObject = box.firstObject;
+		ubo.objectCount = box.objectCount;
+		ubo.rootNode = box.rootNode;
+		ubo.firstTriangle = box.firstTriangle;
+		ubo.triangleCount = box.triangleCount;
+		ubo.firstLight = box.firstLight;
+		ubo.lightCount = options.lightSampling ? box.lightCount : 0;
+		ubo.prevViewProjMatrix = prevViewPrj;
+		ubo.prevCameraPos = prevCamPos;
+		prevViewPrj = ViewPrj;
+		prevCamPos = CamPos;
 
 		DSray.map(currentImage, &ubo, 0);
+
+		// the previous submission of this image is complete, its queries can be read
+		Profiler.collect(currentImage, commandBuffers[currentImage]);
 	}
 };
 
+// Scene of the CPU tracer, the sphere model is only needed while the scene is built
+RayScene headlessScene(const RenderOptions& O) {
+	VertexDescriptor VDSpheres;
+	Model sphere;
+	RayMeshSource sphereMesh{};
+	if (O.meshSpheres) {
+		initSphereVertexDescriptor(nullptr, VDSpheres);
+		sphere.load(&VDSpheres, "models/Sphere.obj", OBJ);
+		sphereMesh = {&sphere.vertices, &sphere.indices, sizeof(VertexSpheres),
+					  VDSpheres.Position.offset, VDSpheres.Normal.offset, 1.5f};
+	}
+	return RayScene::cornellBoxes(O.meshSpheres ? &sphereMesh : nullptr);
+}
+
+// Renders the requested image with the CPU tracer, without window nor Vulkan device
+void renderHeadless(const RenderOptions& O) {
+	RayScene scene = headlessScene(O);
+
+	glm::mat4 M = cameraProjection((float)O.width / (float)O.height);
+	glm::mat4 Mv = cameraView(O.camPos, glm::radians(O.camAlpha), glm::radians(O.camBeta));
+
+	CpuRayTracer tracer;
+	tracer.init(O.width, O.height, &scene);
+	tracer.lightSampling = O.lightSampling;
+	tracer.path = O.modeSettings(O.mode).path;
+	tracer.sampler = O.sampler;
+	tracer.convergenceThreshold = O.convergenceThreshold;
+	tracer.minSamples = O.minSamples;
+	std::cout << "Rendering box " << O.box << " at " << O.width << "x" << O.height << ", "
+		<< O.spp << " spp on " << ThreadPool::global().size() << " threads\n";
+	auto start = std::chrono::steady_clock::now();
+	tracer.render(O.camPos, glm::inverse(Mv), glm::inverse(M), O.box, O.spp);
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Rendered in " << seconds << " s, " << tracer.getConvergedPixels() << " of "
+		<< O.width * O.height << " pixels converged\n";
+	if (O.denoise) {
+		DenoiseSettings settings;
+		settings.iterations = O.denoiseIterations;
+		start = std::chrono::steady_clock::now();
+		tracer.denoise(settings);
+		seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Denoised in " << seconds << " s\n";
+	}
+
+	std::vector<unsigned char> rgba8;
+	std::vector<float> rgb32f;
+	tracer.getImageRGBA8(rgba8);
+	tracer.getImageRGB32F(rgb32f);
+	writeImage(O.output, O.width, O.height, rgba8, rgb32f);
+}
+
+// Flies the camera paths of the ray traced boxes with the CPU tracer, one sample per pixel per frame
+void benchmarkHeadless(const RenderOptions& O) {
+	RayScene scene = headlessScene(O);
+	glm::mat4 M = cameraProjection((float)O.width / (float)O.height);
+	const int frames = O.benchmarkFrames;
+
+	std::vector<BenchmarkRun> runs;
+	for (int box = 0; box < 3; box++) {
+		BenchmarkRun run;
+		run.box = box;
+		run.backend = "cpu";
+		run.width = O.width;
+		run.height = O.height;
+		run.raysMeasured = true;
+
+		CameraPath path = CameraPath::forBox(box);
+		CpuRayTracer tracer;
+		tracer.init(O.width, O.height, &scene);
+		tracer.lightSampling = O.lightSampling;
+		tracer.path = O.modeSettings(O.mode).path;
+		tracer.sampler = O.sampler;
+		uint64_t rays = 0;
+		for (int f = 0; f < BENCHMARK_WARMUP_FRAMES + frames; f++) {
+			CameraPose pose = path.at(std::max(f - BENCHMARK_WARMUP_FRAMES, 0), frames);
+			auto start = std::chrono::steady_clock::now();
+			tracer.traceFrame(pose.pos, glm::inverse(pose.view()), glm::inverse(M), box, 0);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (f >= BENCHMARK_WARMUP_FRAMES) {
+				run.frameMs.push_back(ms);
+				rays += tracer.getRaySegments();
+			}
+		}
+		run.raysPerSample = static_cast<double>(rays) / (static_cast<double>(O.width) * O.height * frames);
+		std::cout << "Box " << box << ": " << run.percentile(50.0) << " ms median, "
+			<< run.samplesPerSecond() * run.raysPerSample / 1e6 << " Mrays/s\n";
+		runs.push_back(run);
+	}
+	writeBenchmarkJSON(O.benchmark, runs, "CPU, " + std::to_string(ThreadPool::global().size()) + " threads");
+}
+
 // This is the main: probably you do not need to touch this!
-int main() {
+int main(int argc, char** argv) {
 	App app;
 
 	try {
+		RenderOptions options;
+		options.parse(argc, argv);
+		if (options.headless && !options.benchmark.empty()) {
+			benchmarkHeadless(options);
+			return EXIT_SUCCESS;
+		}
+		if (options.headless) {
+			renderHeadless(options);
+			return EXIT_SUCCESS;
+		}
+		app.setOptions(options);
 		app.run();
 	}
 	catch (const std::exception & e) {
@@ -0,0 +1,194 @@
+// Reproducible benchmark: scripted camera paths through the boxes and throughput metrics
+//
+// Every box is rendered for a fixed number of frames along a CameraPath that only
+// depends on the frame index, so two runs on any machine see exactly the same views.
+// The frame times of a box are collected in a BenchmarkRun and summarized with
+// percentiles; the runs of all the boxes are written as one JSON document.
+// On the GPU the time between presents depends on the present mode (with FIFO it is
+// just the refresh interval), so the GPU time of the passes of every frame is kept
+// too, and the throughput is computed from it when the timestamps are available.
+// Rays and bounces per second are the samples per second times the rays per sample:
+// the CPU tracer counts them exactly, for the GPU they are estimated by tracing the
+// same path at a low resolution on the CPU (estimateRaysPerSample).
+//
+// Requires RayScene.hpp and CpuRayTracer.hpp to be included first.
+
+#include <json.hpp>
+#include <fstream>
+
+const int BENCHMARK_WARMUP_FRAMES = 30;	// frames not measured after every box switch
+
+struct CameraPose {
+	glm::vec3 pos;
+	float alpha;	// radians, as CamAlpha and CamBeta of the application
+	float beta;
+
+	// Same view matrix as the application camera
+	glm::mat4 view() const {
+		return glm::rotate(glm::mat4(1.0), -beta, glm::vec3(1, 0, 0)) *
+			   glm::rotate(glm::mat4(1.0), -alpha, glm::vec3(0, 1, 0)) *
+			   glm::translate(glm::mat4(1.0), -pos);
+	}
+};
+
+class CameraPath {
+public:
+	std::vector<CameraPose> keys;
+
+	// A loop in front of the open side of the box (x < 0), looking inside.
+	// Raster boxes 3-5 show the rooms of boxes 0-2.
+	static CameraPath forBox(int box) {
+		float z0 = 12.0f * (box % 3);
+		CameraPath P;
+		P.keys = {
+			{glm::vec3(-8.0f, 5.0f, z0 + 5.0f), glm::radians(-90.0f), glm::radians(-5.0f)},
+			{glm::vec3(-4.0f, 4.0f, z0 + 3.0f), glm::radians(-80.0f), glm::radians(-8.0f)},
+			{glm::vec3(-1.0f, 5.5f, z0 + 7.0f), glm::radians(-105.0f), glm::radians(-3.0f)},
+			{glm::vec3(-5.0f, 7.0f, z0 + 5.0f), glm::radians(-90.0f), glm::radians(-15.0f)},
+			{glm::vec3(-8.0f, 5.0f, z0 + 5.0f), glm::radians(-90.0f), glm::radians(-5.0f)}
+		};
+		return P;
+	}
+
+	// Pose of frame out of frameCount, Catmull-Rom on the position, linear on the angles
+	CameraPose at(int frame, int frameCount) const {
+		int segments = static_cast<int>(keys.size()) - 1;
+		float t = frameCount > 1 ? static_cast<float>(frame) / (frameCount - 1) * segments : 0.0f;
+		int i = std::min(static_cast<int>(t), segments - 1);
+		float f = t - i;
+
+		const CameraPose &k0 = keys[std::max(i - 1, 0)];
+		const CameraPose &k1 = keys[i];
+		const CameraPose &k2 = keys[i + 1];
+		const CameraPose &k3 = keys[std::min(i + 2, segments)];
+
+		float f2 = f * f, f3 = f2 * f;
+		CameraPose p;
+		p.pos = 0.5f * ((2.0f * k1.pos) + (-k0.pos + k2.pos) * f +
+						(2.0f * k0.pos - 5.0f * k1.pos + 4.0f * k2.pos - k3.pos) * f2 +
+						(-k0.pos + 3.0f * k1.pos - 3.0f * k2.pos + k3.pos) * f3);
+		p.alpha = glm::mix(k1.alpha, k2.alpha, f);
+		p.beta = glm::mix(k1.beta, k2.beta, f);
+		return p;
+	}
+};
+
+struct BenchmarkRun {
+	int box = 0;
+	std::string backend;	// "cpu", "compute", "fragment" or "raster"
+	int width = 0;
+	int height = 0;
+	int samplesPerFrame = 1;
+	double raysPerSample = 0.0;	// camera ray included, 0 for the raster boxes
+	bool raysMeasured = false;	// counted by the CPU tracer instead of estimated
+	std::vector<double> frameMs;	// between two frames, as seen by the CPU
+	std::vector<double> gpuFrameMs;	// of the GPU passes of a frame (GpuProfiler), empty on the CPU
+
+	// Nearest rank percentile of the frame times, p in [0, 100]
+	double percentile(double p) const {
+		return percentile(frameMs, p);
+	}
+
+	static double percentile(const std::vector<double> &times, double p) {
+		if (times.empty()) return 0.0;
+		std::vector<double> sorted = times;
+		std::sort(sorted.begin(), sorted.end());
+		size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+		return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+	}
+
+	static double totalSeconds(const std::vector<double> &times) {
+		double ms = 0.0;
+		for (double f : times) ms += f;
+		return ms / 1000.0;
+	}
+
+	// The frame times the throughput is computed from: the GPU ones when they were measured
+	const std::vector<double> &throughputFrameMs() const {
+		return gpuFrameMs.empty() ? frameMs : gpuFrameMs;
+	}
+
+	double samplesPerSecond() const {
+		const std::vector<double> &times = throughputFrameMs();
+		if (box >= 3 || times.empty()) return 0.0;
+		return static_cast<double>(width) * height * samplesPerFrame * times.size() / totalSeconds(times);
+	}
+
+	static nlohmann::json summary(const std::vector<double> &times) {
+		return {
+			{"mean", times.empty() ? 0.0 : totalSeconds(times) * 1000.0 / times.size()},
+			{"min", percentile(times, 0.0)},
+			{"p50", percentile(times, 50.0)},
+			{"p90", percentile(times, 90.0)},
+			{"p95", percentile(times, 95.0)},
+			{"p99", percentile(times, 99.0)},
+			{"max", percentile(times, 100.0)}
+		};
+	}
+
+	nlohmann::json toJSON() const {
+		nlohmann::json j;
+		j["box"] = box;
+		j["backend"] = backend;
+		j["width"] = width;
+		j["height"] = height;
+		j["frames"] = frameMs.size();
+		j["samplesPerFrame"] = samplesPerFrame;
+		j["frameTimeMs"] = summary(frameMs);
+		if (!gpuFrameMs.empty()) {
+			j["gpuFrames"] = gpuFrameMs.size();
+			j["gpuFrameTimeMs"] = summary(gpuFrameMs);
+		}
+		j["throughputFrom"] = gpuFrameMs.empty() ? "frameTimeMs" : "gpuFrameTimeMs";
+		double sps = samplesPerSecond();
+		j["samplesPerSecond"] = sps;
+		j["raysPerSample"] = raysPerSample;
+		j["raysPerSampleMeasured"] = raysMeasured;
+		j["raysPerSecond"] = sps * raysPerSample;
+		j["bouncesPerSecond"] = sps * std::max(raysPerSample - 1.0, 0.0);
+		return j;
+	}
+};
+
+// Rays per sample along the path of a ray box, traced on the CPU at a low resolution
+inline double estimateRaysPerSample(const RayScene &scene, int box, int frameCount, float aspectRatio,
+									const glm::mat4 &projection, bool lightSampling = true,
+									const cpurt::PathSettings &pathSettings = cpurt::PathSettings()) {
+	const int W = 128, H = std::max(1, static_cast<int>(128 / aspectRatio));
+	const int POSES = 8;
+	CameraPath path = CameraPath::forBox(box);
+	CpuRayTracer tracer;
+	tracer.init(W, H, &scene);
+	tracer.lightSampling = lightSampling;
+	tracer.path = pathSettings;
+
+	uint64_t rays = 0;
+	for (int i = 0; i < POSES; i++) {
+		CameraPose p = path.at(i * (frameCount - 1) / (POSES - 1), frameCount);
+		tracer.traceFrame(p.pos, glm::inverse(p.view()), glm::inverse(projection), box, 0);
+		rays += tracer.getRaySegments();
+	}
+	return static_cast<double>(rays) / (static_cast<double>(W) * H * POSES);
+}
+
+// presentMode is empty for the CPU tracer, which presents nothing
+inline void writeBenchmarkJSON(const std::string &path, const std::vector<BenchmarkRun> &runs,
+							   const std::string &device, const std::string &presentMode = "") {
+	nlohmann::json j;
+	j["device"] = device;
+	if (!presentMode.empty()) {
+		j["presentMode"] = presentMode;
+	}
+	j["warmupFrames"] = BENCHMARK_WARMUP_FRAMES;
+	j["runs"] = nlohmann::json::array();
+	for (const BenchmarkRun &r : runs) {
+		j["runs"].push_back(r.toJSON());
+	}
+
+	std::ofstream file(path);
+	if (!file) {
+		throw std::runtime_error("failed to write " + path + "!");
+	}
+	file << j.dump(2) << "\n";
+	std::cout << "Benchmark results saved to " << path << "\n";
+}
@@ -0,0 +1,124 @@
+// Scattering of the non dielectric materials of the CPU tracer, same as shaders/Bsdf.glsl
+//
+// smoothness 0 is a Lambertian surface, sampled with cosine weighted directions around
+// the normal. Higher values are a GGX microfacet lobe (Walter et al. 2007) with
+// alpha = (1 - smoothness)^2, sampled from the distribution of the half vectors, and
+// smoothness 1 is a perfect mirror. The reflectance of the lobes is the color of the
+// material (no Fresnel term), the caller multiplies it in as before.
+// Every sample returns its solid angle density, and evalBsdf() gives the value and the
+// density of any direction, so next event estimation can weight both strategies with MIS.
+
+namespace cpurt {
+
+const float PI = 3.1415926f;
+const float GGX_MIN_ALPHA = 1e-3f;	// below this the glossy lobe is a mirror
+
+struct BsdfSample {
+	glm::vec3 direction = glm::vec3(0.0f);	// unit, away from the surface
+	float weight = 0.0f;	// BSDF * cos / pdf, without the color; 0 ends the path
+	float pdf = 0.0f;	// solid angle density, 0 for the mirror
+};
+
+// Branchless orthonormal basis (t, b, n) around a unit vector (Duff et al. 2017)
+inline void orthonormalBasis(const glm::vec3 &n, glm::vec3 &t, glm::vec3 &b) {
+	float s = n.z >= 0.0f ? 1.0f : -1.0f;
+	float a = -1.0f / (s + n.z);
+	float c = n.x * n.y * a;
+	t = glm::vec3(1.0f + s * n.x * n.x * a, s * c, -s * n.x);
+	b = glm::vec3(c, s + n.y * n.y * a, -n.y);
+}
+
+// Direction at angle acos(cosTheta) from n, rotated by 2 * PI * u around it
+inline glm::vec3 directionAround(const glm::vec3 &n, float cosTheta, float u) {
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+	float phi = 2.0f * PI * u;
+	glm::vec3 t, b;
+	orthonormalBasis(n, t, b);
+	return sinTheta * (std::cos(phi) * t + std::sin(phi) * b) + cosTheta * n;
+}
+
+// Cosine weighted direction on the hemisphere of n, pdf = cos / PI
+inline glm::vec3 sampleCosineHemisphere(const glm::vec3 &n, glm::vec2 u) {
+	return directionAround(n, std::sqrt(1.0f - u.x), u.y);
+}
+
+inline float ggxAlpha(float smoothness) {
+	float roughness = 1.0f - smoothness;
+	return roughness * roughness;
+}
+
+inline float ggxDistribution(float cosH, float alpha) {
+	float a2 = alpha * alpha;
+	float d = cosH * cosH * (a2 - 1.0f) + 1.0f;
+	return a2 / (PI * d * d);
+}
+
+// Smith masking of one direction
+inline float smithG1(float cosTheta, float alpha) {
+	float a2 = alpha * alpha;
+	return 2.0f * cosTheta / (cosTheta + std::sqrt(a2 + (1.0f - a2) * cosTheta * cosTheta));
+}
+
+// wo: unit, from the surface towards the viewer
+inline BsdfSample sampleBsdf(const glm::vec3 &n, const glm::vec3 &wo, float smoothness, glm::vec2 u) {
+	BsdfSample s;
+	if(smoothness <= 0.0f) {
+		s.direction = sampleCosineHemisphere(n, u);
+		s.weight = 1.0f;
+		s.pdf = glm::dot(s.direction, n) / PI;
+		return s;
+	}
+	float alpha = ggxAlpha(smoothness);
+	if(alpha < GGX_MIN_ALPHA) {
+		s.direction = glm::reflect(-wo, n);
+		s.weight = 1.0f;
+		return s;
+	}
+
+	// half vector with density D(h) * cosH, the reflection maps it to pdf / (4 * dot(wo, h))
+	float a2 = alpha * alpha;
+	glm::vec3 h = directionAround(n, std::sqrt((1.0f - u.x) / (1.0f + (a2 - 1.0f) * u.x)), u.y);
+	s.direction = glm::reflect(-wo, h);
+	float cosI = glm::dot(n, s.direction);
+	float cosO = glm::dot(n, wo);
+	float cosH = glm::dot(n, h);
+	float cosOH = glm::dot(wo, h);
+	if(cosI <= 0.0f || cosO <= 0.0f || cosOH <= 0.0f) {
+		return s;	// below the surface: absorbed
+	}
+	s.weight = smithG1(cosO, alpha) * smithG1(cosI, alpha) * cosOH / (cosO * cosH);
+	s.pdf = ggxDistribution(cosH, alpha) * cosH / (4.0f * cosOH);
+	return s;
+}
+
+// BSDF (without the color) for the light arriving from wi, and the density of sampleBsdf() for it.
+// Both are 0 for the mirror, which cannot be reached by a sampled light.
+inline float evalBsdf(const glm::vec3 &n, const glm::vec3 &wo, const glm::vec3 &wi, float smoothness, float &pdf) {
+	pdf = 0.0f;
+	float cosI = glm::dot(n, wi);
+	if(cosI <= 0.0f) {
+		return 0.0f;
+	}
+	if(smoothness <= 0.0f) {
+		pdf = cosI / PI;
+		return 1.0f / PI;
+	}
+	float alpha = ggxAlpha(smoothness);
+	float cosO = glm::dot(n, wo);
+	if(alpha < GGX_MIN_ALPHA || cosO <= 0.0f) {
+		return 0.0f;
+	}
+	glm::vec3 h = glm::normalize(wo + wi);
+	float cosH = glm::dot(n, h);
+	float cosOH = glm::dot(wo, h);
+	float d = ggxDistribution(cosH, alpha);
+	pdf = d * cosH / (4.0f * cosOH);
+	return d * smithG1(cosO, alpha) * smithG1(cosI, alpha) / (4.0f * cosO * cosI);
+}
+
+// Whether next event estimation can reach the lobe
+inline bool samplesLights(float smoothness) {
+	return ggxAlpha(smoothness) >= GGX_MIN_ALPHA;
+}
+
+}	// namespace cpurt
@@ -0,0 +1,871 @@
+// CPU reference implementation of shaders/RayShader.frag
+//
+// The bounce loop, the intersection routines, the sampler (Sampler.hpp), the seeding and
+// the material model (Bsdf.hpp) are kept identical to the fragment shader, so that given the
+// same UniformBufferObject contents (cameraPos, invViewMatrix, invProjectionMatrix,
+// currBox) and the same numberOfSamples the two paths can be compared pixel by pixel.
+// The image is split in tiles that are distributed over a work-stealing ThreadPool.
+//
+// The first hit of every camera ray (albedo, normal, depth) is averaged over the samples
+// as the features read by the à-trous denoiser. After a camera move they also validate
+// the samples of the previous frame reprojected into the new view.
+//
+// Requires ThreadPool.hpp, Denoiser.hpp, Sampler.hpp, Bsdf.hpp, RayBVH.hpp and RayScene.hpp to be included first.
+
+namespace cpurt {
+
+const int MAX_DEPTH = 5;	// default bounces of a path
+const int ROULETTE_DEPTH = 3;	// default first bounce that Russian roulette can end
+
+struct Ray {
+	glm::vec3 origin;
+	glm::vec3 direction;
+};
+
+struct GeometryHit {
+	bool isHit = false;
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 normal = glm::vec3(0.0f);
+	int materialIndex = 0;
+	bool frontFace = true;
+	int geometry = RAY_NONE;	// index in geometries, RAY_NONE for triangles
+};
+
+// First hit of the camera ray, the features of the denoiser (all 0 when nothing is hit)
+struct FirstHit {
+	glm::vec3 albedo = glm::vec3(0.0f);	// emission color for the lights
+	glm::vec3 normal = glm::vec3(0.0f);
+	glm::vec3 position = glm::vec3(0.0f);
+	float depth = 0.0f;	// distance from the camera
+};
+
+inline glm::vec2 RandomPointInCircle(glm::vec2 u) {
+	float angle = u.x * 2.0f * 3.1415926f;
+	glm::vec2 pointOnCircle = glm::vec2(std::cos(angle), std::sin(angle));
+	return pointOnCircle * std::sqrt(u.y);
+}
+
+// ------------------- RAY INTERSECTION METHODS ---------------------
+inline bool intersectSphere(const Ray &ray, const RayGeometry &geom, GeometryHit &hit) {
+	glm::vec3 center = glm::vec3(geom.center);
+	float radius = geom.center.w;
+	glm::vec3 oc = ray.origin - center;
+
+	float a = glm::dot(ray.direction, ray.direction);
+	float b = 2.0f * glm::dot(oc, ray.direction);
+	float c = glm::dot(oc, oc) - radius * radius;
+	float discriminant = b * b - 4.0f * a * c;
+
+	if(discriminant > 0.0f) {
+		float t0 = (-b - std::sqrt(discriminant)) / (2.0f * a);
+		float t1 = (-b + std::sqrt(discriminant)) / (2.0f * a);
+
+		float dst = -1.0f;
+		if(t0 > 0.0f) {
+			dst = t0;
+		}
+		if(t1 > 0.0f && (dst < 0.0f || t1 < dst)) {
+			dst = t1;
+		}
+
+		if(dst > 0.0f) {
+			hit.position = ray.origin + dst * ray.direction;
+			hit.normal = glm::normalize(hit.position - center);
+			hit.materialIndex = geom.materialIndex;
+			hit.isHit = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool intersectPlane(const Ray &ray, const RayGeometry &geom, GeometryHit &hit) {
+	glm::vec3 normal = glm::vec3(geom.normal);
+	float denom = glm::dot(normal, ray.direction);
+
+	if(std::abs(denom) < 0.0001f) {
+		return false;
+	}
+
+	glm::vec3 rayPlane = glm::vec3(geom.point) - ray.origin;
+	float t = glm::dot(rayPlane, normal) / denom;
+
+	if(t < 0.0f) {
+		return false;
+	}
+
+	glm::vec3 hitPosition = ray.origin + t * ray.direction;
+
+	if(geom.width > 0.1f || geom.height > 0.1f) {
+		glm::vec3 A = glm::vec3(geom.point);
+		glm::vec3 B = A + geom.width * glm::vec3(geom.vWidth);
+		glm::vec3 C = A + geom.height * glm::vec3(geom.vHeight);
+
+		glm::vec3 AB = B - A;
+		glm::vec3 AC = C - A;
+		glm::vec3 AM = hitPosition - A;
+
+		float AMx = glm::dot(AM, glm::normalize(AB));
+		float AMy = glm::dot(AM, glm::normalize(AC));
+		float lengthAB = glm::length(AB);
+		float lengthAC = glm::length(AC);
+
+		if(AMx >= 0.0f && AMy >= 0.0f && AMx <= lengthAB && AMy <= lengthAC) {
+			hit.position = hitPosition;
+			hit.normal = normal;
+			hit.materialIndex = geom.materialIndex;
+			hit.isHit = true;
+			return true;
+		}
+
+		return false;
+	}
+
+	hit.position = hitPosition;
+	hit.normal = normal;
+	hit.materialIndex = geom.materialIndex;
+	hit.isHit = true;
+	return true;
+}
+
+// Watertight ray/triangle test (Woop, Benthin, Wald 2013): the vertices are
+// sheared in the space of the ray so that shared edges are evaluated exactly
+// the same way by both triangles and no ray can slip between them.
+inline bool intersectTriangle(const Ray &ray, const RayScene &scene, const RayTriangle &tri, GeometryHit &hit) {
+	glm::vec3 absDir = glm::abs(ray.direction);
+	int kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+	int kx = (kz + 1) % 3;
+	int ky = (kx + 1) % 3;
+	if(ray.direction[kz] < 0.0f) {
+		std::swap(kx, ky);
+	}
+	float Sx = ray.direction[kx] / ray.direction[kz];
+	float Sy = ray.direction[ky] / ray.direction[kz];
+	float Sz = 1.0f / ray.direction[kz];
+
+	const RayMeshVertex &v0 = scene.meshVertices[tri.v0];
+	const RayMeshVertex &v1 = scene.meshVertices[tri.v1];
+	const RayMeshVertex &v2 = scene.meshVertices[tri.v2];
+	glm::vec3 A = glm::vec3(v0.position[0], v0.position[1], v0.position[2]) - ray.origin;
+	glm::vec3 B = glm::vec3(v1.position[0], v1.position[1], v1.position[2]) - ray.origin;
+	glm::vec3 C = glm::vec3(v2.position[0], v2.position[1], v2.position[2]) - ray.origin;
+
+	float Ax = A[kx] - Sx * A[kz];
+	float Ay = A[ky] - Sy * A[kz];
+	float Bx = B[kx] - Sx * B[kz];
+	float By = B[ky] - Sy * B[kz];
+	float Cx = C[kx] - Sx * C[kz];
+	float Cy = C[ky] - Sy * C[kz];
+
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+	if((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) {
+		return false;
+	}
+	float det = U + V + W;
+	if(det == 0.0f) {
+		return false;
+	}
+
+	float T = U * Sz * A[kz] + V * Sz * B[kz] + W * Sz * C[kz];
+	float t = T / det;
+	if(t <= 0.0f) {
+		return false;
+	}
+
+	glm::vec3 n0 = glm::vec3(v0.normal[0], v0.normal[1], v0.normal[2]);
+	glm::vec3 n1 = glm::vec3(v1.normal[0], v1.normal[1], v1.normal[2]);
+	glm::vec3 n2 = glm::vec3(v2.normal[0], v2.normal[1], v2.normal[2]);
+	hit.position = ray.origin + t * ray.direction;
+	hit.normal = glm::normalize((U * n0 + V * n1 + W * n2) / det);
+	hit.materialIndex = tri.materialIndex;
+	hit.isHit = true;
+	return true;
+}
+
+inline bool intersectGeometry(const Ray &ray, const RayGeometry &geom, GeometryHit &hit) {
+	if(geom.type == RAY_SPHERE) {
+		return intersectSphere(ray, geom, hit);
+	} else if(geom.type == RAY_PLANE) {
+		return intersectPlane(ray, geom, hit);
+	}
+	return false;
+}
+
+// Slab test, returns the entry distance along the ray or -1 when the box is missed
+inline float intersectAABB(const Ray &ray, const glm::vec3 &invDir, const BVHNode &node) {
+	glm::vec3 t0 = (node.bmin - ray.origin) * invDir;
+	glm::vec3 t1 = (node.bmax - ray.origin) * invDir;
+	glm::vec3 tmin = glm::min(t0, t1);
+	glm::vec3 tmax = glm::max(t0, t1);
+	float tnear = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.0f));
+	float tfar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+	return tnear <= tfar ? tnear : -1.0f;
+}
+
+inline void keepClosest(const Ray &ray, const GeometryHit &hit, GeometryHit &closestHit, float &closestDist) {
+	float dist = glm::length(hit.position - ray.origin);
+	if(dist < closestDist) {
+		closestDist = dist;
+		closestHit = hit;
+		closestHit.frontFace = glm::dot(ray.direction, hit.normal) < 0.0f;
+		closestHit.normal = closestHit.frontFace ? closestHit.normal : -closestHit.normal;
+	}
+}
+
+inline void testPrimitive(const Ray &ray, const RayScene &scene, uint32_t ref, GeometryHit &closestHit,
+						  float &closestDist) {
+	GeometryHit hit;
+	if(ref & RAY_TRIANGLE_BIT) {
+		if(intersectTriangle(ray, scene, scene.triangles[ref & ~RAY_TRIANGLE_BIT], hit)) {
+			hit.geometry = RAY_NONE;
+			keepClosest(ray, hit, closestHit, closestDist);
+		}
+	} else if(scene.geometries[ref].type != RAY_NONE && intersectGeometry(ray, scene.geometries[ref], hit)) {
+		hit.geometry = static_cast<int>(ref);
+		keepClosest(ray, hit, closestHit, closestDist);
+	}
+}
+
+// Stackless walk of the box hierarchy, same as traceClosest() in the shader
+inline GeometryHit traceClosest(const Ray &ray, const RayScene &scene, RayBox box) {
+	GeometryHit closestHit;
+	float closestDist = 1e20f;
+
+	if(box.rootNode < 0) {
+		for(int i = box.firstTriangle; i < box.firstTriangle + box.triangleCount; i++) {
+			testPrimitive(ray, scene, RAY_TRIANGLE_BIT | static_cast<uint32_t>(i), closestHit, closestDist);
+		}
+		for(int i = box.firstObject; i < box.firstObject + box.objectCount; i++) {
+			testPrimitive(ray, scene, static_cast<uint32_t>(i), closestHit, closestDist);
+		}
+		return closestHit;
+	}
+
+	// the direction is not always normalized, distances are compared in world units
+	glm::vec3 invDir = 1.0f / ray.direction;
+	float dirLength = glm::length(ray.direction);
+	int node = box.rootNode;
+	while(node >= 0) {
+		const BVHNode &n = scene.nodes[node];
+		float tnear = intersectAABB(ray, invDir, n);
+		if(tnear >= 0.0f && tnear * dirLength < closestDist) {
+			uint32_t count = n.primInfo >> 24;
+			if(count == 0) {
+				node++;
+				continue;
+			}
+			uint32_t first = n.primInfo & 0xFFFFFFu;
+			for(uint32_t i = first; i < first + count; i++) {
+				testPrimitive(ray, scene, scene.primRefs[i], closestHit, closestDist);
+			}
+		}
+		node = n.missIndex;
+	}
+	return closestHit;
+}
+
+// Shadow rays: true when anything is hit before maxDist, stops at the first intersection
+inline bool occluded(const Ray &ray, const RayScene &scene, RayBox box, float maxDist) {
+	GeometryHit closestHit;
+	float closestDist = maxDist;
+
+	if(box.rootNode < 0) {
+		for(int i = box.firstTriangle; i < box.firstTriangle + box.triangleCount; i++) {
+			testPrimitive(ray, scene, RAY_TRIANGLE_BIT | static_cast<uint32_t>(i), closestHit, closestDist);
+			if(closestHit.isHit) return true;
+		}
+		for(int i = box.firstObject; i < box.firstObject + box.objectCount; i++) {
+			testPrimitive(ray, scene, static_cast<uint32_t>(i), closestHit, closestDist);
+			if(closestHit.isHit) return true;
+		}
+		return false;
+	}
+
+	glm::vec3 invDir = 1.0f / ray.direction;
+	float dirLength = glm::length(ray.direction);
+	int node = box.rootNode;
+	while(node >= 0) {
+		const BVHNode &n = scene.nodes[node];
+		float tnear = intersectAABB(ray, invDir, n);
+		if(tnear >= 0.0f && tnear * dirLength < closestDist) {
+			uint32_t count = n.primInfo >> 24;
+			if(count == 0) {
+				node++;
+				continue;
+			}
+			uint32_t first = n.primInfo & 0xFFFFFFu;
+			for(uint32_t i = first; i < first + count; i++) {
+				testPrimitive(ray, scene, scene.primRefs[i], closestHit, closestDist);
+				if(closestHit.isHit) return true;
+			}
+		}
+		node = n.missIndex;
+	}
+	return false;
+}
+
+//------------------ NEXT EVENT ESTIMATION --------------------
+
+struct LightSample {
+	glm::vec3 direction = glm::vec3(0.0f);	// unit, from the shaded point to the light
+	float dist = 0.0f;	// distance of the sampled point on the light
+	float pdf = 0.0f;	// solid angle density, 0 for an invalid sample
+};
+
+// Spheres: uniform direction in the cone they subtend (solid angle sampling)
+// Rectangles: uniform point on the area, converted to solid angle by dist^2 / (area * cos)
+inline LightSample sampleLight(const RayGeometry &geom, const glm::vec3 &x, glm::vec2 u) {
+	LightSample s;
+	float u1 = u.x;
+	float u2 = u.y;
+
+	if(geom.type == RAY_SPHERE) {
+		glm::vec3 toCenter = glm::vec3(geom.center) - x;
+		float r = geom.center.w;
+		float d2 = glm::dot(toCenter, toCenter);
+		if(d2 <= r * r) {
+			return s;
+		}
+		float cosMax = std::sqrt(std::max(0.0f, 1.0f - r * r / d2));
+		float cosTheta = 1.0f - u1 * (1.0f - cosMax);
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		float phi = 2.0f * PI * u2;
+
+		glm::vec3 w = toCenter / std::sqrt(d2);
+		glm::vec3 t, b;
+		orthonormalBasis(w, t, b);
+		s.direction = glm::normalize(cosTheta * w + sinTheta * (std::cos(phi) * t + std::sin(phi) * b));
+		float proj = glm::dot(toCenter, s.direction);
+		s.dist = proj - std::sqrt(std::max(0.0f, r * r - (d2 - proj * proj)));
+		s.pdf = 1.0f / (2.0f * PI * (1.0f - cosMax));
+	} else {
+		glm::vec3 A = glm::vec3(geom.point);
+		glm::vec3 toLight = A + u1 * geom.width * glm::vec3(geom.vWidth) +
+							u2 * geom.height * glm::vec3(geom.vHeight) - x;
+		float d2 = glm::dot(toLight, toLight);
+		s.dist = std::sqrt(d2);
+		s.direction = toLight / s.dist;
+		float cosLight = std::abs(glm::dot(glm::vec3(geom.normal), s.direction));	// both faces emit
+		float area = geom.width * geom.height;
+		if(cosLight > 1e-4f && area > 0.0f) {
+			s.pdf = d2 / (area * cosLight);
+		}
+	}
+	return s;
+}
+
+// Density of sampleLight(geom, x) for the direction from x to the point p of the light
+inline float lightPdf(const RayGeometry &geom, const glm::vec3 &x, const glm::vec3 &p) {
+	if(geom.type == RAY_SPHERE) {
+		glm::vec3 toCenter = glm::vec3(geom.center) - x;
+		float r = geom.center.w;
+		float d2 = glm::dot(toCenter, toCenter);
+		if(d2 <= r * r) {
+			return 0.0f;
+		}
+		float cosMax = std::sqrt(std::max(0.0f, 1.0f - r * r / d2));
+		return 1.0f / (2.0f * PI * (1.0f - cosMax));
+	}
+	glm::vec3 toLight = p - x;
+	float d2 = glm::dot(toLight, toLight);
+	float cosLight = std::abs(glm::dot(glm::vec3(geom.normal), toLight)) / std::sqrt(d2);
+	float area = geom.width * geom.height;
+	return (cosLight > 1e-4f && area > 0.0f) ? d2 / (area * cosLight) : 0.0f;
+}
+
+inline float powerHeuristic(float pdfA, float pdfB) {
+	return (pdfA * pdfA) / (pdfA * pdfA + pdfB * pdfB);
+}
+
+// Direct light at a diffuse or glossy hit seen from wo: one random light of the box, a shadow
+// ray and the MIS weight against the sampling of the BSDF
+inline glm::vec3 sampleDirectLight(const GeometryHit &hit, const glm::vec3 &albedo, float smoothness, const glm::vec3 &wo,
+								   PixelSampler &sampler, int bounce, const RayScene &scene, RayBox box, uint64_t *segments) {
+	int pick = std::min(static_cast<int>(sampler.get1D(sampleDimension(bounce, SLOT_LIGHT_PICK)) * box.lightCount),
+						box.lightCount - 1);
+	const RayGeometry &geom = scene.geometries[scene.lights[box.firstLight + pick]];
+	LightSample s = sampleLight(geom, hit.position, sampler.get2D(sampleDimension(bounce, SLOT_LIGHT)));
+	float pdfBsdf;
+	float bsdf = evalBsdf(hit.normal, wo, s.direction, smoothness, pdfBsdf);
+	if(s.pdf <= 0.0f || bsdf <= 0.0f) {
+		return glm::vec3(0.0f);
+	}
+
+	Ray shadowRay;
+	shadowRay.origin = hit.position + s.direction * 0.001f;
+	shadowRay.direction = s.direction;
+	if(segments) {
+		(*segments)++;
+	}
+	if(occluded(shadowRay, scene, box, s.dist - 0.002f)) {
+		return glm::vec3(0.0f);
+	}
+
+	const RayMaterial &light = scene.materials[geom.materialIndex];
+	float pdfLight = s.pdf / static_cast<float>(box.lightCount);
+	float cosSurface = glm::dot(hit.normal, s.direction);
+	return albedo * bsdf * glm::vec3(light.emissionColor) * light.emissionStrength * cosSurface / pdfLight *
+		   powerHeuristic(pdfLight, pdfBsdf);
+}
+
+//------------------ RIFLECTION & REFRACTION --------------------
+inline glm::vec3 Myrefract(glm::vec3 v, glm::vec3 n, float eta) {
+	float cosi = glm::dot(v, n);
+	float k = 1.0f - eta * eta * (1.0f - cosi * cosi);
+	if(k < 0.0f) {
+		return glm::vec3(0.0f);
+	} else {
+		return eta * v - (eta * cosi + std::sqrt(k)) * n;
+	}
+}
+
+inline float schlickApproximation(float cosTheta, float refrIndex) {
+	float r0 = (1.0f - refrIndex) / (1.0f + refrIndex);
+	r0 = r0 * r0;
+	return r0 + (1.0f - r0) * std::pow((1.0f - cosTheta), 5.0f);
+}
+
+//------------------ COLOR CALCULATION ---------------------
+// Length of the paths, as maxDepth and rouletteDepth of GlobalUniformBufferObject
+struct PathSettings {
+	int maxDepth = MAX_DEPTH;
+	int rouletteDepth = ROULETTE_DEPTH;	// maxDepth or more disables Russian roulette
+};
+
+// segments, when given, counts the rays traced (camera ray, bounces and shadow rays)
+// firstHit, when given, receives the features of the denoiser
+inline glm::vec4 rayCasting(Ray ray, PixelSampler &sampler, const RayScene &scene, RayBox box,
+							const PathSettings &path, uint64_t *segments = nullptr, FirstHit *firstHit = nullptr) {
+	glm::vec4 rayColor = glm::vec4(0.0f);
+	glm::vec3 rayAttenuation = glm::vec3(1.0f);
+
+	// previous bounce, to weight with MIS the lights hit by BSDF rays
+	bool lastSampledLights = false;	// the camera, the mirrors and the dielectrics do not sample the lights
+	float lastBsdfPdf = 0.0f;
+	glm::vec3 lastPosition = ray.origin;
+
+	for(int bounce = 0; bounce < path.maxDepth; bounce++) {
+		GeometryHit closestHit = traceClosest(ray, scene, box);
+		if(segments) {
+			(*segments)++;
+		}
+
+		if(closestHit.isHit) {
+			const RayMaterial &material = scene.materials[closestHit.materialIndex];
+			if(bounce == 0 && firstHit) {
+				firstHit->albedo = glm::vec3(material.emissionStrength > 0.0f ? material.emissionColor : material.color);
+				firstHit->normal = closestHit.normal;
+				firstHit->position = closestHit.position;
+				firstHit->depth = glm::length(closestHit.position - ray.origin);
+			}
+			if(material.emissionStrength > 0.0f) {
+				float weight = 1.0f;	// triangles and tiny planes are not in lights, they are never sampled directly
+				if(lastSampledLights && box.lightCount > 0 && closestHit.geometry != RAY_NONE &&
+				   scene.geometries[closestHit.geometry].sampledLight) {
+					float pdfLight = lightPdf(scene.geometries[closestHit.geometry], lastPosition,
+											  closestHit.position) / static_cast<float>(box.lightCount);
+					weight = powerHeuristic(lastBsdfPdf, pdfLight);
+				}
+				rayColor += glm::vec4(rayAttenuation * glm::vec3(material.emissionColor) *
+									  material.emissionStrength * weight, 1.0f);
+				break;
+			}
+
+			float refrIndex = material.dieletricConstant;
+			bool sampledLights = refrIndex <= 1.0f && samplesLights(material.smoothness);
+			glm::vec3 wo = -glm::normalize(ray.direction);
+
+			// not at the last bounce: paths end there, the light would get one bounce more than without sampling
+			if(sampledLights && box.lightCount > 0 && bounce < path.maxDepth - 1) {
+				rayColor += glm::vec4(rayAttenuation * sampleDirectLight(closestHit, glm::vec3(material.color), material.smoothness,
+																		 wo, sampler, bounce, scene, box, segments), 0.0f);
+			}
+
+			float lobeWeight = 1.0f;
+			float bsdfPdf = 0.0f;
+
+			if(refrIndex > 1.0f) {
+				float ri = closestHit.frontFace ? (1.0f / refrIndex) : refrIndex;
+
+				glm::vec3 normalRayDir = glm::normalize(ray.direction);
+				float cosTheta = std::min(glm::dot(-normalRayDir, closestHit.normal), 1.0f);
+				float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+
+				if(ri * sinTheta > 1.0f || schlickApproximation(cosTheta, ri) > sampler.get1D(sampleDimension(bounce, SLOT_LOBE))) {
+					ray.direction = glm::reflect(normalRayDir, closestHit.normal);
+				} else {
+					ray.direction = Myrefract(normalRayDir, closestHit.normal, ri);
+				}
+			} else {
+				BsdfSample s = sampleBsdf(closestHit.normal, wo, material.smoothness,
+										  sampler.get2D(sampleDimension(bounce, SLOT_BSDF)));
+				if(s.weight <= 0.0f) {
+					break;
+				}
+				ray.direction = s.direction;
+				lobeWeight = s.weight;
+				bsdfPdf = s.pdf;
+			}
+
+			lastSampledLights = sampledLights;
+			lastBsdfPdf = bsdfPdf;
+			lastPosition = closestHit.position;
+
+			ray.origin = closestHit.position + ray.direction * 0.001f;
+			rayAttenuation *= glm::vec3(material.color) * lobeWeight;
+
+			// Russian roulette: the path survives with the probability of its throughput (at most 0.95),
+			// the survivors are divided by it and the estimate stays unbiased
+			if(bounce + 1 >= path.rouletteDepth && bounce + 1 < path.maxDepth) {
+				float survival = std::min(std::max(rayAttenuation.r, std::max(rayAttenuation.g, rayAttenuation.b)), 0.95f);
+				if(sampler.get1D(sampleDimension(bounce, SLOT_ROULETTE)) >= survival) {
+					break;
+				}
+				rayAttenuation /= survival;
+			}
+		} else {
+			break;
+		}
+	}
+
+	return rayColor;
+}
+
+}	// namespace cpurt
+
+
+// Camera of the previous frame, to reproject the accumulated samples after a move
+struct PreviousCamera {
+	glm::vec3 position;
+	glm::mat4 viewProjection;
+};
+
+class CpuRayTracer {
+public:
+	static const int TILE_SIZE = 16;
+
+	int width = 0;
+	int height = 0;
+	bool lightSampling = true;	// false: light only reaches the camera through BSDF bounces
+	// Adaptive sampling, as GlobalUniformBufferObject: pixels whose mean luminance has a relative
+	// standard error below convergenceThreshold stop sampling, 0 disables it
+	float convergenceThreshold = 0.0f;
+	int minSamples = 32;
+	int maxHistory = 32;	// samples kept by the reprojection, as GlobalUniformBufferObject
+	cpurt::PathSettings path;
+	cpurt::SamplerType sampler = cpurt::SAMPLER_SOBOL;
+
+	void init(int w, int h, const RayScene *rayScene, ThreadPool *pool = nullptr) {
+		width = w;
+		height = h;
+		scene = rayScene;
+		P = pool ? pool : &ThreadPool::global();
+		accumulation.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+		sumSquares.assign(static_cast<size_t>(width) * height, 0.0f);
+		albedoDepth.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+		normals.assign(static_cast<size_t>(width) * height, glm::vec3(0.0f));
+		denoised.clear();
+		samples = 0;
+	}
+
+	// Traces one sample per pixel, as one frame of the ray pipeline does (converged pixels are skipped).
+	// numberOfSamples has the meaning of GlobalUniformBufferObject::numberOfSamples:
+	// 0 restarts the accumulation, and it is also part of the per-pixel seed.
+	// previous, when given, is the camera of the last frame: the camera moved and the accumulation
+	// is reprojected into the new view as with GlobalUniformBufferObject::reproject.
+	void traceFrame(const glm::vec3 &cameraPos, const glm::mat4 &invViewMatrix,
+					const glm::mat4 &invProjectionMatrix, int currBox, int numberOfSamples,
+					const PreviousCamera *previous = nullptr) {
+		if(currBox >= 3) {
+			return;
+		}
+		if(numberOfSamples == 0) {
+			std::fill(accumulation.begin(), accumulation.end(), glm::vec4(0.0f));
+			std::fill(sumSquares.begin(), sumSquares.end(), 0.0f);
+			samples = 0;
+			raySegments = 0;
+		}
+		denoised.clear();
+		bool reproject = previous && numberOfSamples > 0;
+		if(reproject) {
+			history = {accumulation, sumSquares, albedoDepth, normals, *previous};
+		}
+		RayBox box = scene->getBox(currBox);
+		if(!lightSampling) {
+			box.lightCount = 0;
+		}
+
+		int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+		int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+		TaskGroup tiles;
+		for(int t = 0; t < tilesX * tilesY; t++) {
+			int x0 = (t % tilesX) * TILE_SIZE;
+			int y0 = (t / tilesX) * TILE_SIZE;
+			P->submit(tiles, [=]() {
+				int x1 = std::min(x0 + TILE_SIZE, width);
+				int y1 = std::min(y0 + TILE_SIZE, height);
+				uint64_t segments = 0;
+				for(int y = y0; y < y1; y++) {
+					for(int x = x0; x < x1; x++) {
+						size_t i = static_cast<size_t>(y) * width + x;
+						// after a move every pixel is traced, the reprojection needs its first hit
+						if(!reproject && isConverged(accumulation[i], sumSquares[i])) {
+							continue;
+						}
+						cpurt::FirstHit hit;
+						glm::vec3 radiance = glm::vec3(tracePixel(x, y, cameraPos, invViewMatrix, invProjectionMatrix,
+																  numberOfSamples, box, segments, hit));
+						if(reproject) {
+							reprojectHistory(hit, accumulation[i], sumSquares[i]);
+						}
+						float l = luminance(radiance);
+						accumulation[i] += glm::vec4(radiance, 1.0f);
+						sumSquares[i] += l * l;
+						// running average of the features, as renderPixel() in the shader
+						float f = reproject ? 1.0f : 1.0f / accumulation[i].a;
+						albedoDepth[i] += (glm::vec4(hit.albedo, hit.depth) - albedoDepth[i]) * f;
+						normals[i] += (hit.normal - normals[i]) * f;
+					}
+				}
+				raySegments += segments;
+			});
+		}
+		P->wait(tiles);
+		samples++;
+	}
+
+	// Traces spp consecutive frames starting from a cleared accumulation
+	void render(const glm::vec3 &cameraPos, const glm::mat4 &invViewMatrix,
+				const glm::mat4 &invProjectionMatrix, int currBox, int spp) {
+		for(int s = 0; s < spp; s++) {
+			traceFrame(cameraPos, invViewMatrix, invProjectionMatrix, currBox, s);
+		}
+	}
+
+	int getSamples() const {
+		return samples;
+	}
+
+	// Rays traced since the accumulation was restarted, camera rays included
+	uint64_t getRaySegments() const {
+		return raySegments.load();
+	}
+
+	// Pixels that stopped sampling, always 0 without adaptive sampling
+	int getConvergedPixels() const {
+		int converged = 0;
+		for(size_t i = 0; i < accumulation.size(); i++) {
+			if(isConverged(accumulation[i], sumSquares[i])) converged++;
+		}
+		return converged;
+	}
+
+	// Filters the accumulated image with the à-trous denoiser: getPixel() and the image getters
+	// return the filtered radiance until the next traceFrame()
+	void denoise(const DenoiseSettings &settings) {
+		DenoiseImage image;
+		image.width = width;
+		image.height = height;
+		image.color.resize(accumulation.size());
+		image.noise.resize(accumulation.size());
+		for(size_t i = 0; i < accumulation.size(); i++) {
+			const glm::vec4 &sum = accumulation[i];
+			image.color[i] = sum.a > 0.0f ? glm::vec3(sum) / sum.a : glm::vec3(0.0f);
+		}
+		for(int y = 0; y < height; y++) {
+			for(int x = 0; x < width; x++) {
+				image.noise[static_cast<size_t>(y) * width + x] = noiseLevel(image.color, x, y);
+			}
+		}
+		image.albedoDepth = albedoDepth;
+		image.normal = normals;
+
+		AtrousDenoiser D;
+		D.settings = settings;
+		D.denoise(image, P);
+		denoised = std::move(image.color);
+	}
+
+	// Average radiance of pixel (x, y), row 0 being the top of the image
+	glm::vec3 getPixel(int x, int y) const {
+		if(!denoised.empty()) return denoised[static_cast<size_t>(y) * width + x];
+		const glm::vec4 &sum = accumulation[static_cast<size_t>(y) * width + x];
+		if(sum.a == 0.0f) return glm::vec3(0.0f);
+		return glm::vec3(sum) / sum.a;
+	}
+
+	// RGBA8 with the sRGB encoding applied by the swapchain, top row first
+	void getImageRGBA8(std::vector<unsigned char> &out) const {
+		out.resize(static_cast<size_t>(width) * height * 4);
+		for(int y = 0; y < height; y++) {
+			for(int x = 0; x < width; x++) {
+				glm::vec3 c = getPixel(x, y);
+				unsigned char *p = &out[(static_cast<size_t>(y) * width + x) * 4];
+				for(int k = 0; k < 3; k++) {
+					p[k] = static_cast<unsigned char>(std::round(linearToSRGB(c[k]) * 255.0f));
+				}
+				p[3] = 255;
+			}
+		}
+	}
+
+	// Linear average radiance, RGB, top row first
+	void getImageRGB32F(std::vector<float> &out) const {
+		out.resize(static_cast<size_t>(width) * height * 3);
+		for(int y = 0; y < height; y++) {
+			for(int x = 0; x < width; x++) {
+				glm::vec3 c = getPixel(x, y);
+				float *p = &out[(static_cast<size_t>(y) * width + x) * 3];
+				p[0] = c.r;
+				p[1] = c.g;
+				p[2] = c.b;
+			}
+		}
+	}
+
+private:
+	ThreadPool *P = nullptr;
+	std::vector<glm::vec4> accumulation;	// rgb = sum of the samples, a = their count
+	std::vector<float> sumSquares;	// sum of the squared luminances of the samples
+	std::vector<glm::vec4> albedoDepth;	// average first hit albedo, depth in a
+	std::vector<glm::vec3> normals;	// average first hit normal
+	std::vector<glm::vec3> denoised;	// output of denoise(), empty when not filtered
+
+	// Accumulation and features of the previous frame, read by the reprojection
+	struct History {
+		std::vector<glm::vec4> accumulation;
+		std::vector<float> sumSquares;
+		std::vector<glm::vec4> albedoDepth;
+		std::vector<glm::vec3> normals;
+		PreviousCamera camera;
+	} history;
+	int samples = 0;
+	std::atomic<uint64_t> raySegments{0};
+	const RayScene *scene = nullptr;
+
+	static float luminance(const glm::vec3 &c) {
+		return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	// Same as isConverged() in the shader
+	bool isConverged(const glm::vec4 &sum, float squares) const {
+		if(convergenceThreshold <= 0.0f || sum.a < static_cast<float>(std::max(minSamples, 2))) {
+			return false;
+		}
+		float n = sum.a;
+		float mean = luminance(glm::vec3(sum)) / n;
+		float variance = std::max(squares - n * mean * mean, 0.0f) / (n - 1.0f);
+		return std::sqrt(variance / n) <= convergenceThreshold * std::max(mean, 1e-3f);
+	}
+
+	// Same as reprojectHistory() in the shader: the first hit is projected with the previous camera and
+	// the history is interpolated between the 4 nearest pixels, skipping the ones where that point was
+	// not visible (disocclusions, told by a different depth or normal)
+	void reprojectHistory(const cpurt::FirstHit &hit, glm::vec4 &sum, float &squares) const {
+		sum = glm::vec4(0.0f);
+		squares = 0.0f;
+		if(hit.depth <= 0.0f) {
+			return;
+		}
+		glm::vec4 clip = history.camera.viewProjection * glm::vec4(hit.position, 1.0f);
+		if(clip.w <= 0.0f) {
+			return;
+		}
+
+		glm::vec2 prevPixel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(width, height) - 0.5f;
+		glm::ivec2 base = glm::ivec2(glm::floor(prevPixel));
+		glm::vec2 f = prevPixel - glm::vec2(base);
+		float expectedDepth = glm::length(hit.position - history.camera.position);
+
+		float weightSum = 0.0f;
+		for(int k = 0; k < 4; k++) {
+			glm::ivec2 q = base + glm::ivec2(k & 1, k >> 1);
+			if(q.x < 0 || q.y < 0 || q.x >= width || q.y >= height) continue;
+			size_t j = static_cast<size_t>(q.y) * width + q.x;
+			const glm::vec3 &prevNormal = history.normals[j];
+			if(std::abs(history.albedoDepth[j].w - expectedDepth) > 0.05f * expectedDepth ||
+			   glm::dot(prevNormal, hit.normal) < 0.9f * glm::length(prevNormal)) continue;
+
+			float w = ((k & 1) ? f.x : 1.0f - f.x) * ((k >> 1) ? f.y : 1.0f - f.y);
+			sum += w * history.accumulation[j];
+			squares += w * history.sumSquares[j];
+			weightSum += w;
+		}
+		if(weightSum < 1e-3f) {
+			sum = glm::vec4(0.0f);
+			squares = 0.0f;
+			return;
+		}
+		sum /= weightSum;
+		squares /= weightSum;
+
+		if(sum.a > static_cast<float>(maxHistory)) {
+			float scale = static_cast<float>(maxHistory) / sum.a;
+			sum *= scale;
+			squares *= scale;
+		}
+	}
+
+	// Standard deviation of the mean luminance, same as noiseLevel() in Denoise.comp.
+	// A single sample has no variance yet: the one of its 3x3 neighbourhood is used instead
+	float noiseLevel(const std::vector<glm::vec3> &average, int x, int y) const {
+		size_t i = static_cast<size_t>(y) * width + x;
+		float n = accumulation[i].a;
+		if(n >= 2.0f) {
+			float mean = luminance(glm::vec3(accumulation[i])) / n;
+			float variance = std::max(sumSquares[i] - n * mean * mean, 0.0f) / (n - 1.0f);
+			return std::sqrt(variance / n);
+		}
+		float sum = 0.0f, squares = 0.0f, count = 0.0f;
+		for(int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); qy++) {
+			for(int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); qx++) {
+				float l = luminance(average[static_cast<size_t>(qy) * width + qx]);
+				sum += l;
+				squares += l * l;
+				count += 1.0f;
+			}
+		}
+		float mean = sum / count;
+		return std::sqrt(std::max(squares / count - mean * mean, 0.0f));
+	}
+
+	static float linearToSRGB(float v) {
+		v = std::min(std::max(v, 0.0f), 1.0f);
+		return v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+	}
+
+	// Same as UVtoRayDirection() in the shader
+	static glm::vec3 UVtoRayDirection(glm::vec2 uv, const glm::mat4 &invViewMatrix,
+									  const glm::mat4 &invProjectionMatrix) {
+		glm::vec2 ndc = uv * 2.0f - 1.0f;
+		glm::vec4 clipCoords = glm::vec4(ndc, -1.0f, 1.0f);
+		glm::vec4 viewCoords = invProjectionMatrix * clipCoords;
+		glm::vec3 rayDirection = glm::normalize(glm::vec3(viewCoords));
+		return glm::normalize(glm::vec3(invViewMatrix * glm::vec4(rayDirection, 0.0f)));
+	}
+
+	glm::vec4 tracePixel(int x, int y, const glm::vec3 &cameraPos, const glm::mat4 &invViewMatrix,
+						 const glm::mat4 &invProjectionMatrix, int numberOfSamples, RayBox box,
+						 uint64_t &segments, cpurt::FirstHit &firstHit) const {
+		// sample numberOfSamples of the sequence of the pixel, as initSampler() in the shader
+		cpurt::PixelSampler pixelSampler(sampler, static_cast<uint32_t>(x), static_cast<uint32_t>(y),
+										 static_cast<uint32_t>(numberOfSamples));
+
+		// fragUV interpolated at the pixel center
+		glm::vec2 fragUV((x + 0.5f) / width, (y + 0.5f) / height);
+
+		cpurt::Ray ray;
+		ray.origin = cameraPos;
+
+		glm::vec4 totalLight = glm::vec4(0.0f);
+		int rayPerPixel = 1;
+		for(int i = 0; i < rayPerPixel; i++) {
+			glm::vec2 jitter = cpurt::RandomPointInCircle(pixelSampler.get2D(0)) * 0.001f;
+			ray.direction = UVtoRayDirection(fragUV + jitter, invViewMatrix, invProjectionMatrix);
+			totalLight += cpurt::rayCasting(ray, pixelSampler, *scene, box, path, &segments, &firstHit);
+		}
+		return totalLight / static_cast<float>(rayPerPixel);
+	}
+};
@@ -0,0 +1,262 @@
+// Edge-avoiding à-trous denoiser (Dammertz et al. 2010, with the weights of SVGF)
+//
+// Every iteration is a 5x5 B3 spline filter whose taps are stepWidth pixels apart,
+// stepWidth doubling at every iteration. A tap is weighted down when it crosses an
+// edge of the first hit AOVs written by the tracer (albedo, normal, depth) or when its
+// luminance differs from the center more than the noise of the center pixel, estimated
+// from the sample variance kept for adaptive sampling.
+// The same filter runs on the GPU in shaders/Denoise.comp; here the planes are stored as
+// structure of arrays so that four neighbouring pixels are filtered at once with SSE,
+// with a scalar path for the borders and for the machines without SSE.
+//
+// Requires ThreadPool.hpp to be included first.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DENOISER_SSE 1
+#include <emmintrin.h>
+#else
+#define DENOISER_SSE 0
+#endif
+
+const int DENOISER_MAX_ITERATIONS = 8;	// the step width would exceed the image size
+
+struct DenoiseSettings {
+	int iterations = 5;
+	float sigmaColor = 4.0f;	// luminance tolerance, in standard deviations of the noise
+	float sigmaNormal = 128.0f;	// sharpness of the normal weight
+	float sigmaDepth = 1.0f;	// depth tolerance, in multiples of the depth gradient
+	float sigmaAlbedo = 0.1f;
+	float noiseScale = 0.5f;	// the noise estimate is scaled by this at every iteration
+};
+
+// Input of the denoiser, one entry per pixel, top row first
+struct DenoiseImage {
+	int width = 0;
+	int height = 0;
+	std::vector<glm::vec3> color;	// average radiance, replaced by the filtered one
+	std::vector<float> noise;	// standard deviation of the mean luminance
+	std::vector<glm::vec4> albedoDepth;	// first hit albedo, distance from the camera in w
+	std::vector<glm::vec3> normal;	// first hit normal, 0 where nothing is hit
+};
+
+class AtrousDenoiser {
+public:
+	DenoiseSettings settings;
+
+	void denoise(DenoiseImage &image, ThreadPool *pool = nullptr) {
+		W = image.width;
+		H = image.height;
+		size_t n = static_cast<size_t>(W) * H;
+		ThreadPool *P = pool ? pool : &ThreadPool::global();
+
+		for (auto *plane : {&r, &g, &b, &outR, &outG, &outB, &lum, &depth, &nx, &ny, &nz, &ar, &ag, &ab}) {
+			plane->resize(n);
+		}
+		colorScale.resize(n);
+		depthScale.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			r[i] = image.color[i].r;
+			g[i] = image.color[i].g;
+			b[i] = image.color[i].b;
+			depth[i] = image.albedoDepth[i].w;
+			ar[i] = image.albedoDepth[i].r;
+			ag[i] = image.albedoDepth[i].g;
+			ab[i] = image.albedoDepth[i].b;
+			glm::vec3 nn = image.normal[i];
+			float len = glm::length(nn);
+			nn = len > 0.0f ? nn / len : nn;
+			nx[i] = nn.x;
+			ny[i] = nn.y;
+			nz[i] = nn.z;
+		}
+		for (int y = 0; y < H; y++) {
+			for (int x = 0; x < W; x++) {
+				depthScale[index(x, y)] = depthGradient(x, y);
+			}
+		}
+
+		float noiseFactor = 1.0f;
+		for (int it = 0; it < settings.iterations; it++) {
+			int step = 1 << it;
+			for (size_t i = 0; i < n; i++) {
+				lum[i] = luminance(r[i], g[i], b[i]);
+				colorScale[i] = 1.0f / (settings.sigmaColor * image.noise[i] * noiseFactor + 1e-4f);
+			}
+			TaskGroup rows;
+			for (int y = 0; y < H; y++) {
+				P->submit(rows, [this, y, step]() { filterRow(y, step); });
+			}
+			P->wait(rows);
+			std::swap(r, outR);
+			std::swap(g, outG);
+			std::swap(b, outB);
+			noiseFactor *= settings.noiseScale;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			image.color[i] = glm::vec3(r[i], g[i], b[i]);
+		}
+	}
+
+private:
+	int W = 0, H = 0;
+	std::vector<float> r, g, b, outR, outG, outB, lum;
+	std::vector<float> depth, nx, ny, nz, ar, ag, ab;
+	std::vector<float> colorScale;	// 1 / luminance tolerance of every pixel in this iteration
+	std::vector<float> depthScale;	// depth gradient of every pixel
+
+	static constexpr float KERNEL[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+	size_t index(int x, int y) const {
+		return static_cast<size_t>(y) * W + x;
+	}
+
+	static float luminance(float r, float g, float b) {
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	}
+
+	// the smaller difference with the two neighbours on each axis, so that edges are not counted
+	float depthGradient(int x, int y) const {
+		float z = depth[index(x, y)];
+		auto at = [&](int qx, int qy) {
+			return depth[index(std::min(std::max(qx, 0), W - 1), std::min(std::max(qy, 0), H - 1))];
+		};
+		float gx = std::min(std::abs(at(x + 1, y) - z), std::abs(z - at(x - 1, y)));
+		float gy = std::min(std::abs(at(x, y + 1) - z), std::abs(z - at(x, y - 1)));
+		return std::max(gx, gy);
+	}
+
+	void filterRow(int y, int step) {
+		int x = 0;
+#if DENOISER_SSE
+		// the four pixels x..x+3 can be filtered together when all their taps are inside the image
+		bool rowInside = y - 2 * step >= 0 && y + 2 * step < H;
+		if (rowInside) {
+			for (; x < 2 * step && x < W; x++) {
+				filterPixel(x, y, step);
+			}
+			for (; x + 3 + 2 * step < W; x += 4) {
+				filterQuad(x, y, step);
+			}
+		}
+#endif
+		for (; x < W; x++) {
+			filterPixel(x, y, step);
+		}
+	}
+
+	// exponent of the weight of tap q for the center p, same as Denoise.comp
+	float tapExponent(size_t p, size_t q, float offsetLength) const {
+		float dAr = ar[q] - ar[p], dAg = ag[q] - ag[p], dAb = ab[q] - ab[p];
+		float cosNormals = std::min(nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q], 1.0f);
+		return std::abs(lum[q] - lum[p]) * colorScale[p] +
+			   std::abs(depth[q] - depth[p]) / (settings.sigmaDepth * depthScale[p] * offsetLength + 1e-3f) +
+			   settings.sigmaNormal * (1.0f - cosNormals) +
+			   (dAr * dAr + dAg * dAg + dAb * dAb) / (settings.sigmaAlbedo * settings.sigmaAlbedo);
+	}
+
+	void filterPixel(int x, int y, int step) {
+		size_t p = index(x, y);
+		float weightSum = KERNEL[0] * KERNEL[0];
+		float sr = weightSum * r[p], sg = weightSum * g[p], sb = weightSum * b[p];
+		for (int dy = -2; dy <= 2; dy++) {
+			for (int dx = -2; dx <= 2; dx++) {
+				int qx = x + dx * step, qy = y + dy * step;
+				if ((dx == 0 && dy == 0) || qx < 0 || qy < 0 || qx >= W || qy >= H) continue;
+				size_t q = index(qx, qy);
+				float offsetLength = std::sqrt(static_cast<float>(dx * dx + dy * dy)) * step;
+				float w = KERNEL[std::abs(dx)] * KERNEL[std::abs(dy)] * std::exp(-tapExponent(p, q, offsetLength));
+				sr += w * r[q];
+				sg += w * g[q];
+				sb += w * b[q];
+				weightSum += w;
+			}
+		}
+		outR[p] = sr / weightSum;
+		outG[p] = sg / weightSum;
+		outB[p] = sb / weightSum;
+	}
+
+#if DENOISER_SSE
+	// exp(x) for x <= 0: 2^(x log2 e) split in an integer power, built in the exponent bits,
+	// and a polynomial for the fractional part (relative error below 2e-7)
+	static __m128 expNegative(__m128 x) {
+		x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+		__m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+		__m128i ti = _mm_cvttps_epi32(t);
+		__m128 tf = _mm_cvtepi32_ps(ti);
+		tf = _mm_sub_ps(tf, _mm_and_ps(_mm_cmplt_ps(t, tf), _mm_set1_ps(1.0f)));	// floor
+		ti = _mm_cvttps_epi32(tf);
+		__m128 f = _mm_sub_ps(t, tf);
+
+		__m128 p = _mm_set1_ps(1.8775767e-3f);
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+
+		__m128i e = _mm_slli_epi32(_mm_add_epi32(ti, _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(p, _mm_castsi128_ps(e));
+	}
+
+	static __m128 absPs(__m128 v) {
+		return _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)));
+	}
+
+	// Filters the pixels x..x+3 of row y, all their taps are inside the image
+	void filterQuad(int x, int y, int step) {
+		size_t p = index(x, y);
+		__m128 pr = _mm_loadu_ps(&r[p]), pg = _mm_loadu_ps(&g[p]), pb = _mm_loadu_ps(&b[p]);
+		__m128 pLum = _mm_loadu_ps(&lum[p]), pDepth = _mm_loadu_ps(&depth[p]);
+		__m128 pnx = _mm_loadu_ps(&nx[p]), pny = _mm_loadu_ps(&ny[p]), pnz = _mm_loadu_ps(&nz[p]);
+		__m128 par = _mm_loadu_ps(&ar[p]), pag = _mm_loadu_ps(&ag[p]), pab = _mm_loadu_ps(&ab[p]);
+		__m128 pColorScale = _mm_loadu_ps(&colorScale[p]);
+		__m128 pDepthTolerance = _mm_mul_ps(_mm_set1_ps(settings.sigmaDepth), _mm_loadu_ps(&depthScale[p]));
+		__m128 sigmaNormal = _mm_set1_ps(settings.sigmaNormal);
+		__m128 albedoScale = _mm_set1_ps(1.0f / (settings.sigmaAlbedo * settings.sigmaAlbedo));
+		__m128 one = _mm_set1_ps(1.0f);
+
+		__m128 weightSum = _mm_set1_ps(KERNEL[0] * KERNEL[0]);
+		__m128 sr = _mm_mul_ps(weightSum, pr), sg = _mm_mul_ps(weightSum, pg), sb = _mm_mul_ps(weightSum, pb);
+		for (int dy = -2; dy <= 2; dy++) {
+			for (int dx = -2; dx <= 2; dx++) {
+				if (dx == 0 && dy == 0) continue;
+				size_t q = index(x + dx * step, y + dy * step);
+				float offsetLength = std::sqrt(static_cast<float>(dx * dx + dy * dy)) * step;
+
+				__m128 qr = _mm_loadu_ps(&r[q]), qg = _mm_loadu_ps(&g[q]), qb = _mm_loadu_ps(&b[q]);
+				__m128 exponent = _mm_mul_ps(absPs(_mm_sub_ps(_mm_loadu_ps(&lum[q]), pLum)), pColorScale);
+
+				__m128 depthTolerance = _mm_add_ps(_mm_mul_ps(pDepthTolerance, _mm_set1_ps(offsetLength)),
+												   _mm_set1_ps(1e-3f));
+				exponent = _mm_add_ps(exponent, _mm_div_ps(absPs(_mm_sub_ps(_mm_loadu_ps(&depth[q]), pDepth)),
+														   depthTolerance));
+
+				__m128 cosNormals = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pnx, _mm_loadu_ps(&nx[q])),
+														  _mm_mul_ps(pny, _mm_loadu_ps(&ny[q]))),
+											   _mm_mul_ps(pnz, _mm_loadu_ps(&nz[q])));
+				cosNormals = _mm_min_ps(cosNormals, one);
+				exponent = _mm_add_ps(exponent, _mm_mul_ps(sigmaNormal, _mm_sub_ps(one, cosNormals)));
+
+				__m128 dAr = _mm_sub_ps(_mm_loadu_ps(&ar[q]), par);
+				__m128 dAg = _mm_sub_ps(_mm_loadu_ps(&ag[q]), pag);
+				__m128 dAb = _mm_sub_ps(_mm_loadu_ps(&ab[q]), pab);
+				__m128 albedoDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dAr, dAr), _mm_mul_ps(dAg, dAg)),
+												   _mm_mul_ps(dAb, dAb));
+				exponent = _mm_add_ps(exponent, _mm_mul_ps(albedoDistance, albedoScale));
+
+				__m128 w = _mm_mul_ps(_mm_set1_ps(KERNEL[std::abs(dx)] * KERNEL[std::abs(dy)]),
+									  expNegative(_mm_sub_ps(_mm_setzero_ps(), exponent)));
+				sr = _mm_add_ps(sr, _mm_mul_ps(w, qr));
+				sg = _mm_add_ps(sg, _mm_mul_ps(w, qg));
+				sb = _mm_add_ps(sb, _mm_mul_ps(w, qb));
+				weightSum = _mm_add_ps(weightSum, w);
+			}
+		}
+		_mm_storeu_ps(&outR[p], _mm_div_ps(sr, weightSum));
+		_mm_storeu_ps(&outG[p], _mm_div_ps(sg, weightSum));
+		_mm_storeu_ps(&outB[p], _mm_div_ps(sb, weightSum));
+	}
+#endif
+};
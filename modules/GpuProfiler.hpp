@@ -0,0 +1,280 @@
+// GPU timing of the passes recorded in the command buffers
+//
+// Every pass (a pipeline and its draws, a dispatch, a blit) is enclosed between two
+// vkCmdWriteTimestamp and, optionally, a pipeline statistics query. The command buffers
+// are recorded per swap chain image (and per state of the application, see
+// BaseProject::commandBufferKey), so every image has its own query pools, reset at the
+// beginning of each of its command buffers, and every command buffer its own list of passes.
+//
+// Results are never waited for: collect(image, commandBuffer) is called when the image is
+// about to be used again, after drawFrame() has waited the fence of its previous submission,
+// and reads the queries of that submission. The timing of a frame is therefore available
+// as many frames later as there are swap chain images.
+//
+// Per frame results are returned by lastFrame(), passed to onFrame and, when a log is
+// open, appended to a CSV file with one row per pass.
+//
+// Requires Starter.hpp to be included first.
+
+#include <fstream>
+#include <functional>
+
+const int GPU_PROFILER_MAX_PASSES = 32;
+const int GPU_PROFILER_STATISTICS = 6;
+
+struct GpuPassTiming {
+	std::string name;
+	double ms = 0.0;
+	bool hasStatistics = false;
+	// input assembly vertices and primitives, vertex shader invocations,
+	// clipping primitives, fragment and compute shader invocations
+	uint64_t statistics[GPU_PROFILER_STATISTICS] = {};
+};
+
+struct GpuFrameTiming {
+	uint64_t frame = 0;	// index of the frame the passes belong to
+	double totalMs = 0.0;	// from the beginning of the first pass to the end of the last one
+	std::vector<GpuPassTiming> passes;
+};
+
+struct GpuProfiler {
+	BaseProject* BP = nullptr;
+	bool enabled = false;	// false when the graphics queue has no timestamps
+	bool statistics = false;
+	std::function<void(const GpuFrameTiming&)> onFrame;
+
+	void init(BaseProject* bp, bool pipelineStatistics);
+	void openLog(const std::string& path);
+
+	// To be recorded outside the render pass, before any pass of the command buffer
+	void resetQueries(VkCommandBuffer commandBuffer, int currentImage);
+	void beginPass(VkCommandBuffer commandBuffer, int currentImage, const char* name, bool withStatistics = true);
+	void endPass(VkCommandBuffer commandBuffer, int currentImage);
+
+	// Reads the results of the previous submission of currentImage, before it is submitted again.
+	// submitted is the command buffer of that submission, VK_NULL_HANDLE if there has been none.
+	void collect(int currentImage, VkCommandBuffer submitted);
+
+	bool hasResults() const { return resultCount > 0; }
+	// GpuFrameTiming::frame of the frame that is going to be submitted, before its collect()
+	uint64_t nextFrame() const { return frameCounter; }
+	const GpuFrameTiming& lastFrame() const { return last; }
+	void cleanup();
+
+private:
+	struct ImageQueries {
+		VkQueryPool timestampPool = VK_NULL_HANDLE;
+		VkQueryPool statisticsPool = VK_NULL_HANDLE;
+		uint64_t frame = 0;	// of the last submission
+	};
+
+	// Passes recorded in a command buffer, numbered as the queries of its image
+	struct RecordedPasses {
+		std::vector<std::string> names;
+		std::vector<bool> withStatistics;
+		bool open = false;	// a pass has begun and not ended
+	};
+
+	std::vector<ImageQueries> images;
+	std::map<VkCommandBuffer, RecordedPasses> recorded;
+	float timestampPeriod = 1.0f;	// nanoseconds per tick
+	uint64_t timestampMask = ~0ull;
+	uint64_t frameCounter = 0;
+	uint64_t resultCount = 0;
+	GpuFrameTiming last;
+	std::ofstream log;
+
+	ImageQueries& queries(int currentImage);
+};
+
+void GpuProfiler::init(BaseProject* bp, bool pipelineStatistics) {
+	BP = bp;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	timestampPeriod = properties.limits.timestampPeriod;
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, queueFamilies.data());
+	uint32_t validBits = queueFamilies[BP->findQueueFamilies(BP->physicalDevice).graphicsFamily.value()].timestampValidBits;
+	enabled = validBits > 0;
+	timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+	if (!enabled) {
+		std::cout << "GPU timestamps are not supported by the graphics queue, profiling disabled\n";
+	}
+
+	VkPhysicalDeviceFeatures features;
+	vkGetPhysicalDeviceFeatures(BP->physicalDevice, &features);
+	statistics = enabled && pipelineStatistics && features.pipelineStatisticsQuery;
+	if (pipelineStatistics && !statistics) {
+		std::cout << "Pipeline statistics queries are not supported\n";
+	}
+}
+
+void GpuProfiler::openLog(const std::string& path) {
+	log.open(path);
+	if (!log) {
+		throw std::runtime_error("failed to open " + path + "!");
+	}
+	log << "frame,pass,gpu_ms,ia_vertices,ia_primitives,vs_invocations,clipping_primitives,fs_invocations,cs_invocations\n";
+}
+
+GpuProfiler::ImageQueries& GpuProfiler::queries(int currentImage) {
+	if (currentImage >= (int)images.size()) {
+		images.resize(currentImage + 1);
+	}
+	ImageQueries& Q = images[currentImage];
+	if (Q.timestampPool != VK_NULL_HANDLE) {
+		return Q;
+	}
+
+	VkQueryPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = 2 * GPU_PROFILER_MAX_PASSES;
+	VkResult result = vkCreateQueryPool(BP->device, &poolInfo, nullptr, &Q.timestampPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create timestamp query pool!");
+	}
+
+	if (statistics) {
+		poolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+		poolInfo.queryCount = GPU_PROFILER_MAX_PASSES;
+		poolInfo.pipelineStatistics =
+			VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT |
+			VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+			VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+			VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+			VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+			VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+		result = vkCreateQueryPool(BP->device, &poolInfo, nullptr, &Q.statisticsPool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline statistics query pool!");
+		}
+	}
+	return Q;
+}
+
+void GpuProfiler::resetQueries(VkCommandBuffer commandBuffer, int currentImage) {
+	if (!enabled) return;
+	ImageQueries& Q = queries(currentImage);
+	recorded[commandBuffer] = RecordedPasses();	// the handle may belong to a freed command buffer
+	vkCmdResetQueryPool(commandBuffer, Q.timestampPool, 0, 2 * GPU_PROFILER_MAX_PASSES);
+	if (statistics) {
+		vkCmdResetQueryPool(commandBuffer, Q.statisticsPool, 0, GPU_PROFILER_MAX_PASSES);
+	}
+}
+
+void GpuProfiler::beginPass(VkCommandBuffer commandBuffer, int currentImage, const char* name, bool withStatistics) {
+	if (!enabled) return;
+	ImageQueries& Q = queries(currentImage);
+	RecordedPasses& R = recorded[commandBuffer];
+	if (R.open || R.names.size() >= GPU_PROFILER_MAX_PASSES) {
+		throw std::runtime_error("failed to begin GPU pass " + std::string(name) + ", passes cannot nest!");
+	}
+	uint32_t pass = static_cast<uint32_t>(R.names.size());
+	R.names.push_back(name);
+	R.withStatistics.push_back(statistics && withStatistics);
+	R.open = true;
+
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, Q.timestampPool, 2 * pass);
+	if (R.withStatistics.back()) {
+		vkCmdBeginQuery(commandBuffer, Q.statisticsPool, pass, 0);
+	}
+}
+
+void GpuProfiler::endPass(VkCommandBuffer commandBuffer, int currentImage) {
+	if (!enabled) return;
+	ImageQueries& Q = queries(currentImage);
+	RecordedPasses& R = recorded[commandBuffer];
+	uint32_t pass = static_cast<uint32_t>(R.names.size()) - 1;
+	if (R.withStatistics.back()) {
+		vkCmdEndQuery(commandBuffer, Q.statisticsPool, pass);
+	}
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, Q.timestampPool, 2 * pass + 1);
+	R.open = false;
+}
+
+void GpuProfiler::collect(int currentImage, VkCommandBuffer submitted) {
+	if (!enabled || currentImage >= (int)images.size()) return;
+	ImageQueries& Q = images[currentImage];
+	auto passes = recorded.find(submitted);
+	uint32_t passCount = passes == recorded.end() ? 0 : static_cast<uint32_t>(passes->second.names.size());
+
+	if (passCount > 0) {
+		const RecordedPasses& R = passes->second;
+		// the fence of the previous submission has been waited: no VK_QUERY_RESULT_WAIT_BIT
+		std::vector<uint64_t> ticks(2 * passCount);
+		VkResult result = vkGetQueryPoolResults(BP->device, Q.timestampPool, 0, 2 * passCount,
+			ticks.size() * sizeof(uint64_t), ticks.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+
+		std::vector<uint64_t> stats(passCount * GPU_PROFILER_STATISTICS, 0);
+		if (result == VK_SUCCESS && statistics) {
+			// queries of the passes without statistics are never available, read the others one by one
+			for (uint32_t p = 0; p < passCount; p++) {
+				if (!R.withStatistics[p]) continue;
+				vkGetQueryPoolResults(BP->device, Q.statisticsPool, p, 1,
+					GPU_PROFILER_STATISTICS * sizeof(uint64_t), &stats[p * GPU_PROFILER_STATISTICS],
+					GPU_PROFILER_STATISTICS * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+			}
+		}
+
+		if (result == VK_SUCCESS) {
+			GpuFrameTiming frame;
+			frame.frame = Q.frame;
+			for (uint32_t p = 0; p < passCount; p++) {
+				GpuPassTiming pass;
+				pass.name = R.names[p];
+				uint64_t ticksElapsed = ((ticks[2 * p + 1] - ticks[2 * p]) & timestampMask);
+				pass.ms = ticksElapsed * timestampPeriod * 1e-6;
+				pass.hasStatistics = R.withStatistics[p];
+				for (int s = 0; s < GPU_PROFILER_STATISTICS; s++) {
+					pass.statistics[s] = stats[p * GPU_PROFILER_STATISTICS + s];
+				}
+				frame.passes.push_back(pass);
+			}
+			frame.totalMs = ((ticks[2 * passCount - 1] - ticks[0]) & timestampMask) * timestampPeriod * 1e-6;
+
+			if (log.is_open()) {
+				for (const GpuPassTiming& pass : frame.passes) {
+					log << frame.frame << "," << pass.name << "," << pass.ms;
+					for (int s = 0; s < GPU_PROFILER_STATISTICS; s++) {
+						log << ",";
+						if (pass.hasStatistics) log << pass.statistics[s];
+					}
+					log << "\n";
+				}
+			}
+			last = std::move(frame);
+			resultCount++;
+			if (onFrame) {
+				onFrame(last);
+			}
+		}
+		else if (result != VK_NOT_READY) {
+			PrintVkError(result);
+		}
+	}
+
+	Q.frame = frameCounter++;
+}
+
+void GpuProfiler::cleanup() {
+	for (ImageQueries& Q : images) {
+		if (Q.timestampPool != VK_NULL_HANDLE) {
+			vkDestroyQueryPool(BP->device, Q.timestampPool, nullptr);
+		}
+		if (Q.statisticsPool != VK_NULL_HANDLE) {
+			vkDestroyQueryPool(BP->device, Q.statisticsPool, nullptr);
+		}
+	}
+	images.clear();
+	recorded.clear();
+	if (log.is_open()) {
+		log.close();
+	}
+}
@@ -0,0 +1,230 @@
+// Bounding volume hierarchy for the ray tracer
+//
+// Binned SAH build: at every node the centroids are distributed in BVH_BINS bins
+// along each axis and the split with the lowest surface area cost is taken.
+// Large subtrees are built in parallel on a ThreadPool.
+//
+// The result is flattened depth first in 32 byte nodes with a "miss" link:
+// the left child of an interior node is always the next node, and the miss link
+// points to the node that follows its whole subtree. This lets the shader walk
+// the tree without a stack: on a hit go to node + 1 (or test the primitives of a
+// leaf and follow the miss link), on a miss follow the miss link, stop at -1.
+//
+// Requires ThreadPool.hpp to be included first.
+
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 8;
+const int BVH_PARALLEL_THRESHOLD = 1024;	// subtrees with more primitives are built as separate tasks
+const uint32_t BVH_MAX_LEAF_COUNT = 0xFFu;	// fields of BVHNode::primInfo
+const uint32_t BVH_MAX_PRIM_REFS = 1u << 24;
+
+struct BVHNode {
+	glm::vec3 bmin;
+	uint32_t primInfo;	// primitive count << 24 | first primitive reference, count 0 for interior nodes
+	glm::vec3 bmax;
+	int32_t missIndex;	// next node when this subtree is skipped or done, -1 at the end
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode must match the std430 layout of RayShader.frag");
+
+struct BVHAabb {
+	glm::vec3 lo = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::max());
+
+	void grow(const glm::vec3 &p) {
+		lo = glm::min(lo, p);
+		hi = glm::max(hi, p);
+	}
+
+	void grow(const BVHAabb &b) {
+		lo = glm::min(lo, b.lo);
+		hi = glm::max(hi, b.hi);
+	}
+
+	bool empty() const {
+		return lo.x > hi.x;
+	}
+
+	float area() const {
+		if (empty()) return 0.0f;
+		glm::vec3 e = hi - lo;
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	glm::vec3 centroid() const {
+		return 0.5f * (lo + hi);
+	}
+};
+
+class BVHBuilder {
+public:
+	// Builds the hierarchy over the given primitive bounds.
+	// nodes receives the flattened tree, order the primitive indices in leaf order:
+	// the primitives of a leaf are order[first .. first + count).
+	void build(const std::vector<BVHAabb> &primBounds, std::vector<BVHNode> &nodes,
+			   std::vector<uint32_t> &order, ThreadPool *pool = nullptr) {
+		nodes.clear();
+		order.clear();
+		if (primBounds.empty()) return;
+
+		bounds = &primBounds;
+		centroids.resize(primBounds.size());
+		order.resize(primBounds.size());
+		for (size_t i = 0; i < primBounds.size(); i++) {
+			centroids[i] = primBounds[i].centroid();
+			order[i] = static_cast<uint32_t>(i);
+		}
+		indices = &order;
+		P = pool ? pool : &ThreadPool::global();
+
+		BuildNode root;
+		root.first = 0;
+		root.count = static_cast<uint32_t>(order.size());
+		buildRecursive(&root);
+		P->wait(subtrees);
+
+		nodes.reserve(subtreeSize(&root));
+		flatten(&root, -1, nodes);
+	}
+
+private:
+	struct BuildNode {
+		BVHAabb box;
+		uint32_t first = 0;
+		uint32_t count = 0;
+		int subtreeSize = 1;
+		std::unique_ptr<BuildNode> left, right;
+	};
+
+	struct Bin {
+		BVHAabb box;
+		int count = 0;
+	};
+
+	const std::vector<BVHAabb> *bounds = nullptr;
+	std::vector<glm::vec3> centroids;
+	std::vector<uint32_t> *indices = nullptr;
+	ThreadPool *P = nullptr;
+	TaskGroup subtrees;	// the parallel part of the build
+
+	void buildRecursive(BuildNode *node) {
+		BVHAabb centroidBox;
+		for (uint32_t i = node->first; i < node->first + node->count; i++) {
+			uint32_t p = (*indices)[i];
+			node->box.grow((*bounds)[p]);
+			centroidBox.grow(centroids[p]);
+		}
+
+		if (node->count <= 2) return;
+
+		// binned SAH over the three axes
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1, bestSplit = -1;
+		for (int axis = 0; axis < 3; axis++) {
+			float cmin = centroidBox.lo[axis], cmax = centroidBox.hi[axis];
+			if (cmax - cmin <= 1e-6f) continue;
+			float scale = BVH_BINS / (cmax - cmin);
+
+			Bin bins[BVH_BINS];
+			for (uint32_t i = node->first; i < node->first + node->count; i++) {
+				uint32_t p = (*indices)[i];
+				int b = std::min(BVH_BINS - 1, static_cast<int>((centroids[p][axis] - cmin) * scale));
+				bins[b].count++;
+				bins[b].box.grow((*bounds)[p]);
+			}
+
+			// areas and counts of the planes between bins, swept from both sides
+			float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+			int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+			BVHAabb lb, rb;
+			int lc = 0, rc = 0;
+			for (int i = 0; i < BVH_BINS - 1; i++) {
+				lc += bins[i].count;
+				lb.grow(bins[i].box);
+				leftCount[i] = lc;
+				leftArea[i] = lb.area();
+
+				rc += bins[BVH_BINS - 1 - i].count;
+				rb.grow(bins[BVH_BINS - 1 - i].box);
+				rightCount[BVH_BINS - 2 - i] = rc;
+				rightArea[BVH_BINS - 2 - i] = rb.area();
+			}
+			for (int i = 0; i < BVH_BINS - 1; i++) {
+				if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+				float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		// the cost of a leaf is (count * area), traversal cost taken as one intersection
+		float leafCost = node->count * node->box.area();
+		float splitCost = node->box.area() + bestCost;
+		if (node->count <= BVH_MAX_LEAF_SIZE && (bestAxis < 0 || splitCost >= leafCost)) return;
+
+		uint32_t *begin = indices->data() + node->first;
+		uint32_t *end = begin + node->count;
+		uint32_t *mid;
+		if (bestAxis >= 0) {
+			float cmin = centroidBox.lo[bestAxis];
+			float scale = BVH_BINS / (centroidBox.hi[bestAxis] - cmin);
+			mid = std::partition(begin, end, [&](uint32_t p) {
+				int b = std::min(BVH_BINS - 1, static_cast<int>((centroids[p][bestAxis] - cmin) * scale));
+				return b <= bestSplit;
+			});
+		}
+		else {
+			// all the centroids coincide: split in the middle to respect the leaf size
+			mid = begin + node->count / 2;
+		}
+
+		node->left = std::make_unique<BuildNode>();
+		node->right = std::make_unique<BuildNode>();
+		node->left->first = node->first;
+		node->left->count = static_cast<uint32_t>(mid - begin);
+		node->right->first = node->left->first + node->left->count;
+		node->right->count = node->count - node->left->count;
+
+		BuildNode *l = node->left.get(), *r = node->right.get();
+		if (node->count > BVH_PARALLEL_THRESHOLD) {
+			P->submit(subtrees, [this, l]() { buildRecursive(l); });
+			P->submit(subtrees, [this, r]() { buildRecursive(r); });
+		}
+		else {
+			buildRecursive(l);
+			buildRecursive(r);
+		}
+	}
+
+	// number of nodes of every subtree, needed to place the right children when flattening
+	int subtreeSize(BuildNode *node) {
+		if (!node->left) return 1;
+		node->subtreeSize = 1 + subtreeSize(node->left.get()) + subtreeSize(node->right.get());
+		return node->subtreeSize;
+	}
+
+	void flatten(BuildNode *node, int32_t missIndex, std::vector<BVHNode> &out) {
+		int index = static_cast<int>(out.size());
+		BVHNode n;
+		n.bmin = node->box.lo;
+		n.bmax = node->box.hi;
+		n.missIndex = missIndex;
+		if (!node->left && (node->count > BVH_MAX_LEAF_COUNT || node->first >= BVH_MAX_PRIM_REFS)) {
+			throw std::runtime_error("BVH leaf does not fit in primInfo!");
+		}
+		n.primInfo = node->left ? 0u : ((node->count << 24) | node->first);
+		out.push_back(n);
+
+		if (node->left) {
+			int rightIndex = index + 1 + node->left->subtreeSize;
+			flatten(node->left.get(), rightIndex, out);
+			flatten(node->right.get(), missIndex, out);
+		}
+	}
+};
@@ -0,0 +1,330 @@
+// Scene description of the ray tracer
+//
+// A material table and a flat list of geometries, each referencing its material
+// by index. The geometries of every box are stored contiguously and RayBox gives
+// their range, so the whole scene is uploaded once and the shader just selects the
+// range of the current box. The same data is used by the CPU tracer.
+// The structs follow the std430 layout of the storage buffers in RayShader.frag.
+// buildBVH() builds one hierarchy per box (see RayBVH.hpp) into the shared nodes
+// and primRefs arrays, RayBox::rootNode is the node the traversal starts from.
+// Triangle meshes are flattened in world space in meshVertices and triangles,
+// their primitive references have RAY_TRIANGLE_BIT set.
+// The emissive spheres and finite planes of every box are listed in lights, they are
+// sampled directly at the diffuse hits (next event estimation); emissive triangles are not.
+//
+// Requires RayBVH.hpp to be included first.
+
+const int RAY_NONE = -1;
+const int RAY_SPHERE = 0;
+const int RAY_PLANE = 1;
+
+const float NON_DIELECTRIC_REFRACTIVE_INDEX = 1e-6f;
+
+const uint32_t RAY_TRIANGLE_BIT = 0x80000000u;	// primRefs entry that refers to triangles[], not geometries[]
+
+struct RayMaterial {
+	glm::vec4 color;
+	glm::vec4 emissionColor;
+	float emissionStrength;
+	float smoothness;
+	float dieletricConstant;
+	float pad;
+};
+
+struct RayGeometry {
+	int type;
+	int materialIndex;
+	float width;	// finite planes only, 0 for infinite ones
+	float height;
+	glm::vec4 center;	// spheres: xyz = center, w = radius
+	glm::vec4 point;	// planes: corner of the rectangle
+	glm::vec4 normal;
+	glm::vec4 vWidth;
+	glm::vec4 vHeight;
+	int sampledLight;	// 1 when listed in lights, only those hits are weighted with MIS
+	int pad[3];
+};
+
+static_assert(sizeof(RayGeometry) == 112, "RayGeometry must match the std430 layout of RayShader.frag");
+
+// Same position/normal pair as the raster vertices, packed without padding
+struct RayMeshVertex {
+	float position[3];
+	float normal[3];
+};
+
+struct RayTriangle {
+	uint32_t v0, v1, v2;	// absolute indices in meshVertices
+	int materialIndex;
+};
+
+// Vertices of a Model as uploaded to its raster vertex buffer, described by the
+// stride and the offsets of its VertexDescriptor, with their index buffer
+struct RayMeshSource {
+	const std::vector<unsigned char> *vertices;
+	const std::vector<uint32_t> *indices;
+	uint32_t stride;
+	uint32_t positionOffset;
+	uint32_t normalOffset;
+	float radius;	// bounding radius around the origin, used to place meshes in place of spheres
+};
+
+struct RayBox {
+	int firstObject;
+	int objectCount;
+	int rootNode;	// -1 until buildBVH() is called or if the box is empty
+	int firstTriangle;
+	int triangleCount;
+	int firstLight;	// range of the box in lights, lightCount 0 disables light sampling
+	int lightCount;
+};
+
+class RayScene {
+public:
+	std::vector<RayMaterial> materials;
+	std::vector<RayGeometry> geometries;
+	std::vector<RayBox> boxes;
+
+	std::vector<RayMeshVertex> meshVertices;
+	std::vector<RayTriangle> triangles;
+
+	std::vector<BVHNode> nodes;
+	std::vector<uint32_t> primRefs;	// geometry index of the primitives of the BVH leaves
+	std::vector<uint32_t> lights;	// geometry index of the emitters that can be sampled
+
+	int addMaterial(glm::vec4 color, float smoothness = 0.0f,
+					float dieletricConstant = NON_DIELECTRIC_REFRACTIVE_INDEX) {
+		materials.push_back({color, glm::vec4(0.0f), 0.0f, smoothness, dieletricConstant, 0.0f});
+		return static_cast<int>(materials.size()) - 1;
+	}
+
+	int addLight(glm::vec4 emissionColor, float emissionStrength) {
+		materials.push_back({glm::vec4(0.0f), emissionColor, emissionStrength, 0.0f,
+							 NON_DIELECTRIC_REFRACTIVE_INDEX, 0.0f});
+		return static_cast<int>(materials.size()) - 1;
+	}
+
+	void addSphere(int material, glm::vec3 center, float radius) {
+		RayGeometry g{};
+		g.type = RAY_SPHERE;
+		g.materialIndex = material;
+		g.center = glm::vec4(center, radius);
+		geometries.push_back(g);
+	}
+
+	// point is the corner of the rectangle, vWidth and vHeight the (unit) directions of its sides
+	void addPlane(int material, glm::vec3 point, glm::vec3 normal, glm::vec3 vWidth,
+				  glm::vec3 vHeight, float width, float height) {
+		RayGeometry g{};
+		g.type = RAY_PLANE;
+		g.materialIndex = material;
+		g.width = width;
+		g.height = height;
+		g.point = glm::vec4(point, 1.0f);
+		g.normal = glm::vec4(normal, 0.0f);
+		g.vWidth = glm::vec4(vWidth, 0.0f);
+		g.vHeight = glm::vec4(vHeight, 0.0f);
+		geometries.push_back(g);
+	}
+
+	// Adds the triangles of a mesh transformed by Wm, all with the same material
+	void addMesh(int material, const RayMeshSource &mesh, const glm::mat4 &Wm) {
+		uint32_t base = static_cast<uint32_t>(meshVertices.size());
+		size_t count = mesh.vertices->size() / mesh.stride;
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(Wm)));
+
+		for (size_t i = 0; i < count; i++) {
+			const unsigned char *v = mesh.vertices->data() + i * mesh.stride;
+			glm::vec3 pos, norm;
+			memcpy(&pos, v + mesh.positionOffset, sizeof(glm::vec3));
+			memcpy(&norm, v + mesh.normalOffset, sizeof(glm::vec3));
+			pos = glm::vec3(Wm * glm::vec4(pos, 1.0f));
+			norm = glm::normalize(normalMatrix * norm);
+
+			RayMeshVertex rv;
+			for (int k = 0; k < 3; k++) {
+				rv.position[k] = pos[k];
+				rv.normal[k] = norm[k];
+			}
+			meshVertices.push_back(rv);
+		}
+
+		const std::vector<uint32_t> &idx = *mesh.indices;
+		for (size_t t = 0; t + 2 < idx.size(); t += 3) {
+			triangles.push_back({base + idx[t], base + idx[t + 1], base + idx[t + 2], material});
+		}
+	}
+
+	// Geometries and meshes added between beginBox() and endBox() form a new box
+	void beginBox() {
+		boxes.push_back({static_cast<int>(geometries.size()), 0, -1, static_cast<int>(triangles.size()), 0,
+						 static_cast<int>(lights.size()), 0});
+	}
+
+	void endBox() {
+		RayBox &box = boxes.back();
+		box.objectCount = static_cast<int>(geometries.size()) - box.firstObject;
+		box.triangleCount = static_cast<int>(triangles.size()) - box.firstTriangle;
+		for (int i = box.firstObject; i < box.firstObject + box.objectCount; i++) {
+			if (isSampledLight(geometries[i])) {
+				lights.push_back(static_cast<uint32_t>(i));
+				geometries[i].sampledLight = 1;
+			}
+		}
+		box.lightCount = static_cast<int>(lights.size()) - box.firstLight;
+	}
+
+	// Emitters with a finite area: spheres and finite planes
+	bool isSampledLight(const RayGeometry &g) const {
+		if (materials[g.materialIndex].emissionStrength <= 0.0f) return false;
+		return g.type == RAY_SPHERE || (g.type == RAY_PLANE && g.width > 0.1f && g.height > 0.1f);
+	}
+
+	RayBox getBox(int box) const {
+		return boxes[std::min(std::max(box, 0), static_cast<int>(boxes.size()) - 1)];
+	}
+
+	// Bounds of a geometry, finite planes are padded since they are flat on one axis
+	static BVHAabb geometryBounds(const RayGeometry &g) {
+		BVHAabb b;
+		if (g.type == RAY_SPHERE) {
+			glm::vec3 c = glm::vec3(g.center);
+			b.grow(c - glm::vec3(g.center.w));
+			b.grow(c + glm::vec3(g.center.w));
+		}
+		else if (g.type == RAY_PLANE) {
+			if (g.width > 0.1f || g.height > 0.1f) {
+				glm::vec3 A = glm::vec3(g.point);
+				glm::vec3 W = g.width * glm::vec3(g.vWidth);
+				glm::vec3 H = g.height * glm::vec3(g.vHeight);
+				b.grow(A);
+				b.grow(A + W);
+				b.grow(A + H);
+				b.grow(A + W + H);
+				b.lo -= glm::vec3(1e-3f);
+				b.hi += glm::vec3(1e-3f);
+			}
+			else {
+				b.grow(glm::vec3(-1e4f));
+				b.grow(glm::vec3(1e4f));
+			}
+		}
+		return b;
+	}
+
+	BVHAabb triangleBounds(const RayTriangle &t) const {
+		BVHAabb b;
+		for (uint32_t v : {t.v0, t.v1, t.v2}) {
+			const float *p = meshVertices[v].position;
+			b.grow(glm::vec3(p[0], p[1], p[2]));
+		}
+		return b;
+	}
+
+	// Builds the hierarchy of every box. Node and primitive indices are absolute,
+	// so the arrays can be uploaded as they are and shared by all the boxes.
+	void buildBVH(ThreadPool *pool = nullptr) {
+		nodes.clear();
+		primRefs.clear();
+		BVHBuilder builder;
+		std::vector<BVHAabb> bounds;
+		std::vector<BVHNode> boxNodes;
+		std::vector<uint32_t> order;
+
+		for (RayBox &box : boxes) {
+			bounds.clear();
+			for (int i = box.firstObject; i < box.firstObject + box.objectCount; i++) {
+				bounds.push_back(geometryBounds(geometries[i]));
+			}
+			for (int i = box.firstTriangle; i < box.firstTriangle + box.triangleCount; i++) {
+				bounds.push_back(triangleBounds(triangles[i]));
+			}
+			builder.build(bounds, boxNodes, order, pool);
+			if (boxNodes.empty()) {
+				box.rootNode = -1;
+				continue;
+			}
+
+			int32_t nodeBase = static_cast<int32_t>(nodes.size());
+			uint32_t primBase = static_cast<uint32_t>(primRefs.size());
+			if (primRefs.size() + order.size() > BVH_MAX_PRIM_REFS) {
+				throw std::runtime_error("Too many primitives in the scene for the BVH!");
+			}
+			for (BVHNode n : boxNodes) {
+				if (n.primInfo != 0) n.primInfo += primBase;
+				if (n.missIndex >= 0) n.missIndex += nodeBase;
+				nodes.push_back(n);
+			}
+			for (uint32_t o : order) {
+				if (o < static_cast<uint32_t>(box.objectCount)) {
+					primRefs.push_back(static_cast<uint32_t>(box.firstObject) + o);
+				}
+				else {
+					primRefs.push_back(RAY_TRIANGLE_BIT |
+						(static_cast<uint32_t>(box.firstTriangle) + o - box.objectCount));
+				}
+			}
+			box.rootNode = nodeBase;
+		}
+	}
+
+	// The three boxes of the project. With sphereMesh the spheres are traced as
+	// the triangles of that mesh (models/Sphere.obj) instead of analytically.
+	static RayScene cornellBoxes(const RayMeshSource *sphereMesh = nullptr) {
+		RayScene S;
+		auto sphere = [&S, sphereMesh](int material, glm::vec3 center, float radius) {
+			if (sphereMesh) {
+				glm::mat4 Wm = glm::translate(glm::mat4(1.0f), center) *
+							   glm::scale(glm::mat4(1.0f), glm::vec3(radius / sphereMesh->radius));
+				S.addMesh(material, *sphereMesh, Wm);
+			}
+			else {
+				S.addSphere(material, center, radius);
+			}
+		};
+		const glm::vec3 X(1.0f, 0.0f, 0.0f), Y(0.0f, 1.0f, 0.0f), Z(0.0f, 0.0f, 1.0f);
+
+		int white = S.addMaterial(glm::vec4(1.0f));
+		int red = S.addMaterial(glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
+		int green = S.addMaterial(glm::vec4(0.0f, 1.0f, 0.0f, 1.0f));
+		int blue = S.addMaterial(glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+		int mirror = S.addMaterial(glm::vec4(1.0f), 1.0f);
+		int light = S.addLight(glm::vec4(1.0f), 1.0f);
+		int greenBall = S.addMaterial(glm::vec4(0.0f, 1.0f, 0.0f, 1.0f), 0.2f);
+		int redBall = S.addMaterial(glm::vec4(1.0f, 0.0f, 0.0f, 1.0f), 0.9f);
+		int glass = S.addMaterial(glm::vec4(1.0f, 1.0f, 1.0f, 0.0f), 0.0f, 1.5f);
+		int yellowBall = S.addMaterial(glm::vec4(1.0f, 1.0f, 0.0f, 1.0f), 0.7f);
+
+		for (int b = 0; b < 3; b++) {
+			float z0 = 12.0f * b;
+			bool mirrors = (b == 2);
+
+			S.beginBox();
+			S.addPlane(white, glm::vec3(0.0f, 0.0f, z0), Y, X, Z, 10.0f, 10.0f);							// floor
+			S.addPlane(mirrors ? mirror : red, glm::vec3(0.0f, 0.0f, z0), Z, X, Y, 10.0f, 10.0f);			// left wall
+			S.addPlane(mirrors ? mirror : green, glm::vec3(0.0f, 0.0f, z0 + 10.0f), -Z, X, Y, 10.0f, 10.0f);	// right wall
+			S.addPlane(mirrors ? blue : white, glm::vec3(10.0f, 0.0f, z0), -X, Z, Y, 10.0f, 10.0f);			// back wall
+			S.addPlane(white, glm::vec3(0.0f, 10.0f, z0), -Y, X, Z, 10.0f, 10.0f);							// ceiling
+
+			if (b == 0) {
+				S.addPlane(light, glm::vec3(3.0f, 9.99f, 3.0f), -Y, X, Z, 4.0f, 4.0f);
+				sphere(greenBall, glm::vec3(7.0f, 1.5f, 2.5f), 1.5f);
+				sphere(redBall, glm::vec3(7.0f, 1.5f, 7.5f), 1.5f);
+			}
+			else if (b == 1) {
+				S.addPlane(light, glm::vec3(3.0f, 9.99f, 15.0f), -Y, X, Z, 4.0f, 4.0f);
+				sphere(greenBall, glm::vec3(7.0f, 1.5f, 14.5f), 1.5f);
+				// the red ball of this box has always been rendered perfectly diffuse
+				sphere(red, glm::vec3(7.0f, 1.5f, 19.5f), 1.5f);
+				sphere(glass, glm::vec3(3.0f, 1.5f, 17.0f), 1.5f);
+			}
+			else {
+				sphere(light, glm::vec3(5.0f, 7.0f, 29.0f), 1.5f);
+				sphere(yellowBall, glm::vec3(5.0f, 2.64f, 29.0f), 1.5f);
+			}
+			S.endBox();
+		}
+		S.buildBVH();
+		return S;
+	}
+};
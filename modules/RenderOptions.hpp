@@ -0,0 +1,299 @@
+// Command line options of the renderer
+//
+//   --headless             render with the CPU tracer, without window nor Vulkan device
+//   --width W --height H   resolution of the image (and of the window)
+//   --spp N                samples per pixel; in a window, the image is saved and the
+//                          application closes once N samples have been accumulated
+//   --box B                box to render: 0-2 path traced, 3-5 rasterized (window only)
+//   --camera X,Y,Z         camera position
+//   --yaw DEG --pitch DEG  camera angles (CamAlpha and CamBeta of the application)
+//   --output FILE          .png, .jpg, .bmp, .tga or .hdr (linear radiance)
+//   --mesh-spheres         trace the spheres as the triangles of models/Sphere.obj
+//   --fragment             trace with the fragment shader instead of the compute one
+//   --benchmark FILE       fly the scripted camera paths through the boxes and write
+//                          frame time percentiles and throughput to a JSON file;
+//                          presents with IMMEDIATE (else MAILBOX) instead of FIFO
+//   --frames N             measured frames per box in the benchmark
+//   --gpu-profile FILE     log the GPU time of every pass, one CSV row per pass and frame
+//   --pipeline-stats       also collect the pipeline statistics of the passes
+//   --no-nee               disable the direct sampling of the lights (next event estimation)
+//   --adaptive T           pixels stop sampling when the relative standard error of their
+//                          mean luminance is below T (default 0.02, 0 samples every pixel)
+//   --min-samples N        samples of every pixel before its convergence is tested
+//   --denoise              filter the image with the edge-aware à-trous denoiser
+//                          (in a window: compute tracer only, N toggles it)
+//   --denoise-iterations N passes of the denoiser (default 5, 1-8)
+//   --no-reprojection      restart the accumulation whenever the camera moves
+//   --history N            samples kept by the reprojection while moving (default 32)
+//   --max-depth N          bounces of a path in the interactive mode (default 5)
+//   --roulette-depth N     first bounce that Russian roulette can end (default 3)
+//   --no-roulette          paths always run to the maximum depth unless they miss or hit a light
+//   --sampler NAME         random numbers of the tracers: sobol (Owen-scrambled, default) or pcg
+//   --mode NAME            interactive (--max-depth, 1 sample per frame, default), preview (depth 2,
+//                          1 sample per frame) or final (depth 8, 4 samples per frame); M cycles them
+//   --pipeline-cache FILE  file of the Vulkan pipeline cache, loaded at startup and saved on exit
+//                          (default pipeline_cache.bin)
+//   --no-pipeline-cache    compile the pipelines without reading nor writing the cache file
+//
+// Images are written with stb_image_write, included by Starter.hpp.
+
+#include <string>
+#include <sstream>
+#include <cctype>
+
+// Presets of the ray tracers. In a window each one is a variant of the ray tracing pipelines,
+// with the depth and the samples per frame as specialization constants.
+enum RenderMode {
+	RENDER_INTERACTIVE = 0,
+	RENDER_PREVIEW = 1,
+	RENDER_FINAL = 2,
+	RENDER_MODE_COUNT = 3
+};
+
+struct RenderModeSettings {
+	const char* name;
+	cpurt::PathSettings path;
+	int samplesPerFrame;	// samples of every pixel traced in a frame (the CPU tracer always traces 1)
+};
+
+struct RenderOptions {
+	bool headless = false;
+	bool batch = false;	// an output has been requested: no user input, exit when done
+	int width = 1024;
+	int height = 512;
+	int spp = 64;
+	int box = 0;
+	glm::vec3 camPos = glm::vec3(-21.0f, 5.0f, 16.0f);
+	float camAlpha = -75.0f;	// degrees
+	float camBeta = -10.0f;
+	std::string output = "render.png";
+	bool meshSpheres = false;
+	bool fragmentTracing = false;
+	std::string benchmark;	// empty: no benchmark
+	int benchmarkFrames = 240;
+	std::string gpuProfile;	// empty: no CSV log
+	bool pipelineStatistics = false;
+	bool lightSampling = true;
+	float convergenceThreshold = 0.02f;
+	int minSamples = 32;
+	bool denoise = false;
+	int denoiseIterations = 5;
+	bool reprojection = true;
+	int maxHistory = 32;
+	cpurt::PathSettings path;
+	bool roulette = true;
+	cpurt::SamplerType sampler = cpurt::SAMPLER_SOBOL;
+	RenderMode mode = RENDER_INTERACTIVE;
+	std::string pipelineCache = "pipeline_cache.bin";	// empty: not saved
+
+	// The interactive mode uses --max-depth and --roulette-depth
+	RenderModeSettings modeSettings(RenderMode m) const {
+		RenderModeSettings settings = { "interactive", path, 1 };
+		if (m == RENDER_PREVIEW) {
+			settings = { "preview", path, 1 };
+			settings.path.maxDepth = 2;
+		}
+		else if (m == RENDER_FINAL) {
+			settings = { "final", path, 4 };
+			settings.path.maxDepth = 8;
+		}
+		if (!roulette) {
+			settings.path.rouletteDepth = settings.path.maxDepth;
+		}
+		return settings;
+	}
+
+	static void printUsage(const char* program) {
+		std::cout << "Usage: " << program << " [--headless] [--width W] [--height H] [--spp N] [--box B]\n"
+			<< "       [--camera X,Y,Z] [--yaw DEG] [--pitch DEG] [--output FILE]\n"
+			<< "       [--mesh-spheres] [--fragment] [--benchmark FILE] [--frames N]\n"
+			<< "       [--gpu-profile FILE] [--pipeline-stats] [--no-nee]\n"
+			<< "       [--adaptive T] [--min-samples N] [--denoise] [--denoise-iterations N]\n"
+			<< "       [--no-reprojection] [--history N] [--max-depth N] [--roulette-depth N] [--no-roulette]\n"
+			<< "       [--sampler sobol|pcg] [--mode interactive|preview|final]\n"
+			<< "       [--pipeline-cache FILE] [--no-pipeline-cache]\n";
+	}
+
+	void parse(int argc, char** argv) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) {
+					throw std::runtime_error("missing value for " + arg + "!");
+				}
+				return argv[++i];
+			};
+
+			if (arg == "--headless") {
+				headless = true;
+				batch = true;
+			}
+			else if (arg == "--width") {
+				width = std::stoi(value());
+			}
+			else if (arg == "--height") {
+				height = std::stoi(value());
+			}
+			else if (arg == "--spp") {
+				spp = std::stoi(value());
+				batch = true;
+			}
+			else if (arg == "--box") {
+				box = std::stoi(value());
+			}
+			else if (arg == "--camera") {
+				std::stringstream ss(value());
+				char comma;
+				if (!(ss >> camPos.x >> comma >> camPos.y >> comma >> camPos.z)) {
+					throw std::runtime_error("invalid camera position, expected X,Y,Z!");
+				}
+			}
+			else if (arg == "--yaw") {
+				camAlpha = std::stof(value());
+			}
+			else if (arg == "--pitch") {
+				camBeta = std::stof(value());
+			}
+			else if (arg == "--output") {
+				output = value();
+				batch = true;
+			}
+			else if (arg == "--mesh-spheres") {
+				meshSpheres = true;
+			}
+			else if (arg == "--fragment") {
+				fragmentTracing = true;
+			}
+			else if (arg == "--benchmark") {
+				benchmark = value();
+			}
+			else if (arg == "--frames") {
+				benchmarkFrames = std::stoi(value());
+			}
+			else if (arg == "--gpu-profile") {
+				gpuProfile = value();
+			}
+			else if (arg == "--pipeline-stats") {
+				pipelineStatistics = true;
+			}
+			else if (arg == "--no-nee") {
+				lightSampling = false;
+			}
+			else if (arg == "--adaptive") {
+				convergenceThreshold = std::stof(value());
+			}
+			else if (arg == "--min-samples") {
+				minSamples = std::stoi(value());
+			}
+			else if (arg == "--denoise") {
+				denoise = true;
+			}
+			else if (arg == "--denoise-iterations") {
+				denoiseIterations = std::stoi(value());
+				denoise = true;
+			}
+			else if (arg == "--no-reprojection") {
+				reprojection = false;
+			}
+			else if (arg == "--history") {
+				maxHistory = std::stoi(value());
+			}
+			else if (arg == "--max-depth") {
+				path.maxDepth = std::stoi(value());
+			}
+			else if (arg == "--roulette-depth") {
+				path.rouletteDepth = std::stoi(value());
+			}
+			else if (arg == "--no-roulette") {
+				roulette = false;
+			}
+			else if (arg == "--sampler") {
+				std::string name = value();
+				if (name == "sobol") {
+					sampler = cpurt::SAMPLER_SOBOL;
+				}
+				else if (name == "pcg") {
+					sampler = cpurt::SAMPLER_PCG;
+				}
+				else {
+					throw std::runtime_error("unknown sampler " + name + ", use sobol or pcg!");
+				}
+			}
+			else if (arg == "--mode") {
+				std::string name = value();
+				int m = 0;
+				while (m < RENDER_MODE_COUNT && name != modeSettings((RenderMode)m).name) {
+					m++;
+				}
+				if (m == RENDER_MODE_COUNT) {
+					throw std::runtime_error("unknown mode " + name + ", use interactive, preview or final!");
+				}
+				mode = (RenderMode)m;
+			}
+			else if (arg == "--pipeline-cache") {
+				pipelineCache = value();
+			}
+			else if (arg == "--no-pipeline-cache") {
+				pipelineCache.clear();
+			}
+			else {
+				printUsage(argv[0]);
+				throw std::runtime_error("unknown option " + arg + "!");
+			}
+		}
+
+		if (width <= 0 || height <= 0 || spp <= 0 || benchmarkFrames <= 1) {
+			throw std::runtime_error("width, height and spp must be positive, frames greater than 1!");
+		}
+		if (convergenceThreshold < 0.0f || minSamples < 2) {
+			throw std::runtime_error("the adaptive threshold cannot be negative, the minimum samples must be at least 2!");
+		}
+		if (path.maxDepth < 1 || path.rouletteDepth < 1) {
+			throw std::runtime_error("the maximum depth and the roulette depth must be at least 1!");
+		}
+		if (maxHistory < 1) {
+			throw std::runtime_error("the reprojected history must keep at least 1 sample!");
+		}
+		if (denoiseIterations < 1 || denoiseIterations > DENOISER_MAX_ITERATIONS) {
+			throw std::runtime_error("the denoiser runs from 1 to " + std::to_string(DENOISER_MAX_ITERATIONS) + " iterations!");
+		}
+		if (box < 0 || box > 5 || (headless && box > 2)) {
+			throw std::runtime_error("invalid box, the CPU tracer renders boxes 0-2!");
+		}
+	}
+};
+
+// Writes an image choosing the format from the extension of path.
+// rgba8 is used for the 8 bit formats, rgb32f (linear) for .hdr; rows start from the top.
+inline void writeImage(const std::string& path, int width, int height,
+					   const std::vector<unsigned char>& rgba8, const std::vector<float>& rgb32f) {
+	std::string ext = path.substr(path.find_last_of('.') + 1);
+	for (char& c : ext) {
+		c = (char)tolower(c);
+	}
+
+	int ok = 0;
+	if (ext == "png") {
+		ok = stbi_write_png(path.c_str(), width, height, 4, rgba8.data(), width * 4);
+	}
+	else if (ext == "jpg" || ext == "jpeg") {
+		ok = stbi_write_jpg(path.c_str(), width, height, 4, rgba8.data(), 95);
+	}
+	else if (ext == "bmp") {
+		ok = stbi_write_bmp(path.c_str(), width, height, 4, rgba8.data());
+	}
+	else if (ext == "tga") {
+		ok = stbi_write_tga(path.c_str(), width, height, 4, rgba8.data());
+	}
+	else if (ext == "hdr") {
+		ok = stbi_write_hdr(path.c_str(), width, height, 3, rgb32f.data());
+	}
+	else {
+		throw std::runtime_error("unsupported image format: " + path + "!");
+	}
+
+	if (!ok) {
+		throw std::runtime_error("failed to write " + path + "!");
+	}
+	std::cout << "Image saved to " << path << "\n";
+}
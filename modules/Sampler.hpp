@@ -0,0 +1,133 @@
+// Random numbers of the CPU tracer, same as shaders/Sampler.glsl
+//
+// Owen-scrambled Sobol points (Burley 2020, "Practical Hash-based Owen Scrambling"):
+// sample index of a pixel is shuffled and mapped to the first two Sobol dimensions, and
+// every pair of dimensions requested by the tracer (pixel jitter, BSDF, light, ...) gets
+// its own seed, so the pairs are decorrelated from each other while each one keeps the
+// stratification of the sequence. The seed of a pixel is a hash of its coordinates.
+// The PCG generator used before stays available as SAMPLER_PCG, for comparisons.
+
+namespace cpurt {
+
+enum SamplerType {
+	SAMPLER_PCG = 0,
+	SAMPLER_SOBOL = 1
+};
+
+// Dimensions used by every bounce, after dimension 0 of the pixel jitter
+const uint32_t SAMPLER_BOUNCE_DIMENSIONS = 5;
+enum SamplerSlot {
+	SLOT_BSDF = 0,	// direction of the bounce (2D)
+	SLOT_LIGHT = 1,	// point on the light (2D)
+	SLOT_LIGHT_PICK = 2,	// light chosen for next event estimation (1D)
+	SLOT_LOBE = 3,	// reflection or refraction at dielectrics (1D)
+	SLOT_ROULETTE = 4	// Russian roulette (1D)
+};
+
+// -------------------------- PCG -----------------------------
+inline uint32_t NextRandom(uint32_t &state) {
+	state = state * 747796405u + 2891336453u;
+	uint32_t result = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+	result = (result >> 22) ^ result;
+	return result;
+}
+
+inline float RandomValue(uint32_t &state) {
+	return static_cast<float>(NextRandom(state)) / 4294967295.0f;
+}
+
+// ------------------------- SOBOL ----------------------------
+// lowbias32 (C. Wellons)
+inline uint32_t hashUint(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v) {
+	return seed ^ (hashUint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// bitfieldReverse() of GLSL
+inline uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Laine-Karras permutation as improved by N. Vegdahl: every bit only depends on the lower ones
+inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Base 2 Owen scrambling: every bit is flipped depending on the more significant ones
+inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Second Sobol dimension, direction numbers v[0] = 2^31, v[k+1] = v[k] ^ (v[k] >> 1)
+inline uint32_t sobolSecondDimension(uint32_t index) {
+	uint32_t result = 0;
+	for(uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+		if(index & 1u) {
+			result ^= v;
+		}
+	}
+	return result;
+}
+
+// [0, 1) from the 24 most significant bits, exact in a float
+inline float uintToUnit(uint32_t x) {
+	return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+}
+
+inline uint32_t sampleDimension(int bounce, SamplerSlot slot) {
+	return 1u + static_cast<uint32_t>(bounce) * SAMPLER_BOUNCE_DIMENSIONS + static_cast<uint32_t>(slot);
+}
+
+// Sample index of one pixel, as the sampler globals of the shader
+class PixelSampler {
+public:
+	PixelSampler(SamplerType samplerType, uint32_t x, uint32_t y, uint32_t index)
+		: type(samplerType), seed(hashUint(x ^ hashUint(y))), sampleIndex(index),
+		  randomState(hashUint(seed ^ hashUint(index))) {}
+
+	glm::vec2 get2D(uint32_t dimension) {
+		if(type == SAMPLER_PCG) {
+			float u1 = RandomValue(randomState);
+			return glm::vec2(u1, RandomValue(randomState));
+		}
+		uint32_t s = hashCombine(seed, dimension);
+		uint32_t index = nestedUniformScramble(sampleIndex, s);
+		uint32_t x = nestedUniformScramble(reverseBits(index), hashCombine(s, 1u));
+		uint32_t y = nestedUniformScramble(sobolSecondDimension(index), hashCombine(s, 2u));
+		return glm::vec2(uintToUnit(x), uintToUnit(y));
+	}
+
+	float get1D(uint32_t dimension) {
+		if(type == SAMPLER_PCG) {
+			return RandomValue(randomState);
+		}
+		uint32_t s = hashCombine(seed, dimension);
+		uint32_t index = nestedUniformScramble(sampleIndex, s);
+		return uintToUnit(nestedUniformScramble(reverseBits(index), hashCombine(s, 1u)));
+	}
+
+private:
+	SamplerType type;
+	uint32_t seed;	// hash of the pixel coordinates
+	uint32_t sampleIndex;
+	uint32_t randomState;	// PCG state
+};
+
+}	// namespace cpurt
@@ -3,10 +3,13 @@
 #include <iostream>
 #include <stdexcept>
 #include <cstdlib>
+#include <cstdio>
 #include <vector>
 #include <cstring>
 #include <optional>
 #include <set>
+#include <map>
+#include <unordered_set>
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
@@ -43,6 +46,8 @@
 #define SINFL_IMPLEMENTATION
 #include <sinfl.h>
 
+#include "ThreadPool.hpp"
+
 // For compile compatibility issues
 #define M_E			2.7182818284590452354	/* e */
 #define M_LOG2E		1.4426950408889634074	/* log_2 e */
@@ -72,6 +77,7 @@ std::vector<const char*> deviceExtensions = {
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	std::optional<uint32_t> transferFamily;	// transfer only (DMA engine), optional
 
 	bool isComplete() {
 		return graphicsFamily.has_value() &&
@@ -178,6 +184,169 @@ std::vector<char> readFile(const std::string& filename) {
 
 class BaseProject;
 
+// Device memory of the buffers and images created by BaseProject::createBuffer() and createImage().
+//
+// Memory is allocated in blocks, with a pool of blocks for every memory type, kind of resource
+// (buffers and images are kept apart, so bufferImageGranularity never applies inside a block)
+// and lifetime:
+//  - MEMORY_LONG_LIVED (models, textures, attachments, uniform and storage buffers) is split with
+//    the buddy system: power of two ranges from DEVICE_MEMORY_MIN_RANGE, freed in any order
+//  - MEMORY_SHORT_LIVED (staging buffers) is allocated linearly, a block is rewound as soon as
+//    all its allocations have been freed
+// Requests larger than a block get a dedicated vkAllocateMemory. Host visible blocks are mapped
+// once, MemoryAllocation::mapped points to the allocation. printStats() reports the pools.
+enum MemoryLifetime {
+	MEMORY_LONG_LIVED = 0,
+	MEMORY_SHORT_LIVED = 1
+};
+
+const VkDeviceSize DEVICE_MEMORY_BLOCK_SIZE = 64ull << 20;	// buddy blocks, power of two
+const VkDeviceSize DEVICE_MEMORY_LINEAR_BLOCK_SIZE = 32ull << 20;
+const VkDeviceSize DEVICE_MEMORY_MIN_RANGE = 256;
+
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;	// reserved, at least the requested size
+	unsigned char* mapped = nullptr;	// host visible memory only
+	int pool = -1;	// -1: dedicated allocation
+	int block = 0;
+};
+
+// Free lists of a block split by the buddy system: sizes are powers of two from minSize,
+// every free range is aligned to its size and merged back with its buddy when both are free
+struct BuddyBlock {
+	VkDeviceSize size = 0;
+	VkDeviceSize minSize = 0;
+	std::vector<std::set<VkDeviceSize>> freeLists;	// offsets of the free ranges of size minSize << order
+
+	void init(VkDeviceSize blockSize, VkDeviceSize minRange) {
+		size = blockSize;
+		minSize = minRange;
+		int orders = 1;
+		while ((minSize << (orders - 1)) < size) {
+			orders++;
+		}
+		freeLists.assign(orders, std::set<VkDeviceSize>());
+		freeLists.back().insert(0);
+	}
+
+	int order(VkDeviceSize rangeSize) const {
+		int k = 0;
+		while ((minSize << k) < rangeSize) {
+			k++;
+		}
+		return k;
+	}
+
+	// alignment must be a power of two; false when no range is large enough
+	bool allocate(VkDeviceSize request, VkDeviceSize alignment, VkDeviceSize& offset, VkDeviceSize& reserved) {
+		int k = order(std::max(request, alignment));
+		if (k >= (int)freeLists.size()) {
+			return false;
+		}
+		int j = k;
+		while (j < (int)freeLists.size() && freeLists[j].empty()) {
+			j++;
+		}
+		if (j == (int)freeLists.size()) {
+			return false;
+		}
+		offset = *freeLists[j].begin();
+		freeLists[j].erase(freeLists[j].begin());
+		while (j > k) {
+			j--;
+			freeLists[j].insert(offset + (minSize << j));
+		}
+		reserved = minSize << k;
+		return true;
+	}
+
+	void free(VkDeviceSize offset, VkDeviceSize reserved) {
+		int k = order(reserved);
+		while (k + 1 < (int)freeLists.size()) {
+			VkDeviceSize buddy = offset ^ (minSize << k);
+			if (freeLists[k].erase(buddy) == 0) {
+				break;
+			}
+			offset = std::min(offset, buddy);
+			k++;
+		}
+		freeLists[k].insert(offset);
+	}
+
+	bool empty() const {
+		return !freeLists.back().empty();
+	}
+};
+
+// A block used as a stack that is only emptied: rewound when its last allocation is freed
+struct LinearBlock {
+	VkDeviceSize size = 0;
+	VkDeviceSize top = 0;
+	int live = 0;
+
+	bool allocate(VkDeviceSize request, VkDeviceSize alignment, VkDeviceSize& offset) {
+		VkDeviceSize aligned = (top + alignment - 1) & ~(alignment - 1);
+		if (aligned + request > size) {
+			return false;
+		}
+		offset = aligned;
+		top = aligned + request;
+		live++;
+		return true;
+	}
+
+	void free() {
+		if (--live == 0) {
+			top = 0;
+		}
+	}
+};
+
+struct DeviceMemoryPool {
+	struct Block {
+		VkDeviceMemory memory;
+		unsigned char* mapped;
+		BuddyBlock buddy;
+		LinearBlock linear;
+	};
+
+	uint32_t memoryType;
+	bool images;
+	MemoryLifetime lifetime;
+	bool hostVisible;
+	VkDeviceSize blockSize;
+	std::vector<Block> blocks;
+
+	int allocations = 0;
+	VkDeviceSize used = 0;	// reserved by the live allocations
+	VkDeviceSize peakUsed = 0;
+};
+
+struct DeviceMemoryAllocator {
+	BaseProject* BP = nullptr;
+
+	void init(BaseProject* bp);
+	MemoryAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties,
+		bool image, MemoryLifetime lifetime);
+	void free(MemoryAllocation& allocation);
+	void printStats(const char* when);
+	void cleanup();
+
+private:
+	std::vector<DeviceMemoryPool> pools;
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	int deviceAllocations = 0;	// live vkAllocateMemory, blocks and dedicated
+	int peakDeviceAllocations = 0;
+	int dedicated = 0;
+	VkDeviceSize dedicatedBytes = 0;
+
+	int findPool(uint32_t memoryType, bool image, MemoryLifetime lifetime);
+	VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, unsigned char** mapped);
+	void freeDeviceMemory(VkDeviceMemory memory, unsigned char* mapped);
+};
+
 struct VertexBindingDescriptorElement {
 	uint32_t binding;
 	uint32_t stride;
@@ -218,18 +387,21 @@ struct VertexDescriptor {
 	std::vector<VkVertexInputBindingDescription> getBindingDescription();
 	std::vector<VkVertexInputAttributeDescription>
 		getAttributeDescriptions();
+	std::string layoutKey();	// strides and elements: equal keys lay out the vertices the same way
 };
 
 enum ModelType { OBJ, GLTF, MGCG };
 
 class Model {
+	friend class MeshRegistry;
 	BaseProject* BP;
 
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	MemoryAllocation indexBufferMemory;
 	VertexDescriptor* VD;
+	std::string meshKey;	// empty: the buffers belong to this model only
 
 public:
 	glm::mat4 Wm;
@@ -241,6 +413,7 @@ public:
 	void createVertexBuffer();
 
 	void init(BaseProject* bp, VertexDescriptor* VD, std::string file, ModelType MT);
+	void load(VertexDescriptor* VD, std::string file, ModelType MT);
 	void initMesh(BaseProject* bp, VertexDescriptor* VD);
 	void cleanup();
 	void bind(VkCommandBuffer commandBuffer);
@@ -250,13 +423,13 @@ struct Texture {
 	BaseProject* BP;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	MemoryAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
 	int imgs;
-	static const int maxImgs = 6;
+	VkImageViewType viewType;	// 2D, CUBE (6 faces) or 2D_ARRAY (layers of the same size)
+	static const int maxImgs = 16;
 
-	void createTextureImage(std::string files[], VkFormat Fmt);
 	void createTextureImageView(VkFormat Fmt);
 	void createTextureSampler(VkFilter magFilter,
 		VkFilter minFilter,
@@ -270,6 +443,18 @@ struct Texture {
 
 	void init(BaseProject* bp, std::string file, VkFormat Fmt, bool initSampler);
 	void initCubic(BaseProject* bp, std::string files[6]);
+	void initArray(BaseProject* bp, std::string files[], int layers);
+	void initStorage(BaseProject* bp, uint32_t width, uint32_t height, int layers, VkFormat Fmt);
+	void cleanup();
+};
+
+struct StorageBuffer {
+	BaseProject* BP;
+	VkBuffer buffer;
+	MemoryAllocation bufferMemory;
+	VkDeviceSize size;
+
+	void init(BaseProject* bp, const void* data, VkDeviceSize size);
 	void cleanup();
 };
 
@@ -292,6 +477,19 @@ struct DescriptorSetLayout {
 	void cleanup();
 };
 
+// Values of the specialization constants (layout(constant_id = N) const ...) of the shaders of a pipeline,
+// 4 bytes each: int, uint, float or bool (as VkBool32). IDs missing in a stage are ignored by it.
+struct SpecializationConstants {
+	std::vector<VkSpecializationMapEntry> entries;
+	std::vector<uint32_t> data;
+
+	void set(uint32_t constantID, int32_t value);
+	void set(uint32_t constantID, float value);
+	bool empty() const;
+	VkSpecializationInfo getInfo() const;	// points to entries and data, valid while they are not modified
+	std::vector<uint32_t> key() const;	// IDs and values, to look up the variants of a pipeline
+};
+
 struct Pipeline {
 	BaseProject* BP;
 	VkPipeline graphicsPipeline;
@@ -305,6 +503,7 @@ struct Pipeline {
 	VkPolygonMode polyModel;
 	VkCullModeFlagBits CM;
 	bool transp;
+	SpecializationConstants SC;	// applied to both stages
 
 	VertexDescriptor* VD;
 
@@ -313,6 +512,7 @@ struct Pipeline {
 		std::vector<DescriptorSetLayout*> D);
 	void setAdvancedFeatures(VkCompareOp _compareOp, VkPolygonMode _polyModel,
 		VkCullModeFlagBits _CM, bool _transp);
+	void setSpecialization(const SpecializationConstants& _SC);
 	void create();
 	void destroy();
 	void bind(VkCommandBuffer commandBuffer);
@@ -321,20 +521,92 @@ struct Pipeline {
 	void cleanup();
 };
 
+struct ComputePipeline {
+	BaseProject* BP;
+	VkPipeline computePipeline;
+	VkPipelineLayout pipelineLayout;
+
+	VkShaderModule compShaderModule;
+	std::vector<DescriptorSetLayout*> D;
+	SpecializationConstants SC;
+
+	void init(BaseProject* bp, const std::string& CompShader,
+		std::vector<DescriptorSetLayout*> D);
+	void setSpecialization(const SpecializationConstants& _SC);
+	void create();
+	void destroy();
+	void bind(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+// Variants of an initialized Pipeline or ComputePipeline that only differ in their specialization constants.
+// A variant is created the first time its values are requested and then reused, so each one can still be
+// constant folded and unrolled by the driver without recompiling the SPIR-V. All the variants share the
+// shader modules of the base pipeline, destroyed by its destroy(). cleanup() releases the variants, that are
+// created again when requested (as after the recreation of the swap chain).
+template <class P>
+struct PipelineVariants {
+	P* Base;
+	std::map<std::vector<uint32_t>, P> Variants;
+
+	void init(P* base) {
+		Base = base;
+	}
+
+	P& get(const SpecializationConstants& SC) {
+		std::vector<uint32_t> key = SC.key();
+		auto it = Variants.find(key);
+		if (it != Variants.end()) {
+			return it->second;
+		}
+		P& variant = Variants.emplace(key, *Base).first->second;
+		variant.setSpecialization(SC);
+		variant.create();
+		std::cout << "Pipeline variant " << Variants.size() << " created\n";
+		return variant;
+	}
+
+	void cleanup() {
+		for (auto& v : Variants) {
+			v.second.cleanup();
+		}
+		Variants.clear();
+	}
+};
+
+// Slot of a uniform block in the UniformRing: the copy of swap chain image i is at
+// i * regionSize + offset in buffer, which stays mapped at mapped
+struct UniformAllocation {
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize regionSize = 0;
+	VkDeviceSize size = 0;
+	unsigned char* mapped = nullptr;
+
+	uint32_t dynamicOffset(int currentImage) const {
+		return static_cast<uint32_t>(currentImage * regionSize + offset);
+	}
+	void* data(int currentImage) const {
+		return mapped + currentImage * regionSize + offset;
+	}
+};
+
 struct DescriptorSet {
 	BaseProject* BP;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
 	std::vector<VkDescriptorSet> descriptorSets;
 	DescriptorSetLayout* Layout;
 
-	std::vector<bool> toFree;
+	// Uniform blocks of the set in BP->uniforms, one per binding (unused for the other types),
+	// and the dynamic offsets of every swap chain image, in the order of the binding numbers
+	std::vector<UniformAllocation> uniforms;
+	std::vector<std::vector<uint32_t>> dynamicOffsets;
 
 	void init(BaseProject* bp, DescriptorSetLayout* L,
-		std::vector<Texture*>Txs);
+		std::vector<Texture*>Txs, std::vector<StorageBuffer*>Sbs = {});
 	void cleanup();
 	void bind(VkCommandBuffer commandBuffer, Pipeline& P, int setId, int currentImage);
+	void bind(VkCommandBuffer commandBuffer, ComputePipeline& P, int setId, int currentImage);
 	void map(int currentImage, void* src, int slot);
 };
 
@@ -342,17 +614,177 @@ struct DescriptorSet {
 struct PoolSizes {
 	int uniformBlocksInPool = 0;
 	int texturesInPool = 0;
+	int storageImagesInPool = 0;
+	int storageBuffersInPool = 0;
 	int setsInPool = 0;
 };
 
+// Header of the pipeline cache file, before the data returned by vkGetPipelineCacheData.
+// A cache written for another GPU or driver version is discarded when it is loaded.
+const uint32_t PIPELINE_CACHE_MAGIC = 0x48434c50;	// "PLCH"
+struct PipelineCacheFileHeader {
+	uint32_t magic;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+
+	void fill(const VkPhysicalDeviceProperties& P, uint64_t size) {
+		magic = PIPELINE_CACHE_MAGIC;
+		vendorID = P.vendorID;
+		deviceID = P.deviceID;
+		driverVersion = P.driverVersion;
+		memcpy(pipelineCacheUUID, P.pipelineCacheUUID, VK_UUID_SIZE);
+		dataSize = size;
+	}
+
+	bool matches(const VkPhysicalDeviceProperties& P) const {
+		return magic == PIPELINE_CACHE_MAGIC && vendorID == P.vendorID && deviceID == P.deviceID &&
+			driverVersion == P.driverVersion && memcmp(pipelineCacheUUID, P.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	}
+};
+
+// Pipelines created since the last report, split by what the driver says about the cache
+// (VK_EXT_pipeline_creation_feedback, unknown when the extension is not available)
+struct PipelineCacheStats {
+	int hits = 0, misses = 0, unknown = 0;
+	double hitMs = 0.0, missMs = 0.0, unknownMs = 0.0;
+};
+
+// Uploads of DEVICE_LOCAL buffers through a single staging buffer.
+// Between begin() and submit() the data of every add() is appended to a CPU arena; submit()
+// copies the arena into one staging buffer, records all the copies in one command buffer
+// and waits its fence once before freeing the staging memory. An add() outside a batch is
+// submitted immediately.
+struct UploadBatch {
+	BaseProject* BP = nullptr;
+
+	void begin(BaseProject* bp);
+	void add(VkBuffer dst, const void* data, VkDeviceSize size);
+	void submit();
+
+private:
+	struct Copy {
+		VkBuffer dst;
+		VkDeviceSize offset;	// in the arena
+		VkDeviceSize size;
+	};
+	std::vector<unsigned char> arena;
+	std::vector<Copy> copies;
+	bool batching = false;
+};
+
+// Uniform blocks of all the descriptor sets, bound as UNIFORM_BUFFER_DYNAMIC.
+// A chunk is one HOST_COHERENT buffer, mapped by the memory allocator, with a region per swap chain
+// image; the blocks are allocated linearly in the regions, aligned to minUniformBufferOffsetAlignment.
+// DescriptorSet::map() is then a memcpy, and the descriptors of an image select its region with
+// the dynamic offsets recorded by DescriptorSet::bind(). The blocks are released together by
+// cleanup(), when the swap chain (and with it every descriptor set) is recreated.
+const VkDeviceSize UNIFORM_RING_REGION_SIZE = 64 * 1024;
+
+struct UniformRing {
+	BaseProject* BP = nullptr;
+
+	UniformAllocation allocate(BaseProject* bp, VkDeviceSize size);
+	void cleanup();
+
+private:
+	struct Chunk {
+		VkBuffer buffer;
+		MemoryAllocation memory;
+		VkDeviceSize regionSize;
+		VkDeviceSize used;	// in every region
+	};
+	std::vector<Chunk> chunks;
+	VkDeviceSize alignment = 0;
+};
+
+// Textures loaded from image files. Between begin() and submit() (the localInit() of the
+// application) every texture is decoded by a task of ThreadPool::global() while the main thread
+// goes on, so the decoding takes as long as the slowest image instead of the sum of all of them.
+// submit() waits for the decoders and records the copies and the mipmaps of all the textures in a
+// single submit: with a transfer only queue family the copies run on the DMA queue, which hands
+// the images over to the graphics queue with a semaphore. wait() blocks on the fence of the
+// submit, so the GPU works while the pipelines are created. Outside a batch add() loads the
+// texture right away.
+struct TextureLoader {
+	BaseProject* BP = nullptr;
+
+	void begin(BaseProject* bp);
+	void add(Texture* T, std::string files[], VkFormat Fmt, bool initSampler);
+	void submit();
+	void wait();
+
+private:
+	struct Job {
+		Texture* T;
+		std::vector<std::string> files;
+		VkFormat Fmt;
+		bool initSampler;
+		std::vector<stbi_uc*> pixels;	// always RGBA
+		std::vector<int> channels;	// of the files, only reported
+		int width, height;
+		std::string error;	// set by the decoder, thrown by submit()
+		std::string errorFile;
+		double decodeMs;
+		VkDeviceSize stagingOffset;
+	};
+	std::vector<std::unique_ptr<Job>> jobs;	// the decoders keep pointers to them
+	TaskGroup decoders;	// submit() waits only for these, not for the other users of the pool
+	bool batching = false;
+
+	VkBuffer stagingBuffer = VK_NULL_HANDLE;
+	MemoryAllocation stagingBufferMemory;
+	VkCommandPool transferCommandPool = VK_NULL_HANDLE;
+	VkCommandBuffer transferCommandBuffer = VK_NULL_HANDLE;
+	VkCommandBuffer graphicsCommandBuffer = VK_NULL_HANDLE;
+	VkSemaphore transferDone = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	std::chrono::high_resolution_clock::time_point startTime;
+	VkDeviceSize uploadedBytes = 0;
+
+	static void decode(Job& J);
+};
+
+// Meshes loaded from files by Model::init(). Models that load the same file with the same
+// vertex descriptor share its vertex and index buffers: the file is parsed and uploaded once,
+// and the buffers are destroyed by the cleanup() of the last model that uses them.
+struct MeshRegistry {
+	bool acquire(Model* M, const std::string& key);	// false: not loaded yet
+	void add(Model* M, const std::string& key);
+	bool release(const std::string& key);	// true: the last reference is gone
+
+private:
+	struct Mesh {
+		VkBuffer vertexBuffer;
+		MemoryAllocation vertexBufferMemory;
+		VkBuffer indexBuffer;
+		MemoryAllocation indexBufferMemory;
+		std::vector<unsigned char> vertices;
+		std::vector<uint32_t> indices;
+		glm::mat4 Wm;
+		int references;
+	};
+	std::map<std::string, Mesh> meshes;
+};
+
 // MAIN ! 
 class BaseProject {
 	friend class VertexDescriptor;
 	friend class Model;
 	friend class Texture;
 	friend class Pipeline;
+	friend class ComputePipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class StorageBuffer;
+	friend class GpuProfiler;
+	friend class UploadBatch;
+	friend class UniformRing;
+	friend class DeviceMemoryAllocator;
+	friend class TextureLoader;
+	friend class MeshRegistry;
 public:
 	virtual void setWindowParameters() = 0;
 	void run() {
@@ -382,13 +814,24 @@ protected:
 	VkDevice device;
 	VkQueue graphicsQueue;
 	VkQueue presentQueue;
+	VkQueue transferQueue = VK_NULL_HANDLE;	// only if the device has a transfer only family
 	VkCommandPool commandPool;
-	std::vector<VkCommandBuffer> commandBuffers;
+	DeviceMemoryAllocator memoryAllocator;	// memory of every buffer and image
+	UploadBatch uploads;	// vertex, index and storage buffers created by localInit() share one submit
+	TextureLoader textureLoads;	// textures of localInit(), decoded in parallel
+	MeshRegistry meshes;	// models loaded from the same file share their buffers
+	UniformRing uniforms;	// uniform blocks of the descriptor sets, persistently mapped
+	// Command buffers are recorded once for every key of commandBufferKey() and swap chain image,
+	// the first time the key is used, and kept until the swap chain is recreated
+	std::map<uint32_t, std::vector<VkCommandBuffer>> recordedCommandBuffers;
+	std::vector<VkCommandBuffer> commandBuffers;	// submitted last by every swap chain image, VK_NULL_HANDLE before the first
 
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
 	VkFormat swapChainImageFormat;
 	VkExtent2D swapChainExtent;
+	VkPresentModeKHR swapChainPresentMode;
+	bool uncappedPresent = false;	// IMMEDIATE (or MAILBOX) first, so that frames are not paced by the display
 	std::vector<VkImageView> swapChainImageViews;
 
 	VkRenderPass renderPass;
@@ -398,12 +841,12 @@ protected:
 	VkDebugUtilsMessengerEXT debugMessenger;
 
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	MemoryAllocation depthImageMemory;
 	VkImageView depthImageView;
 
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 	VkImage colorImage;
-	VkDeviceMemory colorImageMemory;
+	MemoryAllocation colorImageMemory;
 	VkImageView colorImageView;
 
 	std::vector<VkFramebuffer> swapChainFramebuffers;
@@ -415,6 +858,12 @@ protected:
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
 
+	// Used by every pipeline creation, loaded from pipelineCacheFile at startup and saved there on exit
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	std::string pipelineCacheFile = "pipeline_cache.bin";	// empty: the cache is only kept in memory
+	bool pipelineCreationFeedback = false;
+	PipelineCacheStats pipelineCacheStats;
+
 	void initWindow() {
 		glfwInit();
 
@@ -447,6 +896,8 @@ protected:
 		createSurface();
 		pickPhysicalDevice();
 		createLogicalDevice();
+		memoryAllocator.init(this);
+		createPipelineCache();
 		createSwapChain();
 		createImageViews();
 		createRenderPass();
@@ -454,10 +905,17 @@ protected:
 		createColorResources();
 		createDepthResources();
 		createFramebuffers();
+		uploads.begin(this);
+		textureLoads.begin(this);
 		localInit();
+		textureLoads.submit();
+		uploads.submit();
 
 		createDescriptorPool();
 		pipelinesAndDescriptorSetsInit();
+		textureLoads.wait();	// the GPU has copied the textures while the pipelines were created
+		reportPipelineCache("startup");
+		memoryAllocator.printStats("startup");
 
 		createCommandBuffers();
 		createSyncObjects();
@@ -701,6 +1159,12 @@ protected:
 		if (physicalDevice == VK_NULL_HANDLE) {
 			throw std::runtime_error("failed to find a suitable GPU!");
 		}
+
+		// optional: tells whether each pipeline was found in the pipeline cache
+		pipelineCreationFeedback = checkIfItHasDeviceExtension(physicalDevice, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+		if (pipelineCreationFeedback) {
+			deviceExtensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+		}
 	}
 
 	bool isDeviceSuitable(VkPhysicalDevice device, deviceReport& devRep) {
@@ -757,6 +1221,14 @@ protected:
 			i++;
 		}
 
+		for (uint32_t f = 0; f < queueFamilyCount; f++) {
+			VkQueueFlags flags = queueFamilies[f].queueFlags;
+			if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+				indices.transferFamily = f;
+				break;
+			}
+		}
+
 		return indices;
 	}
 
@@ -833,6 +1305,9 @@ protected:
 		std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 		std::set<uint32_t> uniqueQueueFamilies =
 		{ indices.graphicsFamily.value(), indices.presentFamily.value() };
+		if (indices.transferFamily.has_value()) {
+			uniqueQueueFamilies.insert(indices.transferFamily.value());
+		}
 
 		float queuePriority = 1.0f;
 		for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -848,6 +1323,12 @@ protected:
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
 		deviceFeatures.sampleRateShading = VK_TRUE;
 		deviceFeatures.fillModeNonSolid = VK_TRUE;
+		deviceFeatures.fragmentStoresAndAtomics = VK_TRUE;
+
+		// optional, used by the GPU profiler when available
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
 
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -874,6 +1355,9 @@ protected:
 
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+		if (indices.transferFamily.has_value()) {
+			vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+		}
 	}
 
 	void createSwapChain() {
@@ -938,6 +1422,7 @@ protected:
 
 		swapChainImageFormat = surfaceFormat.format;
 		swapChainExtent = extent;
+		swapChainPresentMode = presentMode;
 	}
 
 	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
@@ -955,6 +1440,13 @@ protected:
 
 	VkPresentModeKHR chooseSwapPresentMode(
 		const std::vector<VkPresentModeKHR>& availablePresentModes) {
+		if (uncappedPresent) {
+			for (const auto& availablePresentMode : availablePresentModes) {
+				if (availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR) {
+					return availablePresentMode;
+				}
+			}
+		}
 		for (const auto& availablePresentMode : availablePresentModes) {
 			if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
 				return availablePresentMode;
@@ -1215,7 +1707,7 @@ protected:
 		VkImageTiling tiling, VkImageUsageFlags usage,
 		VkImageCreateFlags cflags,
 		VkMemoryPropertyFlags properties, VkImage& image,
-		VkDeviceMemory& imageMemory) {
+		MemoryAllocation& imageMemory) {
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1241,22 +1733,27 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-			properties);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-			VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
+		imageMemory = memoryAllocator.allocate(memRequirements, properties, true, MEMORY_LONG_LIVED);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
+	}
 
-		vkBindImageMemory(device, image, imageMemory, 0);
+	void destroyImage(VkImage image, MemoryAllocation& imageMemory) {
+		vkDestroyImage(device, image, nullptr);
+		memoryAllocator.free(imageMemory);
 	}
 
 	void generateMipmaps(VkImage image, VkFormat imageFormat,
 		int32_t texWidth, int32_t texHeight,
 		uint32_t mipLevels, int layerCount) {
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		recordMipmaps(commandBuffer, image, imageFormat, texWidth, texHeight, mipLevels, layerCount);
+		endSingleTimeCommands(commandBuffer);
+	}
+
+	// Blits every level from the previous one, the image must be in TRANSFER_DST_OPTIMAL;
+	// all the levels are left in SHADER_READ_ONLY_OPTIMAL
+	void recordMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat,
+		int32_t texWidth, int32_t texHeight, uint32_t mipLevels, int layerCount) {
 		VkFormatProperties formatProperties;
 		vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat,
 			&formatProperties);
@@ -1266,8 +1763,6 @@ protected:
 			throw std::runtime_error("texture image format does not support linear blitting!");
 		}
 
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
 		VkImageMemoryBarrier barrier{};
 		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		barrier.image = image;
@@ -1338,8 +1833,6 @@ protected:
 			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
 			0, nullptr, 0, nullptr,
 			1, &barrier);
-
-		endSingleTimeCommands(commandBuffer);
 	}
 
 	void transitionImageLayout(VkImage image, VkFormat format,
@@ -1388,6 +1881,13 @@ protected:
 			sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
 			destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 		}
+		else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
+			newLayout == VK_IMAGE_LAYOUT_GENERAL) {
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+			destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		}
 		else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
 			newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
 			barrier.srcAccessMask = 0;
@@ -1459,9 +1959,20 @@ protected:
 		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 	}
 
+	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+		VkBufferCopy copyRegion{};
+		copyRegion.size = size;
+		vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+		endSingleTimeCommands(commandBuffer);
+	}
+
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 		VkMemoryPropertyFlags properties,
-		VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+		VkBuffer& buffer, MemoryAllocation& bufferMemory,
+		MemoryLifetime lifetime = MEMORY_LONG_LIVED) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1478,20 +1989,13 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex =
-			findMemoryType(memRequirements.memoryTypeBits, properties);
-
-		result = vkAllocateMemory(device, &allocInfo, nullptr,
-			&bufferMemory);
-		if (result != VK_SUCCESS) {
-			PrintVkError(result);
-			throw std::runtime_error("failed to allocate vertex buffer memory!");
-		}
+		bufferMemory = memoryAllocator.allocate(memRequirements, properties, false, lifetime);
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+	}
 
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);
+	void destroyBuffer(VkBuffer buffer, MemoryAllocation& bufferMemory) {
+		vkDestroyBuffer(device, buffer, nullptr);
+		memoryAllocator.free(bufferMemory);
 	}
 
 	uint32_t findMemoryType(uint32_t typeFilter,
@@ -1511,13 +2015,27 @@ protected:
 	}
 
 	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		std::vector<VkDescriptorPoolSize> poolSizes(2);
+		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		poolSizes[0].descriptorCount = static_cast<uint32_t>(DPSZs.uniformBlocksInPool *
 			swapChainImages.size());
 		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 		poolSizes[1].descriptorCount = static_cast<uint32_t>(DPSZs.texturesInPool *
 			swapChainImages.size());
+		if (DPSZs.storageImagesInPool > 0) {
+			VkDescriptorPoolSize storageImages{};
+			storageImages.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			storageImages.descriptorCount = static_cast<uint32_t>(DPSZs.storageImagesInPool *
+				swapChainImages.size());
+			poolSizes.push_back(storageImages);
+		}
+		if (DPSZs.storageBuffersInPool > 0) {
+			VkDescriptorPoolSize storageBuffers{};
+			storageBuffers.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			storageBuffers.descriptorCount = static_cast<uint32_t>(DPSZs.storageBuffersInPool *
+				swapChainImages.size());
+			poolSizes.push_back(storageBuffers);
+		}
 
 		VkDescriptorPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1536,61 +2054,111 @@ protected:
 
 	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+	// Commands recorded before the render pass begins (barriers, compute work...)
+	virtual void populatePrePassCommandBuffer(VkCommandBuffer commandBuffer, int i) {}
+
+	// Commands recorded after the render pass ends, the swap chain image is in PRESENT_SRC_KHR layout
+	// (UNDEFINED when needsRenderPass() is false)
+	virtual void populatePostPassCommandBuffer(VkCommandBuffer commandBuffer, int i) {}
+
+	// False in the states where populateCommandBuffer() draws nothing and the post pass commands write
+	// the whole swap chain image: the render pass, with its clears, is not recorded. Like everything
+	// recorded, it must depend only on the state named by commandBufferKey().
+	virtual bool needsRenderPass() { return true; }
+
+	// Identifies what populateCommandBuffer() and the pre and post pass functions record in the current
+	// state of the application (e.g. which passes a mode needs). Every key gets its own command buffers,
+	// so switching between states only selects other buffers, without recording nor waiting the device.
+	virtual uint32_t commandBufferKey() { return 0; }
+
 	void createCommandBuffers() {
-		commandBuffers.resize(swapChainFramebuffers.size());
+		commandBuffers.assign(swapChainFramebuffers.size(), VK_NULL_HANDLE);
+		recordCommandBuffers(commandBufferKey());
+	}
+
+	// Command buffer of the current key for a swap chain image, recorded if the key is new
+	VkCommandBuffer selectCommandBuffer(uint32_t imageIndex) {
+		uint32_t key = commandBufferKey();
+		auto recorded = recordedCommandBuffers.find(key);
+		if (recorded == recordedCommandBuffers.end()) {
+			return recordCommandBuffers(key)[imageIndex];
+		}
+		return recorded->second[imageIndex];
+	}
+
+	void freeCommandBuffers() {
+		for (auto& recorded : recordedCommandBuffers) {
+			vkFreeCommandBuffers(device, commandPool,
+				static_cast<uint32_t>(recorded.second.size()), recorded.second.data());
+		}
+		recordedCommandBuffers.clear();
+		commandBuffers.clear();
+	}
+
+	std::vector<VkCommandBuffer>& recordCommandBuffers(uint32_t key) {
+		std::vector<VkCommandBuffer>& buffers = recordedCommandBuffers[key];
+		buffers.resize(swapChainFramebuffers.size());
 
 		VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		allocInfo.commandPool = commandPool;
 		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+		allocInfo.commandBufferCount = (uint32_t)buffers.size();
 
 		VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
-			commandBuffers.data());
+			buffers.data());
 		if (result != VK_SUCCESS) {
 			PrintVkError(result);
+			recordedCommandBuffers.erase(key);
 			throw std::runtime_error("failed to allocate command buffers!");
 		}
 
-		for (size_t i = 0; i < commandBuffers.size(); i++) {
+		for (size_t i = 0; i < buffers.size(); i++) {
 			VkCommandBufferBeginInfo beginInfo{};
 			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 			beginInfo.flags = 0; // Optional
 			beginInfo.pInheritanceInfo = nullptr; // Optional
 
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
+			if (vkBeginCommandBuffer(buffers[i], &beginInfo) !=
 				VK_SUCCESS) {
 				throw std::runtime_error("failed to begin recording command buffer!");
 			}
 
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass;
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = { 0, 0 };
-			renderPassInfo.renderArea.extent = swapChainExtent;
+			populatePrePassCommandBuffer(buffers[i], i);
+
+			if (needsRenderPass()) {
+				VkRenderPassBeginInfo renderPassInfo{};
+				renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+				renderPassInfo.renderPass = renderPass;
+				renderPassInfo.framebuffer = swapChainFramebuffers[i];
+				renderPassInfo.renderArea.offset = { 0, 0 };
+				renderPassInfo.renderArea.extent = swapChainExtent;
 
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = { 1.0f, 0 };
+				std::array<VkClearValue, 2> clearValues{};
+				clearValues[0].color = initialBackgroundColor;
+				clearValues[1].depthStencil = { 1.0f, 0 };
 
-			renderPassInfo.clearValueCount =
-				static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
+				renderPassInfo.clearValueCount =
+					static_cast<uint32_t>(clearValues.size());
+				renderPassInfo.pClearValues = clearValues.data();
 
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-				VK_SUBPASS_CONTENTS_INLINE);
+				vkCmdBeginRenderPass(buffers[i], &renderPassInfo,
+					VK_SUBPASS_CONTENTS_INLINE);
 
 
-			populateCommandBuffer(commandBuffers[i], i);
+				populateCommandBuffer(buffers[i], i);
 
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+				vkCmdEndRenderPass(buffers[i]);
+			}
+
+			populatePostPassCommandBuffer(buffers[i], i);
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			if (vkEndCommandBuffer(buffers[i]) != VK_SUCCESS) {
 				throw std::runtime_error("failed to record command buffer!");
 			}
 		}
+		return buffers;
 	}
 
 	void createSyncObjects() {
@@ -1634,145 +2202,6 @@ protected:
 		vkDeviceWaitIdle(device);
 	}
 
-	virtual Texture getImage() = 0;
-
-	// SwapChain Implementation
-	void texture(int curImageIndex) {
-		VkImage textureImage = getImage().textureImage; // destination image, calls the main funcion
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-		//barrier to change swap chain image to prepare it to be copied, making it from read to write type image
-		VkImageMemoryBarrier barrierSwapchainToTransfer = {};
-		barrierSwapchainToTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrierSwapchainToTransfer.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;  // was: UNDEFINED
-		barrierSwapchainToTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrierSwapchainToTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierSwapchainToTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierSwapchainToTransfer.image = swapChainImages[curImageIndex];
-		barrierSwapchainToTransfer.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrierSwapchainToTransfer.subresourceRange.baseMipLevel = 0;
-		barrierSwapchainToTransfer.subresourceRange.levelCount = 1;
-		barrierSwapchainToTransfer.subresourceRange.baseArrayLayer = 0;
-		barrierSwapchainToTransfer.subresourceRange.layerCount = 1;
-		barrierSwapchainToTransfer.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;  // was: NONE
-		barrierSwapchainToTransfer.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-		//Transformation command
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,  // was: TOP, TRANSFER
-			0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrierSwapchainToTransfer
-		);
-
-		//Turns the png texture to a write destination
-		VkImageMemoryBarrier barrierTextureToTransfer = {};
-		barrierTextureToTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrierTextureToTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		barrierTextureToTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		barrierTextureToTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierTextureToTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierTextureToTransfer.image = textureImage;
-		barrierTextureToTransfer.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrierTextureToTransfer.subresourceRange.baseMipLevel = 0;
-		barrierTextureToTransfer.subresourceRange.levelCount = 1;
-		barrierTextureToTransfer.subresourceRange.baseArrayLayer = 0;
-		barrierTextureToTransfer.subresourceRange.layerCount = 1;
-		barrierTextureToTransfer.srcAccessMask = VK_ACCESS_NONE_KHR;
-		barrierTextureToTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-		//transformation command
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,  // was: TOP, TRANSFER
-			0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrierTextureToTransfer
-		);
-
-		//Copy parameters, also does other transformations
-		VkOffset3D blitSize;
-		blitSize.x = swapChainExtent.width;
-		blitSize.y = swapChainExtent.height;
-		blitSize.z = 1;
-		VkImageBlit imageBlitRegion{};
-		imageBlitRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageBlitRegion.srcSubresource.layerCount = 1;
-		imageBlitRegion.srcOffsets[1] = blitSize;
-		imageBlitRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		imageBlitRegion.dstSubresource.layerCount = 1;
-		imageBlitRegion.dstOffsets[1] = blitSize;
-
-		// Issue the blit command
-		vkCmdBlitImage(
-			commandBuffer,
-			swapChainImages[curImageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1,
-			&imageBlitRegion, 
-			VK_FILTER_NEAREST);
-		
-		//Reverts the transformation to the texture, making it a read texture
-		VkImageMemoryBarrier barrierTextureToShaderRead = {};
-		barrierTextureToShaderRead.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrierTextureToShaderRead.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		barrierTextureToShaderRead.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;// VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrierTextureToShaderRead.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierTextureToShaderRead.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierTextureToShaderRead.image = textureImage;
-		barrierTextureToShaderRead.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrierTextureToShaderRead.subresourceRange.baseMipLevel = 0;
-		barrierTextureToShaderRead.subresourceRange.levelCount = 1;
-		barrierTextureToShaderRead.subresourceRange.baseArrayLayer = 0;
-		barrierTextureToShaderRead.subresourceRange.layerCount = 1;
-		barrierTextureToShaderRead.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrierTextureToShaderRead.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;//VK_ACCESS_SHADER_READ_BIT;
-
-		//Issues command
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,  // was: TRANSFER, FRAGMENT_SHADER
-			0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrierTextureToShaderRead
-		);
-
-		//Reverts the swap chain image transformation
-		VkImageMemoryBarrier barrierSwapchainToPresent = {};
-		barrierSwapchainToPresent.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrierSwapchainToPresent.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrierSwapchainToPresent.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-		barrierSwapchainToPresent.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierSwapchainToPresent.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrierSwapchainToPresent.image = swapChainImages[curImageIndex];
-		barrierSwapchainToPresent.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrierSwapchainToPresent.subresourceRange.baseMipLevel = 0;
-		barrierSwapchainToPresent.subresourceRange.levelCount = 1;
-		barrierSwapchainToPresent.subresourceRange.baseArrayLayer = 0;
-		barrierSwapchainToPresent.subresourceRange.layerCount = 1;
-		barrierSwapchainToPresent.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-		barrierSwapchainToPresent.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-		//Issue command
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,  // was: TRANSFER, BOTTOM
-			0,
-			0, nullptr,
-			0, nullptr,
-			1, &barrierSwapchainToPresent
-		);
-
-		//Ends commands
-		endSingleTimeCommands(commandBuffer);
-	}
-
-
-
 	void drawFrame() {
 		vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX); //aspettare che la GPU abbia finito il lavoro
 		
@@ -1800,12 +2229,15 @@ protected:
 
 
 		updateUniformBuffer(imageIndex);
+		// after the update, which can change the state chosen by commandBufferKey()
+		commandBuffers[imageIndex] = selectCommandBuffer(imageIndex);
 
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
+		// without a render pass the swap chain image is first written by a transfer (see needsRenderPass())
 		VkPipelineStageFlags waitStages[] =
-		{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT }; //questo significa che prima di poter andare a renderizzare la nostra swapchainImage[i] dovremo attendere che il lavoro della frag shader sia terminato
+		{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT }; //questo significa che prima di poter andare a renderizzare la nostra swapchainImage[i] dovremo attendere che il lavoro della frag shader sia terminato
 		submitInfo.waitSemaphoreCount = 1;
 		submitInfo.pWaitSemaphores = waitSemaphores;
 		submitInfo.pWaitDstStageMask = waitStages;
@@ -1821,8 +2253,6 @@ protected:
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
 
-		texture(imageIndex);
-	
 		VkPresentInfoKHR presentInfo{}; //preparo per la presentazione dell'immagine
 		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 		presentInfo.waitSemaphoreCount = 1;
@@ -1875,27 +2305,128 @@ protected:
 		createDescriptorPool();
 
 		pipelinesAndDescriptorSetsInit();
+		reportPipelineCache("swap chain recreation");
 
 		createCommandBuffers();
 	}
 
+	void createPipelineCache() {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		std::vector<char> data;
+		std::ifstream file(pipelineCacheFile, std::ios::binary | std::ios::ate);
+		if (!pipelineCacheFile.empty() && file.is_open()) {
+			uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+			PipelineCacheFileHeader header{};
+			file.seekg(0);
+			file.read(reinterpret_cast<char*>(&header), sizeof(header));
+			if (!file || !header.matches(properties)) {
+				std::cout << "Pipeline cache <" << pipelineCacheFile << "> not valid for this GPU and driver, discarded\n";
+			}
+			else if (header.dataSize != fileSize - sizeof(header)) {
+				std::cout << "Pipeline cache <" << pipelineCacheFile << "> truncated, discarded\n";
+			}
+			else {
+				data.resize(header.dataSize);
+				file.read(data.data(), data.size());
+				if (!file) {
+					data.clear();
+				}
+				std::cout << "Pipeline cache <" << pipelineCacheFile << "> loaded, " << data.size() << " bytes\n";
+			}
+		}
+
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = data.size();
+		cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+		VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline cache!");
+		}
+	}
+
+	// Written to a temporary file first, an interrupted write does not leave a truncated cache
+	void savePipelineCache() {
+		reportPipelineCache("run");
+		if (!pipelineCacheFile.empty()) {
+			size_t size = 0;
+			vkGetPipelineCacheData(device, pipelineCache, &size, nullptr);
+			std::vector<char> data(size);
+			vkGetPipelineCacheData(device, pipelineCache, &size, data.data());
+
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			PipelineCacheFileHeader header{};
+			header.fill(properties, size);
+
+			std::string tmp = pipelineCacheFile + ".tmp";
+			std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			file.write(data.data(), size);
+			file.close();
+			std::remove(pipelineCacheFile.c_str());
+			if (!file || std::rename(tmp.c_str(), pipelineCacheFile.c_str()) != 0) {
+				std::cout << "Failed to save the pipeline cache to <" << pipelineCacheFile << ">\n";
+			}
+			else {
+				std::cout << "Pipeline cache saved to <" << pipelineCacheFile << ">, " << size << " bytes\n";
+			}
+		}
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+	}
+
+	// Called by Pipeline::create() and ComputePipeline::create() after vkCreate*Pipelines
+	void recordPipelineCreation(std::chrono::steady_clock::time_point start, const VkPipelineCreationFeedbackEXT& feedback) {
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		PipelineCacheStats& S = pipelineCacheStats;
+		if (!(feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT)) {
+			S.unknown++;
+			S.unknownMs += ms;
+		}
+		else if (feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT) {
+			S.hits++;
+			S.hitMs += ms;
+		}
+		else {
+			S.misses++;
+			S.missMs += ms;
+		}
+	}
+
+	void reportPipelineCache(const char* when) {
+		PipelineCacheStats& S = pipelineCacheStats;
+		if (S.hits + S.misses + S.unknown == 0) {
+			return;
+		}
+		std::cout << "Pipelines created during " << when << ": " << S.hits + S.misses + S.unknown << " in "
+			<< S.hitMs + S.missMs + S.unknownMs << " ms";
+		if (pipelineCreationFeedback) {
+			std::cout << " (" << S.hits << " cache hits in " << S.hitMs << " ms, "
+				<< S.misses << " misses in " << S.missMs << " ms)";
+		}
+		std::cout << "\n";
+		S = PipelineCacheStats();
+	}
+
 	void cleanupSwapChain() {
 		vkDestroyImageView(device, colorImageView, nullptr);
-		vkDestroyImage(device, colorImage, nullptr);
-		vkFreeMemory(device, colorImageMemory, nullptr);
+		destroyImage(colorImage, colorImageMemory);
 
 		vkDestroyImageView(device, depthImageView, nullptr);
-		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		destroyImage(depthImage, depthImageMemory);
 
 		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
 			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
 		}
 
-		vkFreeCommandBuffers(device, commandPool,
-			static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		freeCommandBuffers();
 
 		pipelinesAndDescriptorSetsCleanup();
+		uniforms.cleanup();
 
 		vkDestroyRenderPass(device, renderPass, nullptr);
 
@@ -1921,6 +2452,8 @@ protected:
 
 		vkDestroyCommandPool(device, commandPool, nullptr);
 
+		memoryAllocator.cleanup();
+		savePipelineCache();
 		vkDestroyDevice(device, nullptr);
 
 		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -2079,7 +2612,7 @@ public:
 	// Taken from the Sasha Willem sample by copy&paste
 	// This could be better integrated in the code, but for the moment,
 	// i cannot afford to do it, so it stays like this, even if it is awful!	
-private:
+protected:
 	inline VkCommandBufferBeginInfo vks_initializers_commandBufferBeginInfo()
 	{
 		VkCommandBufferBeginInfo cmdBufferBeginInfo{};
@@ -2494,11 +3027,10 @@ public:
 			data += subResourceLayout.rowPitch;
 		}
 
-		const char* filepath = "C:/Users/Torros/Documents/POLIMI/Computer Graphics/computer-graphics-empty-project/RayTracing/RayTracing/textures/texture.png";
-		stbi_write_png(filepath, width, height, 3, pixelArray, width * 3);
+		stbi_write_png(filename, width, height, 3, pixelArray, width * 3);
 		free(pixelArray);
 
-		std::cout << "Screenshot saved to disk" << std::endl;
+		std::cout << "Screenshot saved to " << filename << std::endl;
 
 		// Clean up resources
 		vkUnmapMemory(device, dstImageMemory);
@@ -2636,6 +3168,18 @@ std::vector<VkVertexInputAttributeDescription> VertexDescriptor::getAttributeDes
 	return attributeDescriptions;
 }
 
+std::string VertexDescriptor::layoutKey() {
+	std::string key;
+	for (const VertexBindingDescriptorElement& B : Bindings) {
+		key += std::to_string(B.binding) + ":" + std::to_string(B.stride) + ":" + std::to_string(B.inputRate) + ";";
+	}
+	for (const VertexDescriptorElement& E : Layout) {
+		key += std::to_string(E.binding) + ":" + std::to_string(E.location) + ":" + std::to_string(E.format) + ":" +
+			std::to_string(E.offset) + ":" + std::to_string(E.size) + ":" + std::to_string(E.usage) + ";";
+	}
+	return key;
+}
+
 
 
 void Model::loadModelOBJ(std::string file) {
@@ -2655,6 +3199,26 @@ void Model::loadModelOBJ(std::string file) {
 	//	std::cout << "UV " << VD->UV.hasIt << "," << VD->UV.offset << "\n";	
 	//	std::cout << "Normal " << VD->Normal.hasIt << "," << VD->Normal.offset << "\n";
 	int mainStride = VD->Bindings[0].stride;
+
+	// Vertices are welded: the corners with the same position, normal, UV and color (the bytes of
+	// the vertex) share an index. The set holds the indices of the unique vertices, hashed and
+	// compared through their bytes in the vertices array.
+	auto vertexAt = [&](uint32_t v) { return vertices.data() + (size_t)v * mainStride; };
+	auto vertexHash = [&](uint32_t v) {
+		const unsigned char* bytes = vertexAt(v);
+		size_t h = 14695981039346656037ull;	// FNV-1a
+		for (int b = 0; b < mainStride; b++) {
+			h = (h ^ bytes[b]) * 1099511628211ull;
+		}
+		return h;
+	};
+	auto vertexEqual = [&](uint32_t a, uint32_t b) {
+		return memcmp(vertexAt(a), vertexAt(b), mainStride) == 0;
+	};
+	std::unordered_set<uint32_t, decltype(vertexHash), decltype(vertexEqual)>
+		uniqueVertices(1024, vertexHash, vertexEqual);
+	size_t corners = 0;
+
 	for (const auto& shape : shapes) {
 		for (const auto& index : shape.mesh.indices) {
 			std::vector<unsigned char> vertex(mainStride, 0);
@@ -2697,11 +3261,18 @@ void Model::loadModelOBJ(std::string file) {
 				*o = norm;
 			}
 
+			// appended, and removed again if an equal vertex is already there
+			uint32_t candidate = (uint32_t)(vertices.size() / mainStride);
 			vertices.insert(vertices.end(), vertex.begin(), vertex.end());
-			indices.push_back((vertices.size() / mainStride) - 1);
+			auto inserted = uniqueVertices.insert(candidate);
+			if (!inserted.second) {
+				vertices.resize(vertices.size() - mainStride);
+			}
+			indices.push_back(*inserted.first);
+			corners++;
 		}
 	}
-	std::cout << "[OBJ] Vertices: " << (vertices.size() / mainStride);
+	std::cout << "[OBJ] Vertices: " << (vertices.size() / mainStride) << " (welded from " << corners << ")";
 	std::cout << " Indices: " << indices.size() << "\n";
 
 }
@@ -2970,29 +3541,19 @@ void Model::createVertexBuffer() {
 	//	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
 	VkDeviceSize bufferSize = vertices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		vertexBuffer, vertexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);
+	BP->uploads.add(vertexBuffer, vertices.data(), bufferSize);
 }
 
 void Model::createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		indexBuffer, indexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+	BP->uploads.add(indexBuffer, indices.data(), bufferSize);
 }
 
 void Model::initMesh(BaseProject* bp, VertexDescriptor* vd) {
@@ -3008,6 +3569,20 @@ void Model::initMesh(BaseProject* bp, VertexDescriptor* vd) {
 
 void Model::init(BaseProject* bp, VertexDescriptor* vd, std::string file, ModelType MT) {
 	BP = bp;
+	VD = vd;
+	meshKey = file + "|" + std::to_string(MT) + "|" + vd->layoutKey();
+	if (BP->meshes.acquire(this, meshKey)) {
+		return;
+	}
+	load(vd, file, MT);
+
+	createVertexBuffer();
+	createIndexBuffer();
+	BP->meshes.add(this, meshKey);
+}
+
+// Reads the vertices and the indices only, without creating the Vulkan buffers
+void Model::load(VertexDescriptor* vd, std::string file, ModelType MT) {
 	VD = vd;
 	Wm = glm::mat4(1);
 
@@ -3020,16 +3595,14 @@ void Model::init(BaseProject* bp, VertexDescriptor* vd, std::string file, ModelT
 	else if (MT == MGCG) {
 		loadModelGLTF(file, true);
 	}
-
-	createVertexBuffer();
-	createIndexBuffer();
 }
 
 void Model::cleanup() {
-	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
-	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	if (!meshKey.empty() && !BP->meshes.release(meshKey)) {
+		return;	// still used by other models
+	}
+	BP->destroyBuffer(indexBuffer, indexBufferMemory);
+	BP->destroyBuffer(vertexBuffer, vertexBufferMemory);
 }
 
 void Model::bind(VkCommandBuffer commandBuffer) {
@@ -3047,81 +3620,12 @@ void Model::bind(VkCommandBuffer commandBuffer) {
 
 
 
-void Texture::createTextureImage(std::string files[], VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
-	int texWidth, texHeight, texChannels;
-	int curWidth = -1, curHeight = -1, curChannels = -1;
-	stbi_uc* pixels[maxImgs];
-
-	for (int i = 0; i < imgs; i++) {
-		pixels[i] = stbi_load(files[i].c_str(), &texWidth, &texHeight,
-			&texChannels, STBI_rgb_alpha);
-		if (!pixels[i]) {
-			std::cout << "Not found: " << files[i] << "\n";
-			throw std::runtime_error("failed to load texture image!");
-		}
-		std::cout << "[" << i << "]" << files[i] << " -> size: " << texWidth
-			<< "x" << texHeight << ", ch: " << texChannels << "\n";
-
-		if (i == 0) {
-			curWidth = texWidth;
-			curHeight = texHeight;
-			curChannels = texChannels;
-		}
-		else {
-			if ((curWidth != texWidth) ||
-				(curHeight != texHeight) ||
-				(curChannels != texChannels)) {
-				throw std::runtime_error("multi texture images must be all of the same size!");
-			}
-		}
-	}
-
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
-	VkDeviceSize totalImageSize = texWidth * texHeight * 4 * imgs;
-	mipLevels = static_cast<uint32_t>(std::floor(
-		std::log2(std::max(texWidth, texHeight)))) + 1;
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
-	for (int i = 0; i < imgs; i++) {
-		memcpy(static_cast<char*>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
-		stbi_image_free(pixels[i]);
-	}
-	vkUnmapMemory(BP->device, stagingBufferMemory);
-
-
-	BP->createImage(texWidth, texHeight, mipLevels, imgs, VK_SAMPLE_COUNT_1_BIT, Fmt,
-		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-		imgs == 6 ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
-		textureImageMemory);
-
-	BP->transitionImageLayout(textureImage, Fmt,
-		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, imgs);
-	BP->copyBufferToImage(stagingBuffer, textureImage,
-		static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), imgs);
-
-	BP->generateMipmaps(textureImage, Fmt,
-		texWidth, texHeight, mipLevels, imgs);
-
-	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
-}
-
 void Texture::createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
 	textureImageView = BP->createImageView(textureImage,
 		Fmt,
 		VK_IMAGE_ASPECT_COLOR_BIT,
 		mipLevels,
-		imgs == 6 ? VK_IMAGE_VIEW_TYPE_CUBE : VK_IMAGE_VIEW_TYPE_2D,
+		viewType,
 		imgs);
 }
 
@@ -3167,33 +3671,106 @@ void Texture::init(BaseProject* bp, std::string file, VkFormat Fmt = VK_FORMAT_R
 	std::string files[1] = { file };
 	BP = bp;
 	imgs = 1;
-	createTextureImage(files, Fmt);
-	createTextureImageView(Fmt);
-	if (initSampler) {
-		createTextureSampler();
-	}
+	viewType = VK_IMAGE_VIEW_TYPE_2D;
+	BP->textureLoads.add(this, files, Fmt, initSampler);
 }
 
 
 void Texture::initCubic(BaseProject* bp, std::string files[6]) {
 	BP = bp;
 	imgs = 6;
-	createTextureImage(files);
-	createTextureImageView();
-	createTextureSampler();
+	viewType = VK_IMAGE_VIEW_TYPE_CUBE;
+	BP->textureLoads.add(this, files, VK_FORMAT_R8G8B8A8_SRGB, true);
+}
+
+
+// Images of the same size as the layers of a sampler2DArray, so that objects with
+// different textures can be drawn by a single pipeline and descriptor set.
+void Texture::initArray(BaseProject* bp, std::string files[], int layers) {
+	if (layers < 1 || layers > maxImgs) {
+		throw std::runtime_error("a texture array has from 1 to " + std::to_string(maxImgs) + " layers!");
+	}
+	BP = bp;
+	imgs = layers;
+	viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	BP->textureLoads.add(this, files, VK_FORMAT_R8G8B8A8_SRGB, true);
+}
+
+
+// Image written by the shaders with imageStore (e.g. accumulation buffers).
+// It is left in the GENERAL layout; with more than one layer it is viewed as a 2D array.
+void Texture::initStorage(BaseProject* bp, uint32_t width, uint32_t height, int layers, VkFormat Fmt) {
+	BP = bp;
+	imgs = layers;
+	viewType = layers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+	mipLevels = 1;
+
+	BP->createImage(width, height, 1, layers, VK_SAMPLE_COUNT_1_BIT, Fmt,
+		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+		VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+	textureImageView = BP->createImageView(textureImage, Fmt, VK_IMAGE_ASPECT_COLOR_BIT, 1,
+		viewType, layers);
+
+	BP->transitionImageLayout(textureImage, Fmt,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 1, layers);
+
+	createTextureSampler(VK_FILTER_NEAREST, VK_FILTER_NEAREST,
+		VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_FALSE, 1.0f, 1.0f);
 }
 
 
 void Texture::cleanup() {
 	vkDestroySampler(BP->device, textureSampler, nullptr);
 	vkDestroyImageView(BP->device, textureImageView, nullptr);
-	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->destroyImage(textureImage, textureImageMemory);
+}
+
+
+
+
+
+void SpecializationConstants::set(uint32_t constantID, int32_t value) {
+	uint32_t word;
+	memcpy(&word, &value, sizeof(word));
+	for (int i = 0; i < entries.size(); i++) {
+		if (entries[i].constantID == constantID) {
+			data[i] = word;
+			return;
+		}
+	}
+	entries.push_back({ constantID, static_cast<uint32_t>(data.size() * sizeof(uint32_t)), sizeof(uint32_t) });
+	data.push_back(word);
 }
 
+void SpecializationConstants::set(uint32_t constantID, float value) {
+	int32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	set(constantID, bits);
+}
 
+bool SpecializationConstants::empty() const {
+	return entries.empty();
+}
 
+VkSpecializationInfo SpecializationConstants::getInfo() const {
+	VkSpecializationInfo info{};
+	info.mapEntryCount = static_cast<uint32_t>(entries.size());
+	info.pMapEntries = entries.data();
+	info.dataSize = data.size() * sizeof(uint32_t);
+	info.pData = data.data();
+	return info;
+}
 
+std::vector<uint32_t> SpecializationConstants::key() const {
+	std::vector<uint32_t> k;
+	for (int i = 0; i < entries.size(); i++) {
+		k.push_back(entries[i].constantID);
+		k.push_back(data[i]);
+	}
+	return k;
+}
 
 void Pipeline::init(BaseProject* bp, VertexDescriptor* vd,
 	const std::string& VertShader, const std::string& FragShader,
@@ -3231,14 +3808,20 @@ void Pipeline::setAdvancedFeatures(VkCompareOp _compareOp,
 	transp = _transp;
 }
 
+void Pipeline::setSpecialization(const SpecializationConstants& _SC) {
+	SC = _SC;
+}
 
 void Pipeline::create() {
+	VkSpecializationInfo specializationInfo = SC.getInfo();
+
 	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
 	vertShaderStageInfo.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
 	vertShaderStageInfo.module = vertShaderModule;
 	vertShaderStageInfo.pName = "main";
+	vertShaderStageInfo.pSpecializationInfo = SC.empty() ? nullptr : &specializationInfo;
 
 	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
 	fragShaderStageInfo.sType =
@@ -3246,6 +3829,7 @@ void Pipeline::create() {
 	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
 	fragShaderStageInfo.module = fragShaderModule;
 	fragShaderStageInfo.pName = "main";
+	fragShaderStageInfo.pSpecializationInfo = SC.empty() ? nullptr : &specializationInfo;
 
 	VkPipelineShaderStageCreateInfo shaderStages[] =
 	{ vertShaderStageInfo, fragShaderStageInfo };
@@ -3397,12 +3981,25 @@ void Pipeline::create() {
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
+	VkPipelineCreationFeedbackEXT feedback{};
+	VkPipelineCreationFeedbackEXT stageFeedbacks[2]{};
+	VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo{};
+	feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+	feedbackInfo.pPipelineCreationFeedback = &feedback;
+	feedbackInfo.pipelineStageCreationFeedbackCount = 2;
+	feedbackInfo.pPipelineStageCreationFeedbacks = stageFeedbacks;
+	if (BP->pipelineCreationFeedback) {
+		pipelineInfo.pNext = &feedbackInfo;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache, 1,
 		&pipelineInfo, nullptr, &graphicsPipeline);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
+	BP->recordPipelineCreation(start, feedback);
 
 }
 
@@ -3441,6 +4038,107 @@ void Pipeline::cleanup() {
 	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
+void ComputePipeline::init(BaseProject* bp, const std::string& CompShader,
+	std::vector<DescriptorSetLayout*> d) {
+	BP = bp;
+
+	auto compShaderCode = readFile(CompShader);
+	std::cout << "Compute shader <" << CompShader << "> len: " <<
+		compShaderCode.size() << "\n";
+
+	VkShaderModuleCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.codeSize = compShaderCode.size();
+	createInfo.pCode = reinterpret_cast<const uint32_t*>(compShaderCode.data());
+
+	VkResult result = vkCreateShaderModule(BP->device, &createInfo, nullptr,
+		&compShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	D = d;
+}
+
+void ComputePipeline::setSpecialization(const SpecializationConstants& _SC) {
+	SC = _SC;
+}
+
+void ComputePipeline::create() {
+	VkSpecializationInfo specializationInfo = SC.getInfo();
+
+	VkPipelineShaderStageCreateInfo compShaderStageInfo{};
+	compShaderStageInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	compShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	compShaderStageInfo.module = compShaderModule;
+	compShaderStageInfo.pName = "main";
+	compShaderStageInfo.pSpecializationInfo = SC.empty() ? nullptr : &specializationInfo;
+
+	std::vector<VkDescriptorSetLayout> DSL(D.size());
+	for (int i = 0; i < D.size(); i++) {
+		DSL[i] = D[i]->descriptorSetLayout;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = DSL.size();
+	pipelineLayoutInfo.pSetLayouts = DSL.data();
+	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
+	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+
+	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+		&pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = compShaderStageInfo;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
+	pipelineInfo.basePipelineIndex = -1; // Optional
+
+	VkPipelineCreationFeedbackEXT feedback{};
+	VkPipelineCreationFeedbackEXT stageFeedback{};
+	VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo{};
+	feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+	feedbackInfo.pPipelineCreationFeedback = &feedback;
+	feedbackInfo.pipelineStageCreationFeedbackCount = 1;
+	feedbackInfo.pPipelineStageCreationFeedbacks = &stageFeedback;
+	if (BP->pipelineCreationFeedback) {
+		pipelineInfo.pNext = &feedbackInfo;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache, 1,
+		&pipelineInfo, nullptr, &computePipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+	BP->recordPipelineCreation(start, feedback);
+}
+
+void ComputePipeline::destroy() {
+	vkDestroyShaderModule(BP->device, compShaderModule, nullptr);
+}
+
+void ComputePipeline::bind(VkCommandBuffer commandBuffer) {
+	vkCmdBindPipeline(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		computePipeline);
+}
+
+void ComputePipeline::cleanup() {
+	vkDestroyPipeline(BP->device, computePipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+}
+
 void DescriptorSetLayout::init(BaseProject* bp, std::vector<DescriptorSetLayoutBinding> B) {
 	BP = bp;
 	Bindings = B;
@@ -3450,11 +4148,14 @@ void DescriptorSetLayout::init(BaseProject* bp, std::vector<DescriptorSetLayoutB
 	binds.resize(B.size());
 	for (int i = 0; i < B.size(); i++) {
 		binds[i].binding = B[i].binding;
-		binds[i].descriptorType = B[i].type;
+		// uniform blocks live in the UniformRing, their offsets are given when the set is bound
+		binds[i].descriptorType = B[i].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ?
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : B[i].type;
 		binds[i].descriptorCount = B[i].count;
 		binds[i].stageFlags = B[i].flags;
 		binds[i].pImmutableSamplers = nullptr;
-		if ((B[i].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) && (B[i].linkSize + B[i].count > imgInfoSize)) {
+		if ((B[i].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER ||
+			 B[i].type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE) && (B[i].linkSize + B[i].count > imgInfoSize)) {
 			imgInfoSize = B[i].linkSize + B[i].count;
 		}
 	}
@@ -3477,7 +4178,7 @@ void DescriptorSetLayout::cleanup() {
 }
 
 void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
-	std::vector<Texture*>Txs) {
+	std::vector<Texture*>Txs, std::vector<StorageBuffer*>Sbs) {
 	BP = bp;
 	Layout = DSL;
 
@@ -3485,28 +4186,22 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 	int imgInfoSize = DSL->imgInfoSize;
 	//std::cout << "imgInfoSize: " << imgInfoSize << "(" << size << ")\n";
 
-	uniformBuffers.resize(size);
-	uniformBuffersMemory.resize(size);
-	toFree.resize(size);
-
-	//std::cout << "Descriptor set init: " << E.size() << "\n";
+	uniforms.assign(size, UniformAllocation());
+	std::vector<int> uniformBindings;	// indices in Bindings, sorted by binding number for the dynamic offsets
 	for (int j = 0; j < size; j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-		//std::cout << j << " " << E[j].type << "\n";
 		if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-			//std::cout << "Uniform size: " << E[j].size << "\n";
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = DSL->Bindings[j].linkSize;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-					uniformBuffers[j][i], uniformBuffersMemory[j][i]);
-			}
-			toFree[j] = true;
+			uniforms[j] = BP->uniforms.allocate(BP, DSL->Bindings[j].linkSize);
+			uniformBindings.push_back(j);
 		}
-		else {
-			toFree[j] = false;
+	}
+	std::sort(uniformBindings.begin(), uniformBindings.end(), [DSL](int a, int b) {
+		return DSL->Bindings[a].binding < DSL->Bindings[b].binding;
+	});
+	dynamicOffsets.resize(BP->swapChainImages.size());
+	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+		dynamicOffsets[i].clear();
+		for (int j : uniformBindings) {
+			dynamicOffsets[i].push_back(uniforms[j].dynamicOffset((int)i));
 		}
 	}
 
@@ -3533,7 +4228,8 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 		std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
 		for (int j = 0; j < size; j++) {
 			if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-				bufferInfo[j].buffer = uniformBuffers[j][i];
+				// the region of the image is added by the dynamic offset
+				bufferInfo[j].buffer = uniforms[j].buffer;
 				bufferInfo[j].offset = 0;
 				bufferInfo[j].range = DSL->Bindings[j].linkSize;
 
@@ -3541,28 +4237,46 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
 				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
 			}
-			else if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+			else if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER ||
+					 DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE) {
+				// storage images are accessed with imageLoad/imageStore, in the GENERAL layout
+				bool storage = DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 				for (int k = 0; k < DSL->Bindings[j].count; k++) {
 					int h = DSL->Bindings[j].linkSize + k;
 					Texture* Tx = Txs[h];
-					imageInfo[h].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+					imageInfo[h].imageLayout = storage ? VK_IMAGE_LAYOUT_GENERAL :
+						VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 					imageInfo[h].imageView = Tx->textureImageView;
-					imageInfo[h].sampler = Tx->textureSampler;
+					imageInfo[h].sampler = storage ? VK_NULL_HANDLE : Tx->textureSampler;
 				}
 
 				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType =
-					VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+				descriptorWrites[j].descriptorType = DSL->Bindings[j].type;
 				descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
 				descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
 			}
+			else if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
+				// for storage buffers linkSize is the index in the Sbs vector
+				StorageBuffer* Sb = Sbs[DSL->Bindings[j].linkSize];
+				bufferInfo[j].buffer = Sb->buffer;
+				bufferInfo[j].offset = 0;
+				bufferInfo[j].range = Sb->size;
+
+				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				descriptorWrites[j].dstSet = descriptorSets[i];
+				descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
+				descriptorWrites[j].dstArrayElement = 0;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+				descriptorWrites[j].descriptorCount = 1;
+				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
+			}
 		}
 		vkUpdateDescriptorSets(BP->device,
 			static_cast<uint32_t>(descriptorWrites.size()),
@@ -3570,33 +4284,719 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 	}
 }
 
-void DescriptorSet::cleanup() {
-	for (int j = 0; j < uniformBuffers.size(); j++) {
-		if (toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-			}
-		}
+// Read-only data for the shaders, uploaded once to device local memory
+void StorageBuffer::init(BaseProject* bp, const void* data, VkDeviceSize bufferSize) {
+	BP = bp;
+	// Vulkan does not allow empty buffers, an empty table still gets a small (unused) one
+	size = std::max(bufferSize, (VkDeviceSize)16);
+
+	BP->createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
+	if (bufferSize > 0) {
+		BP->uploads.add(buffer, data, bufferSize);
 	}
 }
 
+void StorageBuffer::cleanup() {
+	BP->destroyBuffer(buffer, bufferMemory);
+}
+
+void UploadBatch::begin(BaseProject* bp) {
+	BP = bp;
+	batching = true;
+}
+
+void UploadBatch::add(VkBuffer dst, const void* data, VkDeviceSize size) {
+	// copies from the staging buffer start at multiples of 16, enough for any buffer usage
+	VkDeviceSize offset = (arena.size() + 15) & ~(VkDeviceSize)15;
+	arena.resize(offset + size);
+	memcpy(arena.data() + offset, data, (size_t)size);
+	copies.push_back({ dst, offset, size });
+	if (!batching) {
+		submit();
+	}
+}
+
+void UploadBatch::submit() {
+	batching = false;
+	if (copies.empty()) {
+		return;
+	}
+
+	VkBuffer stagingBuffer;
+	MemoryAllocation stagingBufferMemory;
+	BP->createBuffer(arena.size(), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		stagingBuffer, stagingBufferMemory, MEMORY_SHORT_LIVED);
+	memcpy(stagingBufferMemory.mapped, arena.data(), arena.size());
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = BP->commandPool;
+	allocInfo.commandBufferCount = 1;
+	VkCommandBuffer commandBuffer;
+	VkResult result = vkAllocateCommandBuffers(BP->device, &allocInfo, &commandBuffer);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate upload command buffer!");
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+	for (const Copy& C : copies) {
+		VkBufferCopy copyRegion{};
+		copyRegion.srcOffset = C.offset;
+		copyRegion.size = C.size;
+		vkCmdCopyBuffer(commandBuffer, stagingBuffer, C.dst, 1, &copyRegion);
+	}
+
+	// the fence only synchronizes with the host: the copies are made visible to every later use on the device
+	VkMemoryBarrier uploaded{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	uploaded.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	uploaded.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &uploaded, 0, nullptr, 0, nullptr);
+	vkEndCommandBuffer(commandBuffer);
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	VkFence fence;
+	result = vkCreateFence(BP->device, &fenceInfo, nullptr, &fence);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create upload fence!");
+	}
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	result = vkQueueSubmit(BP->graphicsQueue, 1, &submitInfo, fence);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to submit buffer uploads!");
+	}
+	vkWaitForFences(BP->device, 1, &fence, VK_TRUE, UINT64_MAX);
+
+	if (copies.size() > 1) {
+		std::cout << "Uploaded " << copies.size() << " buffers, " << arena.size() / 1024 << " KB in one submit\n";
+	}
+
+	vkDestroyFence(BP->device, fence, nullptr);
+	vkFreeCommandBuffers(BP->device, BP->commandPool, 1, &commandBuffer);
+	BP->destroyBuffer(stagingBuffer, stagingBufferMemory);
+	arena.clear();
+	arena.shrink_to_fit();
+	copies.clear();
+}
+
+// The uniform blocks are released with the whole UniformRing, when the swap chain is recreated
+void DescriptorSet::cleanup() {
+	uniforms.clear();
+	dynamicOffsets.clear();
+}
+
 void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline& P, int setId,
 	int currentImage) {
 	//std::cout << "DS[ci]: " << &descriptorSets[currentImage] << "\n";
 	vkCmdBindDescriptorSets(commandBuffer,
 		VK_PIPELINE_BIND_POINT_GRAPHICS,
 		P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
-		0, nullptr);
+		static_cast<uint32_t>(dynamicOffsets[currentImage].size()), dynamicOffsets[currentImage].data());
+}
+
+void DescriptorSet::bind(VkCommandBuffer commandBuffer, ComputePipeline& P, int setId,
+	int currentImage) {
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
+		static_cast<uint32_t>(dynamicOffsets[currentImage].size()), dynamicOffsets[currentImage].data());
 }
 
+// The memory is coherent and mapped: the copy is visible to the next submission of the image
 void DescriptorSet::map(int currentImage, void* src, int slot) {
-	void* data;
+	memcpy(uniforms[slot].data(currentImage), src, Layout->Bindings[slot].linkSize);
+}
 
-	int size = Layout->Bindings[slot].linkSize;
+UniformAllocation UniformRing::allocate(BaseProject* bp, VkDeviceSize size) {
+	BP = bp;
+	if (alignment == 0) {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+		alignment = std::max(properties.limits.minUniformBufferOffsetAlignment, (VkDeviceSize)16);
+	}
+	VkDeviceSize alignedSize = (size + alignment - 1) / alignment * alignment;
+
+	Chunk* C = chunks.empty() ? nullptr : &chunks.back();
+	if (C == nullptr || C->used + alignedSize > C->regionSize) {
+		// blocks larger than a region get a chunk of their own
+		Chunk chunk{};
+		chunk.regionSize = std::max(UNIFORM_RING_REGION_SIZE, alignedSize);
+		VkDeviceSize bufferSize = chunk.regionSize * BP->swapChainImages.size();
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			chunk.buffer, chunk.memory);
+		chunks.push_back(chunk);
+		C = &chunks.back();
+	}
 
-	vkMapMemory(BP->device, uniformBuffersMemory[slot][currentImage], 0,
-		size, 0, &data);
-	memcpy(data, src, size);
-	vkUnmapMemory(BP->device, uniformBuffersMemory[slot][currentImage]);
-}
\ No newline at end of file
+	UniformAllocation A;
+	A.buffer = C->buffer;
+	A.offset = C->used;
+	A.regionSize = C->regionSize;
+	A.size = size;
+	A.mapped = C->memory.mapped;
+	C->used += alignedSize;
+	return A;
+}
+
+void UniformRing::cleanup() {
+	for (Chunk& C : chunks) {
+		BP->destroyBuffer(C.buffer, C.memory);
+	}
+	chunks.clear();
+}
+
+void DeviceMemoryAllocator::init(BaseProject* bp) {
+	BP = bp;
+	vkGetPhysicalDeviceMemoryProperties(BP->physicalDevice, &memoryProperties);
+}
+
+int DeviceMemoryAllocator::findPool(uint32_t memoryType, bool image, MemoryLifetime lifetime) {
+	for (int i = 0; i < (int)pools.size(); i++) {
+		if (pools[i].memoryType == memoryType && pools[i].images == image && pools[i].lifetime == lifetime) {
+			return i;
+		}
+	}
+
+	DeviceMemoryPool P;
+	P.memoryType = memoryType;
+	P.images = image;
+	P.lifetime = lifetime;
+	P.hostVisible = (memoryProperties.memoryTypes[memoryType].propertyFlags &
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+	// small heaps (e.g. the 256 MB device local and host visible one) get smaller blocks
+	VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryType].heapIndex].size;
+	if (lifetime == MEMORY_SHORT_LIVED) {
+		P.blockSize = std::min(DEVICE_MEMORY_LINEAR_BLOCK_SIZE, heapSize / 8);
+	}
+	else {
+		P.blockSize = DEVICE_MEMORY_BLOCK_SIZE;
+		while (P.blockSize > DEVICE_MEMORY_MIN_RANGE && P.blockSize > heapSize / 8) {
+			P.blockSize /= 2;
+		}
+	}
+	pools.push_back(P);
+	return (int)pools.size() - 1;
+}
+
+VkDeviceMemory DeviceMemoryAllocator::allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType,
+	unsigned char** mapped) {
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	VkDeviceMemory memory;
+	VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr, &memory);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate device memory!");
+	}
+
+	*mapped = nullptr;
+	if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		void* data;
+		result = vkMapMemory(BP->device, memory, 0, VK_WHOLE_SIZE, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map device memory!");
+		}
+		*mapped = static_cast<unsigned char*>(data);
+	}
+
+	deviceAllocations++;
+	peakDeviceAllocations = std::max(peakDeviceAllocations, deviceAllocations);
+	return memory;
+}
+
+void DeviceMemoryAllocator::freeDeviceMemory(VkDeviceMemory memory, unsigned char* mapped) {
+	if (mapped != nullptr) {
+		vkUnmapMemory(BP->device, memory);
+	}
+	vkFreeMemory(BP->device, memory, nullptr);
+	deviceAllocations--;
+}
+
+MemoryAllocation DeviceMemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+	VkMemoryPropertyFlags properties, bool image, MemoryLifetime lifetime) {
+	uint32_t memoryType = BP->findMemoryType(requirements.memoryTypeBits, properties);
+	int p = findPool(memoryType, image, lifetime);
+	DeviceMemoryPool& P = pools[p];
+
+	MemoryAllocation A;
+	if (requirements.size > P.blockSize) {
+		A.memory = allocateDeviceMemory(requirements.size, memoryType, &A.mapped);
+		A.size = requirements.size;
+		dedicated++;
+		dedicatedBytes += A.size;
+		return A;
+	}
+
+	int b = 0;
+	bool found = false;
+	while (!found && b < (int)P.blocks.size()) {
+		DeviceMemoryPool::Block& B = P.blocks[b];
+		if (B.memory != VK_NULL_HANDLE && lifetime == MEMORY_SHORT_LIVED) {
+			found = B.linear.allocate(requirements.size, requirements.alignment, A.offset);
+			A.size = requirements.size;
+		}
+		else if (B.memory != VK_NULL_HANDLE) {
+			found = B.buddy.allocate(requirements.size, requirements.alignment, A.offset, A.size);
+		}
+		if (!found) {
+			b++;
+		}
+	}
+	if (!found) {
+		// a new block, in the slot of a released one if there is any
+		DeviceMemoryPool::Block B{};
+		B.memory = allocateDeviceMemory(P.blockSize, memoryType, &B.mapped);
+		if (lifetime == MEMORY_SHORT_LIVED) {
+			B.linear.size = P.blockSize;
+			B.linear.allocate(requirements.size, requirements.alignment, A.offset);
+			A.size = requirements.size;
+		}
+		else {
+			B.buddy.init(P.blockSize, DEVICE_MEMORY_MIN_RANGE);
+			B.buddy.allocate(requirements.size, requirements.alignment, A.offset, A.size);
+		}
+		b = 0;
+		while (b < (int)P.blocks.size() && P.blocks[b].memory != VK_NULL_HANDLE) {
+			b++;
+		}
+		if (b == (int)P.blocks.size()) {
+			P.blocks.push_back(B);
+		}
+		else {
+			P.blocks[b] = B;
+		}
+	}
+
+	DeviceMemoryPool::Block& B = P.blocks[b];
+	A.memory = B.memory;
+	A.mapped = B.mapped != nullptr ? B.mapped + A.offset : nullptr;
+	A.pool = p;
+	A.block = b;
+	P.allocations++;
+	P.used += A.size;
+	P.peakUsed = std::max(P.peakUsed, P.used);
+	return A;
+}
+
+void DeviceMemoryAllocator::free(MemoryAllocation& A) {
+	if (A.memory == VK_NULL_HANDLE) {
+		return;
+	}
+	if (A.pool < 0) {
+		freeDeviceMemory(A.memory, A.mapped);
+		dedicated--;
+		dedicatedBytes -= A.size;
+		A = MemoryAllocation();
+		return;
+	}
+
+	DeviceMemoryPool& P = pools[A.pool];
+	DeviceMemoryPool::Block& B = P.blocks[A.block];
+	bool empty;
+	if (P.lifetime == MEMORY_SHORT_LIVED) {
+		B.linear.free();
+		empty = B.linear.live == 0;
+	}
+	else {
+		B.buddy.free(A.offset, A.size);
+		empty = B.buddy.empty();
+	}
+	P.allocations--;
+	P.used -= A.size;
+
+	// an empty block is released, unless it is the last one of its pool
+	int liveBlocks = 0;
+	for (DeviceMemoryPool::Block& other : P.blocks) {
+		liveBlocks += other.memory != VK_NULL_HANDLE ? 1 : 0;
+	}
+	if (empty && liveBlocks > 1) {
+		freeDeviceMemory(B.memory, B.mapped);
+		B = DeviceMemoryPool::Block{};
+	}
+	A = MemoryAllocation();
+}
+
+void DeviceMemoryAllocator::printStats(const char* when) {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	std::cout << "Device memory after " << when << ": " << deviceAllocations << " allocations (peak "
+		<< peakDeviceAllocations << ", limit " << properties.limits.maxMemoryAllocationCount << ")";
+	if (dedicated > 0) {
+		std::cout << ", " << dedicated << " dedicated of " << dedicatedBytes / 1024 << " KB";
+	}
+	std::cout << "\n";
+	for (DeviceMemoryPool& P : pools) {
+		int liveBlocks = 0;
+		for (DeviceMemoryPool::Block& B : P.blocks) {
+			liveBlocks += B.memory != VK_NULL_HANDLE ? 1 : 0;
+		}
+		VkDeviceSize reserved = liveBlocks * P.blockSize;
+		std::cout << "  type " << P.memoryType << (P.images ? " images" : " buffers")
+			<< (P.lifetime == MEMORY_SHORT_LIVED ? " (linear)" : " (buddy)") << ": "
+			<< P.allocations << " allocations, " << P.used / 1024 << " KB used of "
+			<< liveBlocks << " x " << P.blockSize / 1024 << " KB blocks";
+		if (reserved > 0) {
+			std::cout << " (" << 100 * P.used / reserved << "%)";
+		}
+		std::cout << ", peak " << P.peakUsed / 1024 << " KB\n";
+	}
+}
+
+void DeviceMemoryAllocator::cleanup() {
+	int leaked = 0;
+	for (DeviceMemoryPool& P : pools) {
+		leaked += P.allocations;
+		for (DeviceMemoryPool::Block& B : P.blocks) {
+			if (B.memory != VK_NULL_HANDLE) {
+				freeDeviceMemory(B.memory, B.mapped);
+			}
+		}
+	}
+	if (leaked + dedicated > 0) {
+		std::cout << "Warning: " << leaked + dedicated << " device memory allocations were not freed\n";
+	}
+	pools.clear();
+}
+
+
+void TextureLoader::begin(BaseProject* bp) {
+	BP = bp;
+	batching = true;
+	startTime = std::chrono::high_resolution_clock::now();
+}
+
+// Runs on a worker: no Vulkan calls, errors are reported by submit() on the main thread
+void TextureLoader::decode(Job& J) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < (int)J.files.size(); i++) {
+		int texWidth, texHeight, texChannels;
+		J.pixels[i] = stbi_load(J.files[i].c_str(), &texWidth, &texHeight,
+			&texChannels, STBI_rgb_alpha);
+		if (!J.pixels[i]) {
+			J.error = "failed to load texture image!";
+			J.errorFile = "Not found: " + J.files[i];
+			break;
+		}
+		J.channels[i] = texChannels;
+		if (i == 0) {
+			J.width = texWidth;
+			J.height = texHeight;
+		}
+		else if ((J.width != texWidth) || (J.height != texHeight)) {
+			J.error = "multi texture images must be all of the same size!";
+			J.errorFile = "Different size: " + J.files[i];
+			break;
+		}
+	}
+	J.decodeMs = std::chrono::duration<double, std::milli>(
+		std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void TextureLoader::add(Texture* T, std::string files[], VkFormat Fmt, bool initSampler) {
+	if (!batching) {
+		// a texture of its own: the previous batch must be complete first
+		wait();
+		BP = T->BP;
+		startTime = std::chrono::high_resolution_clock::now();
+	}
+
+	jobs.push_back(std::make_unique<Job>());
+	Job* J = jobs.back().get();
+	J->T = T;
+	J->files.assign(files, files + T->imgs);
+	J->Fmt = Fmt;
+	J->initSampler = initSampler;
+	J->pixels.assign(T->imgs, nullptr);
+	J->channels.assign(T->imgs, 0);
+
+	if (batching) {
+		ThreadPool::global().submit(decoders, [J]() { decode(*J); });
+	}
+	else {
+		decode(*J);
+		submit();
+		wait();
+	}
+}
+
+void TextureLoader::submit() {
+	batching = false;
+	if (jobs.empty()) {
+		return;
+	}
+	ThreadPool::global().wait(decoders);
+	double decodeMs = std::chrono::duration<double, std::milli>(
+		std::chrono::high_resolution_clock::now() - startTime).count();
+
+	uploadedBytes = 0;
+	for (auto& J : jobs) {
+		if (!J->error.empty()) {
+			for (stbi_uc* pixels : J->pixels) {
+				stbi_image_free(pixels);
+			}
+			std::cout << J->errorFile << "\n";
+			throw std::runtime_error(J->error);
+		}
+		for (int i = 0; i < (int)J->files.size(); i++) {
+			std::cout << "[" << i << "]" << J->files[i] << " -> size: " << J->width
+				<< "x" << J->height << ", ch: " << J->channels[i] << "\n";
+		}
+		J->stagingOffset = uploadedBytes;
+		uploadedBytes += (VkDeviceSize)J->width * J->height * 4 * J->files.size();
+	}
+
+	BP->createBuffer(uploadedBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		stagingBuffer, stagingBufferMemory, MEMORY_SHORT_LIVED);
+
+	for (auto& J : jobs) {
+		Texture* T = J->T;
+		VkDeviceSize imageSize = (VkDeviceSize)J->width * J->height * 4;
+		for (int i = 0; i < (int)J->files.size(); i++) {
+			memcpy(stagingBufferMemory.mapped + J->stagingOffset + imageSize * i, J->pixels[i],
+				static_cast<size_t>(imageSize));
+			stbi_image_free(J->pixels[i]);
+		}
+		J->pixels.clear();
+
+		T->mipLevels = static_cast<uint32_t>(std::floor(
+			std::log2(std::max(J->width, J->height)))) + 1;
+		BP->createImage(J->width, J->height, T->mipLevels, T->imgs, VK_SAMPLE_COUNT_1_BIT, J->Fmt,
+			VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+			VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+			T->viewType == VK_IMAGE_VIEW_TYPE_CUBE ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, T->textureImage,
+			T->textureImageMemory);
+	}
+
+	QueueFamilyIndices indices = BP->findQueueFamilies(BP->physicalDevice);
+	bool dedicatedTransfer = BP->transferQueue != VK_NULL_HANDLE;
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	allocInfo.commandPool = BP->commandPool;
+	vkAllocateCommandBuffers(BP->device, &allocInfo, &graphicsCommandBuffer);
+	VkCommandBuffer copyCommandBuffer = graphicsCommandBuffer;
+	if (dedicatedTransfer) {
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = indices.transferFamily.value();
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		VkResult result = vkCreateCommandPool(BP->device, &poolInfo, nullptr, &transferCommandPool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create the transfer command pool!");
+		}
+		allocInfo.commandPool = transferCommandPool;
+		vkAllocateCommandBuffers(BP->device, &allocInfo, &transferCommandBuffer);
+		copyCommandBuffer = transferCommandBuffer;
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(graphicsCommandBuffer, &beginInfo);
+	if (dedicatedTransfer) {
+		vkBeginCommandBuffer(transferCommandBuffer, &beginInfo);
+	}
+
+	for (auto& J : jobs) {
+		Texture* T = J->T;
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.image = T->textureImage;
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = T->mipLevels;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = T->imgs;
+
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(copyCommandBuffer,
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+
+		VkBufferImageCopy region{};
+		region.bufferOffset = J->stagingOffset;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = T->imgs;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { (uint32_t)J->width, (uint32_t)J->height, 1 };
+		vkCmdCopyBufferToImage(copyCommandBuffer, stagingBuffer, T->textureImage,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+		if (dedicatedTransfer) {
+			// ownership of the image goes from the transfer to the graphics family:
+			// the same barrier is recorded on both queues, as release and as acquire
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.srcQueueFamilyIndex = indices.transferFamily.value();
+			barrier.dstQueueFamilyIndex = indices.graphicsFamily.value();
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = 0;
+			vkCmdPipelineBarrier(transferCommandBuffer,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+				0, nullptr, 0, nullptr, 1, &barrier);
+
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+			vkCmdPipelineBarrier(graphicsCommandBuffer,
+				VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+				0, nullptr, 0, nullptr, 1, &barrier);
+		}
+
+		BP->recordMipmaps(graphicsCommandBuffer, T->textureImage, J->Fmt,
+			J->width, J->height, T->mipLevels, T->imgs);
+	}
+
+	VkResult result;
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	if (dedicatedTransfer) {
+		vkEndCommandBuffer(transferCommandBuffer);
+
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		vkCreateSemaphore(BP->device, &semaphoreInfo, nullptr, &transferDone);
+
+		submitInfo.pCommandBuffers = &transferCommandBuffer;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &transferDone;
+		result = vkQueueSubmit(BP->transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to submit the texture copies!");
+		}
+
+		submitInfo.signalSemaphoreCount = 0;
+		submitInfo.pSignalSemaphores = nullptr;
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &transferDone;
+		submitInfo.pWaitDstStageMask = &waitStage;
+	}
+	vkEndCommandBuffer(graphicsCommandBuffer);
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	vkCreateFence(BP->device, &fenceInfo, nullptr, &fence);
+
+	submitInfo.pCommandBuffers = &graphicsCommandBuffer;
+	result = vkQueueSubmit(BP->graphicsQueue, 1, &submitInfo, fence);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to submit the texture uploads!");
+	}
+
+	double slowestMs = 0.0, totalMs = 0.0;
+	for (auto& J : jobs) {
+		J->T->createTextureImageView(J->Fmt);
+		if (J->initSampler) {
+			J->T->createTextureSampler();
+		}
+		slowestMs = std::max(slowestMs, J->decodeMs);
+		totalMs += J->decodeMs;
+	}
+	if (jobs.size() > 1) {
+		std::cout << "Decoded " << jobs.size() << " textures in " << decodeMs << " ms (slowest "
+			<< slowestMs << " ms, " << totalMs << " ms one after the other)"
+			<< (dedicatedTransfer ? ", copied by the transfer queue\n" : "\n");
+	}
+}
+
+void TextureLoader::wait() {
+	if (fence == VK_NULL_HANDLE) {
+		return;
+	}
+	vkWaitForFences(BP->device, 1, &fence, VK_TRUE, UINT64_MAX);
+	vkDestroyFence(BP->device, fence, nullptr);
+	fence = VK_NULL_HANDLE;
+
+	vkFreeCommandBuffers(BP->device, BP->commandPool, 1, &graphicsCommandBuffer);
+	if (transferCommandPool != VK_NULL_HANDLE) {
+		vkDestroySemaphore(BP->device, transferDone, nullptr);
+		vkDestroyCommandPool(BP->device, transferCommandPool, nullptr);
+		transferDone = VK_NULL_HANDLE;
+		transferCommandPool = VK_NULL_HANDLE;
+	}
+	BP->destroyBuffer(stagingBuffer, stagingBufferMemory);
+	jobs.clear();
+}
+
+
+bool MeshRegistry::acquire(Model* M, const std::string& key) {
+	auto it = meshes.find(key);
+	if (it == meshes.end()) {
+		return false;
+	}
+	Mesh& S = it->second;
+	S.references++;
+	M->vertexBuffer = S.vertexBuffer;
+	M->vertexBufferMemory = S.vertexBufferMemory;
+	M->indexBuffer = S.indexBuffer;
+	M->indexBufferMemory = S.indexBufferMemory;
+	M->vertices = S.vertices;
+	M->indices = S.indices;
+	M->Wm = S.Wm;
+	std::cout << "Sharing : " << key.substr(0, key.find('|')) << " (" << S.references << " models)\n";
+	return true;
+}
+
+void MeshRegistry::add(Model* M, const std::string& key) {
+	Mesh S;
+	S.vertexBuffer = M->vertexBuffer;
+	S.vertexBufferMemory = M->vertexBufferMemory;
+	S.indexBuffer = M->indexBuffer;
+	S.indexBufferMemory = M->indexBufferMemory;
+	S.vertices = M->vertices;
+	S.indices = M->indices;
+	S.Wm = M->Wm;
+	S.references = 1;
+	meshes[key] = S;
+}
+
+bool MeshRegistry::release(const std::string& key) {
+	auto it = meshes.find(key);
+	if (it == meshes.end()) {
+		return true;
+	}
+	if (--it->second.references > 0) {
+		return false;
+	}
+	meshes.erase(it);
+	return true;
+}
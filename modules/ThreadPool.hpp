@@ -0,0 +1,199 @@
+// Work-stealing thread pool used by the CPU-side renderers and builders.
+//
+// Every worker owns a deque: it pushes and pops its own tasks at the back and,
+// when it runs out of work, steals from the front of the other workers' deques.
+// Tasks are submitted in a TaskGroup and wait(group) returns once that group
+// has finished, so independent clients of the same pool do not wait for each
+// other and a task may itself wait for a group of sub-tasks (as parallelFor
+// does). The waiting thread helps out instead of sleeping.
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// Completion counter of a set of tasks, owned by whoever waits for them.
+// It must outlive its tasks: wait for it before it goes out of scope.
+class TaskGroup {
+public:
+	TaskGroup() = default;
+	TaskGroup(const TaskGroup &) = delete;
+	TaskGroup &operator=(const TaskGroup &) = delete;
+
+	bool done() const {
+		return pending.load() == 0;
+	}
+
+private:
+	std::atomic<int> pending{0};
+	friend class ThreadPool;
+};
+
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned int threadCount = 0) {
+		if(threadCount == 0) {
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		queues.resize(threadCount);
+		for(auto &q : queues) {
+			q = std::make_unique<WorkQueue>();
+		}
+		for(unsigned int i = 0; i < threadCount; i++) {
+			workers.emplace_back([this, i]() { workerLoop(i); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		sleepCV.notify_all();
+		for(auto &w : workers) {
+			w.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	unsigned int size() const {
+		return static_cast<unsigned int>(workers.size());
+	}
+
+	// Tasks submitted from a worker go on that worker's own deque (good locality
+	// for recursive work such as BVH builds), the others are spread round-robin.
+	void submit(TaskGroup &group, std::function<void()> task) {
+		size_t q = (currentPool == this && currentWorker >= 0) ?
+					currentWorker : (nextQueue++ % queues.size());
+		group.pending++;
+		{
+			std::lock_guard<std::mutex> lock(queues[q]->mutex);
+			queues[q]->tasks.push_back({std::move(task), &group});
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		sleepCV.notify_one();
+	}
+
+	// Blocks until every task of the group has finished, running tasks (of any
+	// group) meanwhile. Safe to call from inside a task of the same pool.
+	void wait(TaskGroup &group) {
+		while(!group.done()) {
+			Task task;
+			if(findTask(currentPool == this ? currentWorker : -1, task)) {
+				runTask(task);
+			} else {
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				doneCV.wait_for(lock, std::chrono::milliseconds(1),
+								[&group]() { return group.done(); });
+			}
+		}
+	}
+
+	// Splits [begin, end) into chunks of grain iterations and waits for them.
+	template <class F>
+	void parallelFor(int begin, int end, int grain, F &&body) {
+		if(end <= begin) return;
+		grain = std::max(1, grain);
+		TaskGroup group;
+		for(int s = begin; s < end; s += grain) {
+			int e = std::min(end, s + grain);
+			submit(group, [&body, s, e]() {
+				for(int i = s; i < e; i++) body(i);
+			});
+		}
+		wait(group);
+	}
+
+	// Pool shared by the whole application, created on first use
+	static ThreadPool &global() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	struct Task {
+		std::function<void()> run;
+		TaskGroup *group = nullptr;
+	};
+
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> nextQueue{0};
+
+	std::mutex sleepMutex;
+	std::condition_variable sleepCV;
+	std::condition_variable doneCV;
+	bool stopping = false;
+
+	static inline thread_local ThreadPool *currentPool = nullptr;
+	static inline thread_local int currentWorker = -1;
+
+	bool popLocal(int self, Task &task) {
+		WorkQueue &q = *queues[self];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if(q.tasks.empty()) return false;
+		task = std::move(q.tasks.back());
+		q.tasks.pop_back();
+		return true;
+	}
+
+	bool steal(int victim, Task &task) {
+		WorkQueue &q = *queues[victim];
+		std::unique_lock<std::mutex> lock(q.mutex, std::try_to_lock);
+		if(!lock.owns_lock() || q.tasks.empty()) return false;
+		task = std::move(q.tasks.front());
+		q.tasks.pop_front();
+		return true;
+	}
+
+	bool findTask(int self, Task &task) {
+		if(self >= 0 && popLocal(self, task)) return true;
+		int n = static_cast<int>(queues.size());
+		int start = self >= 0 ? self + 1 : 0;
+		for(int i = 0; i < n; i++) {
+			int victim = (start + i) % n;
+			if(victim != self && steal(victim, task)) return true;
+		}
+		return false;
+	}
+
+	void runTask(Task &task) {
+		task.run();
+		if(--task.group->pending == 0) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			doneCV.notify_all();
+		}
+	}
+
+	void workerLoop(int self) {
+		currentPool = this;
+		currentWorker = self;
+		while(true) {
+			Task task;
+			if(findTask(self, task)) {
+				runTask(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			if(stopping) break;
+			// a short timeout covers steals that failed on a contended try_lock
+			sleepCV.wait_for(lock, std::chrono::milliseconds(2));
+			if(stopping) break;
+		}
+	}
+};
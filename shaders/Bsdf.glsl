@@ -0,0 +1,121 @@
+// Riflessione dei materiali non dielettrici, stessi calcoli di modules/Bsdf.hpp.
+//
+// smoothness 0 è una superficie lambertiana, campionata con direzioni distribuite come il coseno attorno alla normale.
+// Valori maggiori sono un lobo microfacet GGX (Walter et al. 2007) con alpha = (1 - smoothness)^2, campionato dalla
+// distribuzione dei vettori half, e smoothness 1 è uno specchio perfetto. La riflettanza è il colore del materiale
+// (senza termine di Fresnel), moltiplicato dal chiamante come prima.
+// Ogni campione restituisce la sua pdf rispetto all'angolo solido ed evalBsdf() dà valore e pdf di una direzione qualsiasi,
+// così la luce diretta può pesare le due strategie con MIS.
+// Va incluso da RayCommon.glsl, dopo la definizione di PI.
+
+#define GGX_MIN_ALPHA 1e-3 // sotto questo valore il lobo è uno specchio
+
+struct BsdfSample {
+	vec3 direction; // normalizzata, uscente dalla superficie
+	float weight; // BSDF * coseno / pdf, senza il colore; 0 termina il cammino
+	float pdf; // rispetto all'angolo solido, 0 per lo specchio
+};
+
+// Base ortonormale (t, b, n) senza branch (Duff et al. 2017), n deve essere normalizzata
+void orthonormalBasis(vec3 n, out vec3 t, out vec3 b) {
+	float s = n.z >= 0.0 ? 1.0 : -1.0;
+	float a = -1.0 / (s + n.z);
+	float c = n.x * n.y * a;
+	t = vec3(1.0 + s * n.x * n.x * a, s * c, -s * n.x);
+	b = vec3(c, s + n.y * n.y * a, -n.y);
+}
+
+// direzione ad angolo acos(cosTheta) da n, ruotata di 2 * PI * u attorno ad n
+vec3 directionAround(vec3 n, float cosTheta, float u) {
+	float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+	float phi = 2.0 * PI * u;
+	vec3 t, b;
+	orthonormalBasis(n, t, b);
+	return sinTheta * (cos(phi) * t + sin(phi) * b) + cosTheta * n;
+}
+
+// direzione sull'emisfero di n con pdf = coseno / PI
+vec3 sampleCosineHemisphere(vec3 n, vec2 u) {
+	return directionAround(n, sqrt(1.0 - u.x), u.y);
+}
+
+float ggxAlpha(float smoothness) {
+	float roughness = 1.0 - smoothness;
+	return roughness * roughness;
+}
+
+float ggxDistribution(float cosH, float alpha) {
+	float a2 = alpha * alpha;
+	float d = cosH * cosH * (a2 - 1.0) + 1.0;
+	return a2 / (PI * d * d);
+}
+
+// mascheramento di Smith di una direzione
+float smithG1(float cosTheta, float alpha) {
+	float a2 = alpha * alpha;
+	return 2.0 * cosTheta / (cosTheta + sqrt(a2 + (1.0 - a2) * cosTheta * cosTheta));
+}
+
+// wo: normalizzata, dalla superficie verso chi osserva
+BsdfSample sampleBsdf(vec3 n, vec3 wo, float smoothness, vec2 u) {
+	BsdfSample s;
+	s.weight = 0.0;
+	s.pdf = 0.0;
+	if (smoothness <= 0.0) {
+		s.direction = sampleCosineHemisphere(n, u);
+		s.weight = 1.0;
+		s.pdf = dot(s.direction, n) / PI;
+		return s;
+	}
+	float alpha = ggxAlpha(smoothness);
+	if (alpha < GGX_MIN_ALPHA) {
+		s.direction = reflect(-wo, n);
+		s.weight = 1.0;
+		return s;
+	}
+
+	// vettore half con densità D(h) * cosH, la riflessione la trasforma in pdf / (4 * dot(wo, h))
+	float a2 = alpha * alpha;
+	vec3 h = directionAround(n, sqrt((1.0 - u.x) / (1.0 + (a2 - 1.0) * u.x)), u.y);
+	s.direction = reflect(-wo, h);
+	float cosI = dot(n, s.direction);
+	float cosO = dot(n, wo);
+	float cosH = dot(n, h);
+	float cosOH = dot(wo, h);
+	if (cosI <= 0.0 || cosO <= 0.0 || cosOH <= 0.0) {
+		return s; // sotto la superficie: assorbito
+	}
+	s.weight = smithG1(cosO, alpha) * smithG1(cosI, alpha) * cosOH / (cosO * cosH);
+	s.pdf = ggxDistribution(cosH, alpha) * cosH / (4.0 * cosOH);
+	return s;
+}
+
+// BSDF (senza il colore) per la luce che arriva da wi e pdf con cui sampleBsdf() la genera.
+// Entrambe sono 0 per lo specchio, che una luce campionata non può raggiungere.
+float evalBsdf(vec3 n, vec3 wo, vec3 wi, float smoothness, out float pdf) {
+	pdf = 0.0;
+	float cosI = dot(n, wi);
+	if (cosI <= 0.0) {
+		return 0.0;
+	}
+	if (smoothness <= 0.0) {
+		pdf = cosI / PI;
+		return 1.0 / PI;
+	}
+	float alpha = ggxAlpha(smoothness);
+	float cosO = dot(n, wo);
+	if (alpha < GGX_MIN_ALPHA || cosO <= 0.0) {
+		return 0.0;
+	}
+	vec3 h = normalize(wo + wi);
+	float cosH = dot(n, h);
+	float cosOH = dot(wo, h);
+	float d = ggxDistribution(cosH, alpha);
+	pdf = d * cosH / (4.0 * cosOH);
+	return d * smithG1(cosO, alpha) * smithG1(cosI, alpha) / (4.0 * cosO * cosI);
+}
+
+// se la luce diretta può raggiungere il lobo
+bool samplesLights(float smoothness) {
+	return ggxAlpha(smoothness) >= GGX_MIN_ALPHA;
+}
@@ -0,0 +1,833 @@
+// Codice comune al path tracer in fragment shader (RayShader.frag) e in compute shader (RayShader.comp):
+// descrittori, scena, intersezioni, materiali e accumulo progressivo.
+// Va incluso dopo #version e #extension GL_GOOGLE_include_directive
+
+#define NULL -1
+#define SPHERE 0
+#define PLANE 1
+
+#define TRIANGLE_BIT 0x80000000u // primRefs che si riferiscono a triangles[] e non a geometries[]
+
+#define PI 3.1415926
+
+// Costanti di specializzazione: ogni modalità di rendering (interattiva, anteprima, finale) è una variante della pipeline
+// creata da main.cpp con i suoi valori, così il compilatore del driver può srotolare i cicli e semplificare le espressioni
+layout(constant_id = 0) const int MAX_DEPTH = 5; // rimbalzi massimi di un cammino
+layout(constant_id = 1) const int RAYS_PER_PIXEL = 1; // campioni di ogni pixel tracciati in un frame
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	int numberOfSamples;
+	float convergenceThreshold; // errore relativo della media sotto cui un pixel smette di campionare, 0 = disattivato
+	int minSamples; // campioni minimi prima di valutare la convergenza
+	int reproject; // la camera si è mossa: l'accumulo del frame precedente va riproiettato nei pixel di questo
+	int maxHistory; // campioni massimi della storia riproiettata, i più vecchi pesano sempre meno
+	int rouletteDepth; // dal rimbalzo rouletteDepth i cammini possono essere terminati dalla roulette russa (>= MAX_DEPTH = mai)
+	int samplerType; // SAMPLER_SOBOL o SAMPLER_PCG, vedi Sampler.glsl
+} gubo;
+	
+// Due coppie di layer usate a ping-pong: il frame con numberOfSamples = N scrive i layer N % 2 e 2 + N % 2 e legge gli altri.
+// layer 0-1: rgb = somma dei campioni, a = numero di campioni (in float a 32 bit, senza perdita di precisione)
+// layer 2-3: r = somma dei quadrati della luminanza dei campioni, per la varianza del campionamento adattivo
+layout(set = 0, binding = 1, rgba32f) uniform image2DArray accumulation;
+
+// AOV per il denoiser e la riproiezione, medie sui campioni del primo punto colpito dal raggio della camera
+// (0 se non colpisce nulla). Ping-pong come accumulation: il frame con numberOfSamples = N scrive i layer 2 * (N % 2) e 2 * (N % 2) + 1.
+// layer 2k: rgb = albedo (colore di emissione per le luci), a = distanza dalla camera
+// layer 2k + 1: xyz = normale
+layout(set = 0, binding = 3, rgba32f) uniform image2DArray features;
+
+layout(set = 1, binding = 0) uniform UniformBufferObject {
+    vec3 cameraPos; // Posizione della camera
+    mat4 invViewMatrix; // Matrice di vista inversa
+    mat4 invProjectionMatrix; // Matrice di proiezione inversa
+	int currBox;
+	int firstObject; // intervallo del box corrente nel buffer delle geometrie
+	int objectCount;
+	int rootNode; // radice della BVH del box corrente, -1 se non c'è
+	int firstTriangle; // intervallo del box corrente nel buffer dei triangoli
+	int triangleCount;
+	int firstLight; // intervallo delle luci del box corrente in lights[]
+	int lightCount; // 0 = nessun campionamento diretto delle luci
+	mat4 prevViewProjMatrix; // camera del frame precedente, per la riproiezione
+	vec3 prevCameraPos;
+} ubo;
+
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+};
+
+/* struct per i materiali
+    - color: colore associato all'oggetto
+	- emissionColor: se è una luce = bianco, altrimenti = nero (nel caso di luce metti color = nero)
+	- emissionStrength: potenza associata alla luce [0,1]
+	- smoothness: indice per gli specchi, 0 è un diffuse material, valori maggiori un lobo glossy GGX sempre più stretto (vedi Bsdf.glsl), 1 uno specchio [0,1] 
+	- dieletricConstant: indice per i materiali dieletrici, se = 0 allora il materiale non è dieletrico, se > 1 allora questo è il suo indice 
+	
+Esempi di materiali
+	- SPECCHIO: colore = bianco, smoothness > 0.0 (= 1.0 specchio perfettamente riflettente)
+	- NON SPECCHIO: smoothness = 0.0
+	- DIELETTRICO: dieletricConstant > 1.0, smoothness > 0.0 (perchè questo valore serve per decidere se il raggio incidente viene riflesso o rifratto)
+	- NON DIELETTRICO: dieletricConstant < 1.0
+	- DIFFUSE: colore = qualsiasi, emissionStrength = 0.0, emissionColor = nero
+	- LUCE: colore = qualisasi, emissionStrength > 0.0, emissionColor != nero
+*/
+struct RayTracingMaterial{
+	vec4 color; 
+	vec4 emissionColor; 
+	float emissionStrength; 
+	float smoothness; 
+	float dieletricConstant;
+	float pad;
+};
+
+struct GeometryHit{ // questa struttura dati contiene le informazioni dell'oggetto che abbiamo colpito col raggio
+	bool isHit;
+	vec3 position;
+	vec3 normal;
+	int materialIndex; // indice del materiale nella tabella dei materiali
+	bool frontFace; //serve per la rifrazione se sto colpendo la faccia interna o esterna di un oggetto
+	int geometry; // indice in geometries[], NULL per i triangoli
+};
+
+/* struct per le geometrie
+Non tutti i componenti sono necessari per ogni elemento. Se non sono necessari basta settarli a 0 o a un qualsiasi altro valore
+	SFERA
+		- type = SPHERE
+		- settare center e radius
+	PIANO
+		- type = PLANE
+		- settare point e normal 
+	se il piano è infinito, allora tutti gli altri parametri possono essere settati come vec3(0.0) o 0.0
+	se il piano è finito
+		- normal: deve essere uno dei tre assi, quindi vec3(1.0, 0.0, 0.0) o vec3(0.0, 1.0, 0.0) o vec3(0.0, 0.0, 1.0)
+		- vWidth e VHeight: direzioni dei lati del rettangolo (gli altri due assi non scelti dalla normale)
+		- width e height: lunghezze dei lati del rettangolo
+	(ovviamente puoi anche selezionare gli assi con valori negativi (-1.0,0.0,0.0) per invertire le direzioni)
+*/
+struct Geometry { // layout std430, deve corrispondere a RayGeometry in modules/RayScene.hpp
+	//caratteristiche comuni a tutti
+    int type; //SPHERE o PLANE
+	int materialIndex; //indice nella tabella dei materiali
+	
+	// Solo per piani
+	float width;  //se il piano è infinito settare width & height = 0.0
+	float height;
+
+	// Solo per sfere: xyz = centro, w = raggio
+    vec4 center;   
+	
+	// Solo per piani
+    vec4 point;   
+    vec4 normal;
+	vec4 vWidth;
+	vec4 vHeight;
+
+	int sampledLight; // 1 se è in lights[], solo queste luci vengono pesate con MIS
+	int pad0;
+	int pad1;
+	int pad2;
+};
+
+// La scena viene caricata una volta sola dall'applicazione (RayScene::cornellBoxes())
+layout(std430, set = 1, binding = 1) readonly buffer MaterialBuffer {
+	RayTracingMaterial materials[];
+};
+
+layout(std430, set = 1, binding = 2) readonly buffer GeometryBuffer {
+	Geometry geometries[];
+};
+
+/* nodo della BVH (RayBVH.hpp), 32 byte
+	- primInfo: numero di primitive << 24 | prima primitiva in primRefs, numero = 0 per i nodi interni
+	- missIndex: nodo successivo quando il sottoalbero viene saltato o finito, -1 alla fine
+Il figlio sinistro di un nodo interno è sempre il nodo successivo, quindi non serve uno stack
+*/
+struct BVHNode {
+	vec3 bmin;
+	uint primInfo;
+	vec3 bmax;
+	int missIndex;
+};
+
+layout(std430, set = 1, binding = 3) readonly buffer BVHNodeBuffer {
+	BVHNode nodes[];
+};
+
+// indice nel buffer delle geometrie delle primitive delle foglie, oppure TRIANGLE_BIT | indice del triangolo
+layout(std430, set = 1, binding = 4) readonly buffer PrimRefBuffer {
+	uint primRefs[];
+};
+
+// Mesh (ad esempio models/Sphere.obj) già trasformate nello spazio del mondo da RayScene::addMesh()
+// stessa coppia posizione/normale dei vertici del raster, senza padding
+struct MeshVertex {
+	float px, py, pz;
+	float nx, ny, nz;
+};
+
+struct Triangle {
+	uint v0, v1, v2; // indici in meshVertices
+	int materialIndex;
+};
+
+layout(std430, set = 1, binding = 5) readonly buffer MeshVertexBuffer {
+	MeshVertex meshVertices[];
+};
+
+layout(std430, set = 1, binding = 6) readonly buffer TriangleBuffer {
+	Triangle triangles[];
+};
+
+// indici in geometries[] delle luci (sfere e rettangoli emissivi) di tutti i box, campionate direttamente
+layout(std430, set = 1, binding = 7) readonly buffer LightBuffer {
+	uint lights[];
+};
+
+#include "Sampler.glsl"
+#include "Bsdf.glsl"
+
+// Genera un punto casuale sul cerchio di raggio 1, usato per il jittering
+// Non facciamo partire il prossimo raggio dal punto di hit, ma da un punto nel suo intorno
+vec2 RandomPointInCircle(vec2 u){
+	float angle = u.x * 2 * 3.1415926; //otteniamo un angolo randomico della sfera
+	vec2 pointOnCircle = vec2(cos(angle), sin(angle)); //trasformiamo l'angolo in coordinate 2D
+	return pointOnCircle * sqrt(u.y); //otteniamo un punto qualsiasi lungo il raggio che collega il centro al punto 2D
+}
+
+// ------------------- RAY INTERSECTION METHODS --------------------- 
+
+
+// Funzione per calcolare l'intersezione tra un raggio e una sfera
+bool intersectSphere(Ray ray, int g, out GeometryHit hit) {
+	vec3 center = geometries[g].center.xyz;
+	float radius = geometries[g].center.w;
+    vec3 oc = ray.origin - center; // distanza tra i due centri
+	
+    // coefficienti della formula quadratica per l'intersezione di un raggio con una sfera
+    float a = dot(ray.direction, ray.direction); // a = 1
+    float b = 2.0 * dot(oc, ray.direction);
+    float c = dot(oc, oc) - radius * radius;
+    float discriminant = b * b - 4.0 * a * c;
+
+    if (discriminant > 0.0) {
+		float t0 = (-b - sqrt(discriminant)) / (2.0 * a);
+        float t1 = (-b + sqrt(discriminant)) / (2.0 * a);
+		
+		float dst = -1.0; // prendi sempre la più piccola positiva
+        if (t0 > 0.0) {
+            dst = t0;
+        }
+        if (t1 > 0.0 && (dst < 0.0 || t1 < dst)) {
+            dst = t1;
+        }
+        
+
+        if (dst > 0.0) {
+            hit.position = ray.origin + dst * ray.direction;
+			hit.normal = normalize(hit.position - center);
+			hit.materialIndex = geometries[g].materialIndex;
+			hit.isHit = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void calculateRectangleVertices(int g, out vec3 A, out vec3 B, out vec3 C) { 
+    A = geometries[g].point.xyz; // bottom-left
+    B = A + geometries[g].width * geometries[g].vWidth.xyz; // bottom-right
+	C = A + geometries[g].height * geometries[g].vHeight.xyz; // top-left
+}
+
+// Funzione per intersezione del raggio con un piano infinito o finito
+bool intersectPlane(Ray ray, int g, out GeometryHit hit) {
+	vec3 normal = geometries[g].normal.xyz;
+    float denom = dot(normal, ray.direction); 
+
+    if (abs(denom) < 0.0001f) { //verifichiamo che il raggio non sia parallelo al piano
+        return false; 
+    }
+
+    vec3 rayPlane = geometries[g].point.xyz - ray.origin; // Vettore dal punto del raggio al punto del piano
+    float t = dot(rayPlane, normal) / denom; // distanza
+  
+    if (t < 0) { // Se t è negativo, l'intersezione è dietro il raggio
+        return false; 
+    }
+	
+	vec3 hitPosition = ray.origin + t * ray.direction; 
+	
+	if(geometries[g].width > 0.1 || geometries[g].height > 0.1){ //piano non infinito	
+		vec3 A, B, C;
+		calculateRectangleVertices(g, A, B, C);
+		
+		vec3 AB = B - A;
+		vec3 AC = C - A;
+		vec3 AM = hitPosition - A; //M è l'hitpoint
+		
+		float AMx = dot(AM, normalize(AB));
+        float AMy = dot(AM, normalize(AC));
+        float lengthAB = length(AB);
+        float lengthAC = length(AC);
+		
+		if(AMx >= 0.0 && AMy >= 0.0 && AMx <= lengthAB && AMy <= lengthAC){
+			hit.position = hitPosition;
+			hit.normal = normal;
+			hit.materialIndex = geometries[g].materialIndex;
+			hit.isHit = true;
+			return true;
+		}
+		
+		return false;
+	}
+
+	hit.position = hitPosition;
+	hit.normal = normal;
+	hit.materialIndex = geometries[g].materialIndex;
+	hit.isHit = true;
+	return true;
+}
+
+vec3 vertexPosition(uint v) {
+	return vec3(meshVertices[v].px, meshVertices[v].py, meshVertices[v].pz);
+}
+
+vec3 vertexNormal(uint v) {
+	return vec3(meshVertices[v].nx, meshVertices[v].ny, meshVertices[v].nz);
+}
+
+// Intersezione raggio/triangolo watertight (Woop, Benthin, Wald 2013): i vertici vengono
+// trasformati nello spazio del raggio, così i lati in comune tra due triangoli vengono
+// calcolati allo stesso modo da entrambi e nessun raggio passa tra i due
+bool intersectTriangle(Ray ray, int tri, inout GeometryHit hit) {
+	vec3 absDir = abs(ray.direction);
+	int kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+	int kx = (kz + 1) % 3;
+	int ky = (kx + 1) % 3;
+	if (ray.direction[kz] < 0.0) {
+		int tmp = kx;
+		kx = ky;
+		ky = tmp;
+	}
+	float Sx = ray.direction[kx] / ray.direction[kz];
+	float Sy = ray.direction[ky] / ray.direction[kz];
+	float Sz = 1.0 / ray.direction[kz];
+
+	Triangle T = triangles[tri];
+	vec3 A = vertexPosition(T.v0) - ray.origin;
+	vec3 B = vertexPosition(T.v1) - ray.origin;
+	vec3 C = vertexPosition(T.v2) - ray.origin;
+
+	float Ax = A[kx] - Sx * A[kz];
+	float Ay = A[ky] - Sy * A[kz];
+	float Bx = B[kx] - Sx * B[kz];
+	float By = B[ky] - Sy * B[kz];
+	float Cx = C[kx] - Sx * C[kz];
+	float Cy = C[ky] - Sy * C[kz];
+
+	// coordinate baricentriche non normalizzate
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+	if ((U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0)) {
+		return false;
+	}
+	float det = U + V + W;
+	if (det == 0.0) {
+		return false;
+	}
+
+	float t = (U * Sz * A[kz] + V * Sz * B[kz] + W * Sz * C[kz]) / det;
+	if (t <= 0.0) {
+		return false;
+	}
+
+	hit.position = ray.origin + t * ray.direction;
+	hit.normal = normalize((U * vertexNormal(T.v0) + V * vertexNormal(T.v1) + W * vertexNormal(T.v2)) / det);
+	hit.materialIndex = T.materialIndex;
+	hit.isHit = true;
+	return true;
+}
+
+// Scegliamo il metodo di calcolo dell'intersezione sulla base della tipologia di geometria
+bool intersectGeometry(Ray ray, int g, inout GeometryHit hit) {
+    if (geometries[g].type == SPHERE) {
+        return intersectSphere(ray, g, hit);
+    } else if (geometries[g].type == PLANE) {
+        return intersectPlane(ray, g, hit);
+    }
+    return false; 
+}
+
+// Slab test, restituisce la distanza di entrata lungo il raggio o -1 se il box non viene colpito
+float intersectAABB(Ray ray, vec3 invDir, int n) {
+	vec3 t0 = (nodes[n].bmin - ray.origin) * invDir;
+	vec3 t1 = (nodes[n].bmax - ray.origin) * invDir;
+	vec3 tmin = min(t0, t1);
+	vec3 tmax = max(t0, t1);
+	float tnear = max(max(tmin.x, tmin.y), max(tmin.z, 0.0));
+	float tfar = min(min(tmax.x, tmax.y), tmax.z);
+	return tnear <= tfar ? tnear : -1.0;
+}
+
+void keepClosest(Ray ray, GeometryHit hit, inout GeometryHit closestHit, inout float closestDist) {
+	float dist = length(hit.position - ray.origin);
+	if (dist < closestDist) {
+		closestDist = dist;
+		closestHit = hit;
+		closestHit.frontFace = dot(ray.direction, hit.normal) < 0; //capire se sto colpendo la faccia esterna o interna
+		closestHit.normal = closestHit.frontFace ? closestHit.normal : - closestHit.normal; //eventualmente inverti la normale se sei all'interno del materiale
+	}
+}
+
+void testPrimitive(Ray ray, uint ref, inout GeometryHit closestHit, inout float closestDist) {
+	GeometryHit hit;
+	if ((ref & TRIANGLE_BIT) != 0u) {
+		if (intersectTriangle(ray, int(ref & ~TRIANGLE_BIT), hit)) {
+			hit.geometry = NULL;
+			keepClosest(ray, hit, closestHit, closestDist);
+		}
+	} else if (geometries[ref].type != NULL && intersectGeometry(ray, int(ref), hit)) {
+		hit.geometry = int(ref);
+		keepClosest(ray, hit, closestHit, closestDist);
+	}
+}
+
+// troviamo l'oggetto più vicino che viene intersecato, visitando la BVH del box senza stack
+GeometryHit traceClosest(Ray ray) {
+	GeometryHit closestHit;
+	closestHit.isHit = false;
+	float closestDist = 1e20;
+
+	if (ubo.rootNode < 0) {
+		for (int i = ubo.firstTriangle; i < ubo.firstTriangle + ubo.triangleCount; i++) {
+			testPrimitive(ray, TRIANGLE_BIT | uint(i), closestHit, closestDist);
+		}
+		for (int i = ubo.firstObject; i < ubo.firstObject + ubo.objectCount; i++) {
+			testPrimitive(ray, uint(i), closestHit, closestDist);
+		}
+		return closestHit;
+	}
+
+	// la direzione non è sempre normalizzata, le distanze vengono confrontate in unità del mondo
+	vec3 invDir = 1.0 / ray.direction;
+	float dirLength = length(ray.direction);
+	int node = ubo.rootNode;
+	while (node >= 0) {
+		float tnear = intersectAABB(ray, invDir, node);
+		if (tnear >= 0.0 && tnear * dirLength < closestDist) {
+			uint count = nodes[node].primInfo >> 24;
+			if (count == 0u) { // nodo interno: scendiamo nel figlio sinistro
+				node++;
+				continue;
+			}
+			uint first = nodes[node].primInfo & 0xFFFFFFu;
+			for (uint i = first; i < first + count; i++) {
+				testPrimitive(ray, primRefs[i], closestHit, closestDist);
+			}
+		}
+		node = nodes[node].missIndex;
+	}
+	return closestHit;
+}
+
+// raggi d'ombra: true se qualcosa viene colpito prima di maxDist, ci si ferma alla prima intersezione
+bool occluded(Ray ray, float maxDist) {
+	GeometryHit closestHit;
+	closestHit.isHit = false;
+	float closestDist = maxDist;
+
+	if (ubo.rootNode < 0) {
+		for (int i = ubo.firstTriangle; i < ubo.firstTriangle + ubo.triangleCount; i++) {
+			testPrimitive(ray, TRIANGLE_BIT | uint(i), closestHit, closestDist);
+			if (closestHit.isHit) return true;
+		}
+		for (int i = ubo.firstObject; i < ubo.firstObject + ubo.objectCount; i++) {
+			testPrimitive(ray, uint(i), closestHit, closestDist);
+			if (closestHit.isHit) return true;
+		}
+		return false;
+	}
+
+	vec3 invDir = 1.0 / ray.direction;
+	float dirLength = length(ray.direction);
+	int node = ubo.rootNode;
+	while (node >= 0) {
+		float tnear = intersectAABB(ray, invDir, node);
+		if (tnear >= 0.0 && tnear * dirLength < closestDist) {
+			uint count = nodes[node].primInfo >> 24;
+			if (count == 0u) {
+				node++;
+				continue;
+			}
+			uint first = nodes[node].primInfo & 0xFFFFFFu;
+			for (uint i = first; i < first + count; i++) {
+				testPrimitive(ray, primRefs[i], closestHit, closestDist);
+				if (closestHit.isHit) return true;
+			}
+		}
+		node = nodes[node].missIndex;
+	}
+	return false;
+}
+
+//------------------ NEXT EVENT ESTIMATION --------------------
+
+struct LightSample {
+	vec3 direction; // normalizzata, dal punto verso la luce
+	float dist; // distanza del punto campionato sulla luce
+	float pdf; // rispetto all'angolo solido, 0 se il campione non è valido
+};
+
+// Sfere: direzione uniforme nel cono sotteso dalla sfera (angolo solido)
+// Rettangoli: punto uniforme sull'area, convertito in angolo solido con dist^2 / (area * cos)
+LightSample sampleLight(int g, vec3 x, vec2 u) {
+	LightSample s;
+	s.pdf = 0.0;
+	float u1 = u.x;
+	float u2 = u.y;
+
+	if (geometries[g].type == SPHERE) {
+		vec3 toCenter = geometries[g].center.xyz - x;
+		float r = geometries[g].center.w;
+		float d2 = dot(toCenter, toCenter);
+		if (d2 <= r * r) {
+			return s;
+		}
+		float cosMax = sqrt(max(0.0, 1.0 - r * r / d2));
+		float cosTheta = 1.0 - u1 * (1.0 - cosMax);
+		float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+		float phi = 2.0 * PI * u2;
+
+		vec3 w = toCenter / sqrt(d2);
+		vec3 t, b;
+		orthonormalBasis(w, t, b);
+		s.direction = normalize(cosTheta * w + sinTheta * (cos(phi) * t + sin(phi) * b));
+		float proj = dot(toCenter, s.direction); // distanza dalla superficie vicina lungo la direzione
+		s.dist = proj - sqrt(max(0.0, r * r - (d2 - proj * proj)));
+		s.pdf = 1.0 / (2.0 * PI * (1.0 - cosMax));
+	} else {
+		vec3 A, B, C;
+		calculateRectangleVertices(g, A, B, C);
+		vec3 toLight = A + u1 * (B - A) + u2 * (C - A) - x;
+		float d2 = dot(toLight, toLight);
+		s.dist = sqrt(d2);
+		s.direction = toLight / s.dist;
+		float cosLight = abs(dot(geometries[g].normal.xyz, s.direction)); // le luci emettono da entrambe le facce
+		float area = geometries[g].width * geometries[g].height;
+		if (cosLight > 1e-4 && area > 0.0) {
+			s.pdf = d2 / (area * cosLight);
+		}
+	}
+	return s;
+}
+
+// pdf con cui sampleLight(g, x) genera la direzione da x verso il punto p della luce
+float lightPdf(int g, vec3 x, vec3 p) {
+	if (geometries[g].type == SPHERE) {
+		vec3 toCenter = geometries[g].center.xyz - x;
+		float r = geometries[g].center.w;
+		float d2 = dot(toCenter, toCenter);
+		if (d2 <= r * r) {
+			return 0.0;
+		}
+		float cosMax = sqrt(max(0.0, 1.0 - r * r / d2));
+		return 1.0 / (2.0 * PI * (1.0 - cosMax));
+	}
+	vec3 toLight = p - x;
+	float d2 = dot(toLight, toLight);
+	float cosLight = abs(dot(geometries[g].normal.xyz, toLight)) / sqrt(d2);
+	float area = geometries[g].width * geometries[g].height;
+	return (cosLight > 1e-4 && area > 0.0) ? d2 / (area * cosLight) : 0.0;
+}
+
+float powerHeuristic(float pdfA, float pdfB) {
+	return (pdfA * pdfA) / (pdfA * pdfA + pdfB * pdfB);
+}
+
+// Luce diretta in un punto diffuse o glossy visto da wo: una luce scelta a caso tra quelle del box,
+// un raggio d'ombra e il peso MIS rispetto al campionamento della BSDF
+vec3 sampleDirectLight(GeometryHit hit, vec3 albedo, float smoothness, vec3 wo, int bounce) {
+	int pick = min(int(sample1D(sampleDimension(bounce, SLOT_LIGHT_PICK)) * ubo.lightCount), ubo.lightCount - 1);
+	int g = int(lights[ubo.firstLight + pick]);
+	LightSample s = sampleLight(g, hit.position, sample2D(sampleDimension(bounce, SLOT_LIGHT)));
+	float pdfBsdf;
+	float bsdf = evalBsdf(hit.normal, wo, s.direction, smoothness, pdfBsdf);
+	if (s.pdf <= 0.0 || bsdf <= 0.0) {
+		return vec3(0.0);
+	}
+
+	Ray shadowRay;
+	shadowRay.origin = hit.position + s.direction * 0.001; //self intersection problem
+	shadowRay.direction = s.direction;
+	if (occluded(shadowRay, s.dist - 0.002)) {
+		return vec3(0.0);
+	}
+
+	RayTracingMaterial light = materials[geometries[g].materialIndex];
+	float pdfLight = s.pdf / float(ubo.lightCount);
+	float cosSurface = dot(hit.normal, s.direction);
+	return albedo * bsdf * light.emissionColor.rgb * light.emissionStrength * cosSurface / pdfLight * powerHeuristic(pdfLight, pdfBsdf);
+}
+
+//------------------ RIFLECTION & REFRACTION --------------------
+vec3 Myrefract(vec3 v, vec3 n, float eta) { //implementazione della legge di Snell per il riflesso dentro i vetri
+    float cosi = dot(v, n);
+    float k = 1.0 - eta * eta * (1.0 - cosi * cosi);
+    if (k < 0.0) {
+        return vec3(0.0); // Riflessione totale interna
+    } else {
+        return eta * v - (eta * cosi + sqrt(k)) * n;
+    }
+}
+
+float schlickApproximation(float cosTheta, float refrIndex){ //fa l'effetto di sfocatura dei punti più lontani degli oggetti riflessi sul vetro, a seconda del punto di vista (Fresnel effect)
+	// Approssimazione di Schlick per la riflettanza
+	float r0 = (1.0 - refrIndex) / (1.0 + refrIndex);
+	r0 = r0 * r0;
+	return r0 + (1.0 - r0) * pow((1.0 - cosTheta), 5.0);
+}
+
+
+//------------------ COLOR CALCULATION ---------------------
+// primo punto colpito dall'ultimo raggio tracciato, scritto da rayCasting per le AOV
+vec3 firstHitAlbedo;
+vec3 firstHitNormal;
+vec3 firstHitPosition;
+float firstHitDepth;
+
+vec4 rayCasting(Ray ray){
+	vec4 rayColor = vec4(0.0);
+	vec3 rayAttenuation = vec3(1.0);
+	firstHitAlbedo = vec3(0.0);
+	firstHitNormal = vec3(0.0);
+	firstHitPosition = vec3(0.0);
+	firstHitDepth = 0.0;
+
+	// rimbalzo precedente, per pesare con MIS le luci colpite dai raggi della BSDF
+	bool lastSampledLights = false; // la camera, gli specchi e i dielettrici non campionano le luci
+	float lastBsdfPdf = 0.0;
+	vec3 lastPosition = ray.origin;
+
+	for(int bounce = 0; bounce < MAX_DEPTH; bounce++){ // gestione della ricorsione
+		GeometryHit closestHit = traceClosest(ray);
+
+		if (closestHit.isHit) {
+			RayTracingMaterial material = materials[closestHit.materialIndex];
+			if (bounce == 0) {
+				firstHitAlbedo = material.emissionStrength > 0.0 ? material.emissionColor.rgb : material.color.rgb;
+				firstHitNormal = closestHit.normal;
+				firstHitPosition = closestHit.position;
+				firstHitDepth = length(closestHit.position - ray.origin);
+			}
+			if(material.emissionStrength > 0.0) { //se il raggio incontra un materiale che emette luce possiamo uscire dal ciclo
+				float weight = 1.0; // triangoli e piani troppo piccoli non sono in lights[], non vengono mai campionati direttamente
+				if (lastSampledLights && ubo.lightCount > 0 && closestHit.geometry != NULL &&
+					geometries[closestHit.geometry].sampledLight != 0) {
+					float pdfLight = lightPdf(closestHit.geometry, lastPosition, closestHit.position) / float(ubo.lightCount);
+					weight = powerHeuristic(lastBsdfPdf, pdfLight);
+				}
+				rayColor += vec4(rayAttenuation * material.emissionColor.rgb * material.emissionStrength * weight, 1.0);
+				break;
+			}
+
+			float refrIndex = material.dieletricConstant;
+			bool sampledLights = refrIndex <= 1.0 && samplesLights(material.smoothness);
+			vec3 wo = -normalize(ray.direction);
+
+			// non all'ultimo rimbalzo: i cammini finiscono lì, la luce diretta aggiungerebbe un rimbalzo in più
+			if (sampledLights && ubo.lightCount > 0 && bounce < MAX_DEPTH - 1) {
+				rayColor += vec4(rayAttenuation * sampleDirectLight(closestHit, material.color.rgb, material.smoothness, wo, bounce), 0.0);
+			}
+
+			float lobeWeight = 1.0;
+			float bsdfPdf = 0.0;
+
+			if (refrIndex > 1.0) { //materiale dielettrico (vetro)				
+				float ri = closestHit.frontFace ? (1.0 / refrIndex) : refrIndex; //se sto colpendo la faccia esterna allora sto passando da vuoto 1.0 a materiale refrIndex, altrimenti da materiale a vuoto
+				
+				vec3 normalRayDir = normalize(ray.direction);
+				float cosTheta = min(dot(-normalRayDir, closestHit.normal), 1.0);
+				float sinTheta = sqrt(1.0 - cosTheta * cosTheta); //sin^2 + cos^2 = 1
+				
+				if(ri * sinTheta > 1.0 || schlickApproximation(cosTheta, ri) > sample1D(sampleDimension(bounce, SLOT_LOBE))){ //riflessione totale, totalmente fuori dall'oggetto, dipende dall'angolo di incidenza
+					ray.direction = reflect(normalRayDir, closestHit.normal);
+				}
+				else{ //possibile rifrazione all'interno dell'oggetto
+					ray.direction = Myrefract(normalRayDir, closestHit.normal, ri);
+				}
+			}
+			else{ //diffuse, glossy o specchio, vedi Bsdf.glsl
+				BsdfSample s = sampleBsdf(closestHit.normal, wo, material.smoothness, sample2D(sampleDimension(bounce, SLOT_BSDF)));
+				if (s.weight <= 0.0) {
+					break;
+				}
+				ray.direction = s.direction;
+				lobeWeight = s.weight;
+				bsdfPdf = s.pdf;
+			}
+
+			lastSampledLights = sampledLights;
+			lastBsdfPdf = bsdfPdf;
+			lastPosition = closestHit.position;
+
+			ray.origin = closestHit.position + ray.direction * 0.001; //self intersection problem	
+			rayAttenuation *= material.color.rgb * lobeWeight;				
+
+			// roulette russa: il cammino continua con probabilità pari alla sua attenuazione (massimo 0.95)
+			// e chi sopravvive viene diviso per quella probabilità, così la media resta la stessa
+			if (bounce + 1 >= gubo.rouletteDepth && bounce + 1 < MAX_DEPTH) {
+				float survival = min(max(rayAttenuation.r, max(rayAttenuation.g, rayAttenuation.b)), 0.95);
+				if (sample1D(sampleDimension(bounce, SLOT_ROULETTE)) >= survival) {
+					break;
+				}
+				rayAttenuation /= survival;
+			}
+		} else {
+			break;
+		}
+	}
+
+	return rayColor;
+}
+
+
+vec3 UVtoRayDirection(vec2 uv){
+	vec2 ndc = uv * 2.0 - 1.0; // Convertiamo le coordinate UV in coordinate NDC (Normalized Device Coordinates), passiamo da un sistema [0,1] a [-1,1]
+    vec4 clipCoords = vec4(ndc, -1.0, 1.0); // Creiamo un punto nello spazio partendo dalle coordinate di prima, con z = -1
+    vec4 viewCoords = ubo.invProjectionMatrix * clipCoords; // Convertiamo le coordinate della clip in coordinate dello spazio della vista
+    vec3 rayDirection = normalize(viewCoords.xyz);  // Normalizziamo le coordinate
+    return normalize(vec3(ubo.invViewMatrix * vec4(rayDirection, 0.0))); // Trasformiamo la direzione del raggio nello spazio del mondo
+}
+
+// Traccia il campione numero index del pixel con coordinate uv, pixelCoords è usato solo per il seed
+vec3 tracePixel(vec2 uv, uvec2 pixelCoords, uint index) {
+	// Inizializzo seed randomici: il campione numero index della sequenza del pixel
+	initSampler(pixelCoords, index);
+
+	// Creiamo il raggio
+	Ray ray;
+	ray.origin = ubo.cameraPos;
+	vec2 jitter = RandomPointInCircle(sample2D(0u)) * 0.001;
+	ray.direction = UVtoRayDirection(uv + jitter);
+	return rayCasting(ray).rgb;
+}
+
+float luminance(vec3 c) {
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// un pixel è converso quando l'errore standard della sua luminanza media è sotto la soglia, relativa alla media
+bool isConverged(vec4 sum, float sumSquares) {
+	if (gubo.convergenceThreshold <= 0.0 || sum.a < float(max(gubo.minSamples, 2))) {
+		return false;
+	}
+	float n = sum.a;
+	float mean = luminance(sum.rgb) / n;
+	float variance = max(sumSquares - n * mean * mean, 0.0) / (n - 1.0);
+	return sqrt(variance / n) <= gubo.convergenceThreshold * max(mean, 1e-3);
+}
+
+// Accumulo del frame precedente riproiettato nel pixel, dopo un movimento della camera: il primo punto colpito
+// viene proiettato con la camera del frame precedente e la storia è interpolata tra i 4 pixel più vicini,
+// scartando quelli in cui quel punto non era visibile (profondità o normale diverse: disocclusione).
+// Se nessuno è valido la storia resta vuota e il pixel riparte da un campione.
+void reprojectHistory(out vec4 sum, out float sumSquares) {
+	sum = vec4(0.0);
+	sumSquares = 0.0;
+	if (firstHitDepth <= 0.0) {
+		return; // il raggio non ha colpito nulla
+	}
+	vec4 clip = ubo.prevViewProjMatrix * vec4(firstHitPosition, 1.0);
+	if (clip.w <= 0.0) {
+		return; // dietro la camera precedente
+	}
+
+	ivec2 size = imageSize(accumulation).xy;
+	vec2 prevPixel = (clip.xy / clip.w * 0.5 + 0.5) * vec2(size) - 0.5; // centri dei pixel sugli interi
+	ivec2 base = ivec2(floor(prevPixel));
+	vec2 f = prevPixel - vec2(base);
+	float expectedDepth = length(firstHitPosition - ubo.prevCameraPos);
+	int readLayer = 1 - (gubo.numberOfSamples & 1);
+
+	float weightSum = 0.0;
+	for (int k = 0; k < 4; k++) {
+		ivec2 q = base + ivec2(k & 1, k >> 1);
+		if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+		float prevDepth = imageLoad(features, ivec3(q, 2 * readLayer)).a;
+		vec3 prevNormal = imageLoad(features, ivec3(q, 2 * readLayer + 1)).xyz;
+		if (abs(prevDepth - expectedDepth) > 0.05 * expectedDepth || dot(prevNormal, firstHitNormal) < 0.9 * length(prevNormal)) continue;
+
+		float w = ((k & 1) != 0 ? f.x : 1.0 - f.x) * ((k >> 1) != 0 ? f.y : 1.0 - f.y);
+		sum += w * imageLoad(accumulation, ivec3(q, readLayer));
+		sumSquares += w * imageLoad(accumulation, ivec3(q, 2 + readLayer)).r;
+		weightSum += w;
+	}
+	if (weightSum < 1e-3) {
+		sum = vec4(0.0);
+		sumSquares = 0.0;
+		return;
+	}
+	sum /= weightSum;
+	sumSquares /= weightSum;
+
+	// storia lunga al massimo maxHistory campioni: il nuovo campione pesa almeno 1 / (maxHistory + 1)
+	if (sum.a > float(gubo.maxHistory)) {
+		float scale = float(gubo.maxHistory) / sum.a;
+		sum *= scale;
+		sumSquares *= scale;
+	}
+}
+
+// media progressiva: sommiamo un nuovo campione all'accumulo del frame precedente e restituiamo la media.
+// I pixel già conversi non tracciano raggi, copiano solo l'accumulo nei layer di questo frame
+vec3 renderPixel(vec2 uv, ivec2 pixel) {
+	int writeLayer = gubo.numberOfSamples & 1;
+	int readLayer = 1 - writeLayer;
+	bool reproject = gubo.numberOfSamples > 0 && gubo.reproject != 0;
+	vec4 sum = vec4(0.0f);
+	float sumSquares = 0.0;
+	if(gubo.numberOfSamples > 0 && !reproject){
+		sum = imageLoad(accumulation, ivec3(pixel, readLayer));
+		sumSquares = imageLoad(accumulation, ivec3(pixel, 2 + readLayer)).r;
+	}
+
+	// dopo un movimento tutti i pixel tracciano: la riproiezione ha bisogno del primo punto colpito
+	if (reproject || !isConverged(sum, sumSquares)) {
+		// RAYS_PER_PIXEL campioni consecutivi della sequenza del pixel
+		vec4 samples = vec4(0.0);
+		float samplesSquares = 0.0;
+		vec4 albedoDepth = vec4(0.0);
+		vec4 normal = vec4(0.0);
+		for (int i = 0; i < RAYS_PER_PIXEL; i++) {
+			vec3 radiance = tracePixel(uv, uvec2(pixel), uint(gubo.numberOfSamples * RAYS_PER_PIXEL + i));
+			float l = luminance(radiance);
+			samples += vec4(radiance, 1.0f);
+			samplesSquares += l * l;
+			albedoDepth += vec4(firstHitAlbedo, firstHitDepth);
+			normal += vec4(firstHitNormal, 0.0);
+		}
+		if (reproject) {
+			reprojectHistory(sum, sumSquares); // primo punto colpito dall'ultimo campione
+		}
+		sum += samples;
+		sumSquares += samplesSquares;
+
+		// media incrementale delle AOV: al primo frame e dopo una riproiezione riparte da questo
+		albedoDepth /= float(RAYS_PER_PIXEL);
+		normal /= float(RAYS_PER_PIXEL);
+		if (sum.a > samples.a && !reproject) {
+			albedoDepth = mix(imageLoad(features, ivec3(pixel, 2 * readLayer)), albedoDepth, samples.a / sum.a);
+			normal = mix(imageLoad(features, ivec3(pixel, 2 * readLayer + 1)), normal, samples.a / sum.a);
+		}
+		imageStore(features, ivec3(pixel, 2 * writeLayer), albedoDepth);
+		imageStore(features, ivec3(pixel, 2 * writeLayer + 1), normal);
+	} else {
+		imageStore(features, ivec3(pixel, 2 * writeLayer), imageLoad(features, ivec3(pixel, 2 * readLayer)));
+		imageStore(features, ivec3(pixel, 2 * writeLayer + 1), imageLoad(features, ivec3(pixel, 2 * readLayer + 1)));
+	}
+	imageStore(accumulation, ivec3(pixel, writeLayer), sum);
+	imageStore(accumulation, ivec3(pixel, 2 + writeLayer), vec4(sumSquares, 0.0, 0.0, 0.0));
+	return sum.rgb / sum.a;
+}
@@ -16,6 +16,15 @@ layout(set = 1, binding = 0) uniform UniformBufferObject {
 	mat4 inviewMatrix; // Matrice di vista inversa
 	mat4 invProjectionMatrix; // Matrice di proiezione inversa
 	int currBox;
+	int firstObject;
+	int objectCount;
+	int rootNode;
+	int firstTriangle;
+	int triangleCount;
+	int firstLight;
+	int lightCount;
+	mat4 prevViewProjMatrix;
+	vec3 prevCameraPos;
 } ubo;
 
 // Here the shader simply computes clipping coordinates, and passes to the Fragment Shader
@@ -0,0 +1,119 @@
+// Generatore dei numeri casuali del path tracer: sequenza di Sobol con scrambling di Owen (Burley 2020,
+// "Practical Hash-based Owen Scrambling") oppure PCG, scelto con gubo.samplerType.
+// Stessi calcoli di PixelSampler in modules/Sampler.hpp.
+//
+// Ogni campione di un pixel è un punto di una sequenza a bassa discrepanza: il campione numero index usa
+// le prime due dimensioni di Sobol dopo un mescolamento dell'indice, e ogni coppia di dimensioni richiesta
+// (jitter, BSDF, luce, ...) ha un seed diverso, così le coppie non sono correlate tra loro.
+// Il seed del pixel è un hash delle sue coordinate: nessuna correlazione tra pixel a qualsiasi risoluzione.
+// Va incluso da RayCommon.glsl, dopo la dichiarazione di gubo.
+
+#define SAMPLER_PCG 0
+#define SAMPLER_SOBOL 1
+
+// dimensioni usate da ogni rimbalzo, dopo la dimensione 0 del jitter del pixel
+#define SAMPLER_BOUNCE_DIMENSIONS 5
+#define SLOT_BSDF 0 // direzione del rimbalzo (2D)
+#define SLOT_LIGHT 1 // punto sulla luce (2D)
+#define SLOT_LIGHT_PICK 2 // scelta della luce (1D)
+#define SLOT_LOBE 3 // riflessione o rifrazione nei dielettrici (1D)
+#define SLOT_ROULETTE 4 // roulette russa (1D)
+
+// -------------------------- PCG -----------------------------
+uint randomState;
+
+// PCG (permuted congruential generator) www.pcg-random.org
+uint NextRandom(inout uint state) {
+	state = state * 747796405 + 2891336453;
+	uint result = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
+	result = (result >> 22) ^ result;
+	return result;
+}
+
+float RandomValue(inout uint state) {
+	return NextRandom(state) / 4294967295.0; // 2^32 - 1
+}
+
+// ------------------------- SOBOL ----------------------------
+uint samplerSeed; // hash delle coordinate del pixel
+uint samplerIndex; // numero del campione del pixel
+
+// hash a 32 bit con buona diffusione dei bit (lowbias32, C. Wellons)
+uint hashUint(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+uint hashCombine(uint seed, uint v) {
+	return seed ^ (hashUint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// permutazione di Laine-Karras migliorata da N. Vegdahl: ogni bit dipende solo da quelli meno significativi
+uint laineKarrasPermutation(uint x, uint seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// scrambling di Owen in base 2: ogni bit viene invertito in base a quelli più significativi
+uint nestedUniformScramble(uint x, uint seed) {
+	x = bitfieldReverse(x);
+	x = laineKarrasPermutation(x, seed);
+	return bitfieldReverse(x);
+}
+
+// seconda dimensione di Sobol, i numeri di direzione sono v[0] = 2^31, v[k+1] = v[k] ^ (v[k] >> 1)
+uint sobolSecondDimension(uint index) {
+	uint result = 0u;
+	uint v = 1u << 31;
+	for (; index != 0u; index >>= 1) {
+		if ((index & 1u) != 0u) {
+			result ^= v;
+		}
+		v ^= v >> 1;
+	}
+	return result;
+}
+
+// [0, 1) con i 24 bit più significativi, rappresentabili esattamente in un float
+float uintToUnit(uint x) {
+	return float(x >> 8) * (1.0 / 16777216.0);
+}
+
+void initSampler(uvec2 pixel, uint index) {
+	samplerSeed = hashUint(pixel.x ^ hashUint(pixel.y));
+	samplerIndex = index;
+	randomState = hashUint(samplerSeed ^ hashUint(index));
+}
+
+uint sampleDimension(int bounce, int slot) {
+	return 1u + uint(bounce) * SAMPLER_BOUNCE_DIMENSIONS + uint(slot);
+}
+
+vec2 sample2D(uint dimension) {
+	if (gubo.samplerType == SAMPLER_PCG) {
+		float u1 = RandomValue(randomState);
+		return vec2(u1, RandomValue(randomState));
+	}
+	uint seed = hashCombine(samplerSeed, dimension);
+	uint index = nestedUniformScramble(samplerIndex, seed);
+	uint x = nestedUniformScramble(bitfieldReverse(index), hashCombine(seed, 1u));
+	uint y = nestedUniformScramble(sobolSecondDimension(index), hashCombine(seed, 2u));
+	return vec2(uintToUnit(x), uintToUnit(y));
+}
+
+float sample1D(uint dimension) {
+	if (gubo.samplerType == SAMPLER_PCG) {
+		return RandomValue(randomState);
+	}
+	uint seed = hashCombine(samplerSeed, dimension);
+	uint index = nestedUniformScramble(samplerIndex, seed);
+	return uintToUnit(nestedUniformScramble(bitfieldReverse(index), hashCombine(seed, 1u)));
+}
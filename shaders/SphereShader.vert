@@ -0,0 +1,45 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// The attributes associated with each vertex.
+// Their type and location must match the definition given in the
+// corresponding Vertex Descriptor, and in turn, with the CPP data structure
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNorm;
+layout(location = 2) in vec2 inUV;
+
+// this defines the variable passed to the Fragment Shader
+// the locations must match the one of its in variables
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragUV;
+layout(location = 3) flat out int fragInstance;
+
+// Transform of the whole scene, shared with the rooms and the mirrors
+layout(set = 0, binding = 0) uniform UniformBufferObject {
+	mat4 mvpMat;
+	mat4 mMat;
+	mat4 nMat;
+} ubo;
+
+// One entry per sphere, same layout as SphereInstance in main.cpp
+struct SphereInstance {
+	mat4 mMat;
+	mat4 nMat;
+	int material;
+	int textureLayer;
+};
+layout(std430, set = 2, binding = 0) readonly buffer Instances {
+	SphereInstance instances[];
+};
+
+// All the spheres are drawn by a single instanced call: gl_InstanceIndex selects the
+// transform of the sphere, the Fragment Shader reads its material with the same index
+void main() {
+	SphereInstance inst = instances[gl_InstanceIndex];
+	gl_Position = ubo.mvpMat * inst.mMat * vec4(inPosition, 1.0);
+	fragPos = (ubo.mMat * inst.mMat * vec4(inPosition, 1.0)).xyz;
+	fragNorm = (ubo.nMat * inst.nMat * vec4(inNorm, 0.0)).xyz;
+	fragUV = inUV;
+	fragInstance = gl_InstanceIndex;
+}